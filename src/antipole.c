@@ -20,37 +20,81 @@
 
 #include <assert.h>  /* assert */
 #include <math.h>    /* fmax */
+#include <stddef.h>  /* size_t */
 #include <stdio.h>   /* printf */
 #include <stdlib.h>  /* NULL, rand */
+#include <time.h>    /* clock */
 #include "antipole.h"
+#include "trace.h"
 
 #define min(a,b) ((a) < (b) ? (a) : (b))
 #define max(a,b) ((a) > (b) ? (a) : (b))
 
+static __thread double (*tuning_dist)( ap_Point *p1, ap_Point *p2 ) = NULL;  /* distance function counted by counting_dist */
+static __thread long tuning_dist_count = 0;   /* number of distances calculated by counting_dist */
+
+static double counting_dist( ap_Point *p1, ap_Point *p2 );
+
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * *
                TREE CONSTRUCTION FUNCTIONS
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
 
-// Create an ap_Tree that serves as the root, an internal
-// node, or a leaf for the tree data structure. Non-leaves
-// contain the identities of two antipole points, a left
-// subtree and a right subtree which each contain the
-// subset of points that is nearest its respective antipole
-// point, and the radii of the subsets. Leaves contain a
-// cluster of points.
+// Create an ap_Tree that serves as the root of the tree
+// data structure. All memory belonging to the tree,
+// including the ancestor lists of the points in the set, is
+// taken from an arena owned by the root, so that the tree
+// can be freed at once by free_tree. The ancestor lists are
+// therefore only valid until the tree is freed. If
+// antipole_a and antipole_b are given, they are used as the
+// antipoles of the root.
 ap_Tree*
 build_tree( ap_PointList *set, double target_radius, ap_Point *antipole_a, ap_Point *antipole_b, int dimensionality, DIST_FUNC ) {
 
+   ap_PointList *index;
+   double start = trace_begin();
+   ap_Arena *arena = create_arena( ARENA_BLOCK_SIZE );
+   ap_Arena *scratch = create_arena( ARENA_BLOCK_SIZE );
+
+   // Forget the ancestors from any tree the points belonged to
+   // before
+   for( index = set; index != NULL; index = index->next )
+      index->p->ancestors = NULL;
+   if( antipole_a != NULL )
+      antipole_a->ancestors = NULL;
+   if( antipole_b != NULL )
+      antipole_b->ancestors = NULL;
+
+   ap_Tree *new_tree = build_subtree( set, target_radius, antipole_a, antipole_b, dimensionality, arena, scratch, dist );
+   new_tree->arena = arena;
+
+   free_arena( scratch );
+   trace_end( "build", "build_tree", start );
+
+   return new_tree;
+}
+
+
+// Create an ap_Tree that serves as an internal node or a
+// leaf for the tree data structure. Non-leaves contain the
+// identities of two antipole points, a left subtree and a
+// right subtree which each contain the subset of points
+// that is nearest its respective antipole point, and the
+// radii of the subsets. Leaves contain a cluster of points.
+// The tree is allocated from arena, and temporary lists are
+// allocated from scratch and released before returning.
+ap_Tree*
+build_subtree( ap_PointList *set, double target_radius, ap_Point *antipole_a, ap_Point *antipole_b, int dimensionality, ap_Arena *arena, ap_Arena *scratch, DIST_FUNC ) {
+
 #ifdef DEBUG
    static int depth = -1;
    depth++;
 #endif
 
    // Create the new ap_Tree
-   ap_Tree *new_tree = malloc( sizeof( ap_Tree ) );
-   assert( new_tree );
+   ap_Tree *new_tree = arena_alloc( arena, sizeof( ap_Tree ) );
+   new_tree->arena = NULL;
 
 #ifdef DEBUG
    if( depth == 0 )
@@ -60,12 +104,16 @@ build_tree( ap_PointList *set, double target_radius, ap_Point *antipole_a, ap_Po
 
    // Determine if this tree is an internal node or a leaf
    if( antipole_a == NULL || antipole_b == NULL ) {
+      double start = trace_begin();
       first_approx_antipoles( set, &antipole_a, &antipole_b, target_radius, dist );
+      trace_end( "build", "first_approx_antipoles", start );
       if( antipole_a == NULL || antipole_b == NULL ) {
          // If it is a leaf, create a cluster from the set and return
          // the leaf
          new_tree->is_leaf = true;
-         new_tree->cluster = build_cluster( set, dimensionality, dist );
+         start = trace_begin();
+         new_tree->cluster = build_cluster( set, dimensionality, arena, scratch, dist );
+         trace_end( "build", "build_cluster", start );
 #ifdef DEBUG
          depth--;
 #endif
@@ -73,12 +121,22 @@ build_tree( ap_PointList *set, double target_radius, ap_Point *antipole_a, ap_Po
       }
    }
 
-   // If this tree is an internal node, initialize it
+   // If this tree is an internal node, initialize it. An
+   // antipole that is already its own ancestor was an
+   // antipole of an ancestor node too, so searches need not
+   // consider it again here, and every point in the set
+   // already has its distance to it.
    new_tree->is_leaf = false;
    new_tree->a = antipole_a;
    new_tree->b = antipole_b;
    new_tree->radius_a = 0;
    new_tree->radius_b = 0;
+   new_tree->try_a = !list_contains( antipole_a->ancestors, antipole_a );
+   new_tree->try_b = !list_contains( antipole_b->ancestors, antipole_b );
+
+   // Everything allocated from scratch below this point is
+   // released once both subtrees are built
+   ap_ArenaMark mark = arena_mark( scratch );
 
    // For each point in the set, find the distance to each
    // antipole, store the distances in the point's ancestor
@@ -87,27 +145,31 @@ build_tree( ap_PointList *set, double target_radius, ap_Point *antipole_a, ap_Po
    // necessary
    double dist_a, dist_b;
    ap_PointList *set_a = NULL, *set_b = NULL;
+   double start = trace_begin();
    while( set != NULL ) {
       dist_a = dist( new_tree->a, set->p );
       dist_b = dist( new_tree->b, set->p );
-      add_point( &(set->p->ancestors), new_tree->a, dist_a );
-      add_point( &(set->p->ancestors), new_tree->b, dist_b );
+      if( new_tree->try_a )
+         prepend_point( &(set->p->ancestors), new_tree->a, dist_a, arena );
+      if( new_tree->try_b )
+         prepend_point( &(set->p->ancestors), new_tree->b, dist_b, arena );
       if( dist_a < dist_b ) {
-         add_point( &set_a, set->p, dist_a );
+         prepend_point( &set_a, set->p, dist_a, scratch );
          new_tree->radius_a = fmax( dist_a, new_tree->radius_a );
       } else {
-         add_point( &set_b, set->p, dist_b );
+         prepend_point( &set_b, set->p, dist_b, scratch );
          new_tree->radius_b = fmax( dist_b, new_tree->radius_b );
       }
       set = set->next;
    }
+   trace_end( "build", "partition", start );
 
    // Build subtrees as children for this node using the two
    // point subsets
    check_ancestors_for_antipoles( set_a, target_radius, new_tree->a, &antipole_a, &antipole_b );
-   new_tree->left = build_tree( set_a, target_radius, antipole_a, antipole_b, dimensionality, dist );
+   new_tree->left = build_subtree( set_a, target_radius, antipole_a, antipole_b, dimensionality, arena, scratch, dist );
    check_ancestors_for_antipoles( set_b, target_radius, new_tree->b, &antipole_a, &antipole_b );
-   new_tree->right = build_tree( set_b, target_radius, antipole_a, antipole_b, dimensionality, dist );
+   new_tree->right = build_subtree( set_b, target_radius, antipole_a, antipole_b, dimensionality, arena, scratch, dist );
 
 #ifdef DEBUG
    printf("{%ld->%ld,%d},", (long)new_tree, (long)new_tree->left, new_tree->a->id);
@@ -118,80 +180,317 @@ build_tree( ap_PointList *set, double target_radius, ap_Point *antipole_a, ap_Po
    depth--;
 #endif
 
-   free_list( set_a );
-   free_list( set_b );
+   arena_release( scratch, mark );
 
    return new_tree;
 }
 
 
 // Create an ap_Cluster owned by a leaf of the tree data
-// structure containing a list of the points in the cluster
-// (already determined to be sufficiently close to one
-// another to group together), the identity of the geometric
-// median of the cluster, and the cluster radius.
+// structure containing an array of the points in the
+// cluster (already determined to be sufficiently close to
+// one another to group together), the identity of the
+// geometric median of the cluster, and the cluster radius.
+// Members that were antipoles of an ancestor node are
+// placed at the end of the array. The cluster is allocated
+// from arena, or with malloc if arena is NULL, in which case
+// it must be freed with free_cluster.
 ap_Cluster*
-build_cluster( ap_PointList *set, int dimensionality, DIST_FUNC ) {
+build_cluster( ap_PointList *set, int dimensionality, ap_Arena *arena, ap_Arena *scratch, DIST_FUNC ) {
 
+   int i, j;
    double dist_centroid;
 
    // Create the new ap_Cluster and initialize it
-   ap_Cluster *new_cluster = malloc( sizeof( ap_Cluster ) );
-   assert( new_cluster );
-   approx_1_median( set, &(new_cluster->centroid), dimensionality, dist );
+   ap_Cluster *new_cluster = arena_alloc( arena, sizeof( ap_Cluster ) );
+   double start = trace_begin();
+   approx_1_median( set, &(new_cluster->centroid), dimensionality, scratch, dist );
+   trace_end( "build", "approx_1_median", start );
+   new_cluster->centroid_is_antipole = list_contains( new_cluster->centroid->ancestors, new_cluster->centroid );
    new_cluster->radius = 0;
-   new_cluster->members = NULL;
+   new_cluster->size = list_size( set ) - 1;
+   new_cluster->n_antipoles = 0;
+   new_cluster->members = arena_alloc( arena, max( new_cluster->size, 1 ) * sizeof( ap_Point* ) );
+   new_cluster->dists = arena_alloc( arena, max( new_cluster->size, 1 ) * sizeof( double ) );
 
    // For every point in the set (besides the centroid), find
-   // the distance to the centroid, add the point to the list
-   // of points in the cluster, and update the radius of the
-   // cluster if necessary
-   while( set != NULL ) {
+   // the distance to the centroid, add the point to the array
+   // of points in the cluster, filling antipoles in from the
+   // end, and update the radius of the cluster if necessary
+   for( i = 0, j = new_cluster->size - 1; set != NULL; set = set->next ) {
       if( set->p != new_cluster->centroid ) {
          dist_centroid = dist( new_cluster->centroid, set->p );
-         add_point( &(new_cluster->members), set->p, dist_centroid );
+         if( list_contains( set->p->ancestors, set->p ) ) {
+            new_cluster->members[j] = set->p;
+            new_cluster->dists[j] = dist_centroid;
+            new_cluster->n_antipoles++;
+            j--;
+         } else {
+            new_cluster->members[i] = set->p;
+            new_cluster->dists[i] = dist_centroid;
+            i++;
+         }
          new_cluster->radius = fmax( new_cluster->radius, dist_centroid );
       }
-      set = set->next;
    }
+   assert( i == j + 1 );
 
    return new_cluster;
 }
 
 
+// Create an ap_Index over a set of points. If type is
+// INDEX_AUTO, both an antipole tree and a flat scan are
+// timed on a small sample of queries drawn from the set,
+// and whichever answers them faster is kept. Small sets are
+// often searched faster by the flat scan, since it avoids
+// the overhead of traversing the tree.
+ap_Index*
+build_index( ap_PointList *set, double target_radius, ap_IndexType type, int dimensionality, DIST_FUNC ) {
+
+   int i, n_sample, rounds;
+   clock_t start, tree_time, flat_time;
+   ap_PointList *results, *index_set = set;
+
+   // Create the new ap_Index and copy the points into an
+   // array
+   ap_Index *new_index = malloc( sizeof( ap_Index ) );
+   assert( new_index );
+   new_index->size = list_size( set );
+   new_index->points = malloc( max( new_index->size, 1 ) * sizeof( ap_Point* ) );
+   assert( new_index->points );
+   for( i = 0; set != NULL; i++, set = set->next )
+      new_index->points[i] = set->p;
+   new_index->tree = NULL;
+   new_index->target_radius = target_radius;
+
+   // A flat index needs nothing more than the array of points
+   if( type == INDEX_FLAT || new_index->size == 0 ) {
+      new_index->type = INDEX_FLAT;
+      return new_index;
+   }
+
+   // Build the tree
+   new_index->tree = build_tree( index_set, target_radius, NULL, NULL, dimensionality, dist );
+   new_index->type = INDEX_TREE;
+
+   if( type == INDEX_TREE )
+      return new_index;
+
+   // Calibrate by timing a sample of queries spread evenly
+   // through the set against both search methods, repeating
+   // the sample until each measurement is long enough to be
+   // meaningful
+   n_sample = min( CALIBRATION_QUERIES, new_index->size );
+   tree_time = flat_time = 0;
+   double calibration_start = trace_begin();
+   for( rounds = 0; tree_time + flat_time < CLOCKS_PER_SEC / 100 && rounds < 1000; rounds++ ) {
+      start = clock();
+      for( i = 0; i < n_sample; i++ ) {
+         nearest_neighbor_search( new_index->tree, new_index->points[i * new_index->size / n_sample], CALIBRATION_K, &results, dist );
+         free_list( results );
+      }
+      tree_time += clock() - start;
+
+      start = clock();
+      for( i = 0; i < n_sample; i++ ) {
+         flat_nearest_neighbor_search( new_index->points, new_index->size, new_index->points[i * new_index->size / n_sample], CALIBRATION_K, &results, dist );
+         free_list( results );
+      }
+      flat_time += clock() - start;
+   }
+   trace_end( "build", "calibrate_index", calibration_start );
+
+   // Keep the tree only if it won
+   if( flat_time < tree_time ) {
+      free_tree( new_index->tree );
+      new_index->tree = NULL;
+      new_index->type = INDEX_FLAT;
+   }
+
+   return new_index;
+}
+
+
+// Choose a target_radius for build_tree by trying a range
+// of candidates on the set and timing a workload of n_query
+// queries for k neighbors each against every trial tree. If
+// queries is NULL, TUNE_QUERIES points spread evenly through
+// the set serve as the workload. The candidates are halvings
+// of the median distance between sampled pairs of points,
+// which gives the scale of the data. A tree whose arena
+// reserves more than memory_budget bytes is never chosen,
+// unless memory_budget is 0; if no tree fits, the largest
+// candidate, which builds the smallest tree, is returned.
+// If trials is not NULL, the measurements for each of the
+// TUNE_STEPS candidates are stored in it. Building the trial
+// trees overwrites the ancestor lists of the points in the
+// set, so a tree built on the set before tuning must be
+// rebuilt afterward.
+double
+tune_target_radius( ap_PointList *set, ap_Point **queries, int n_query, int k, size_t memory_budget, int dimensionality, ap_RadiusTrial *trials, DIST_FUNC ) {
+
+   int i, step, rounds, size = list_size( set );
+   long start_count;
+   bool own_queries = queries == NULL;
+   clock_t start, elapsed;
+   double scale, radius, best_radius = -1, best_time = INFINITY;
+   double sample[TUNE_PAIRS];
+   ap_RadiusTrial trial;
+   ap_PointList *index, *results;
+
+   if( size < 2 )
+      return 0;
+
+   // Collect the points into an array
+   ap_Point **points = malloc( size * sizeof( ap_Point* ) );
+   assert( points );
+   for( i = 0, index = set; index != NULL; i++, index = index->next )
+      points[i] = index->p;
+
+   // Estimate the scale of the data from the median distance
+   // between pairs of points
+   for( i = 0; i < TUNE_PAIRS; i++ )
+      sample[i] = dist( points[(long)i * size / TUNE_PAIRS], points[( (long)i * size / TUNE_PAIRS + size / 2 + i ) % size] );
+   qsort( sample, TUNE_PAIRS, sizeof( double ), compare_doubles );
+   scale = sample[TUNE_PAIRS/2];
+
+   // Use points from the set as the workload if none is given
+   if( own_queries ) {
+      n_query = min( TUNE_QUERIES, size );
+      queries = malloc( n_query * sizeof( ap_Point* ) );
+      assert( queries );
+      for( i = 0; i < n_query; i++ )
+         queries[i] = points[(long)i * size / n_query];
+   }
+
+   tuning_dist = dist;
+   for( step = 0; step < TUNE_STEPS; step++ ) {
+      radius = scale * ldexp( 1, -( step + 1 ) );
+      ap_Tree *tree = build_tree( set, radius, NULL, NULL, dimensionality, dist );
+
+      // Time the workload, repeating it until the measurement
+      // is long enough to be meaningful, and count the distance
+      // calculations of one pass
+      start_count = tuning_dist_count;
+      for( i = 0; i < n_query; i++ ) {
+         nearest_neighbor_search( tree, queries[i], k, &results, counting_dist );
+         free_list( results );
+      }
+      trial.dists_per_query = n_query > 0 ? (double)( tuning_dist_count - start_count ) / n_query : 0;
+      elapsed = 0;
+      for( rounds = 0; elapsed < CLOCKS_PER_SEC / 100 && rounds < 1000; rounds++ ) {
+         start = clock();
+         for( i = 0; i < n_query; i++ ) {
+            nearest_neighbor_search( tree, queries[i], k, &results, dist );
+            free_list( results );
+         }
+         elapsed += clock() - start;
+      }
+
+      trial.target_radius = radius;
+      trial.memory = tree->arena->reserved;
+      trial.seconds_per_query = n_query > 0 ? (double)elapsed / CLOCKS_PER_SEC / rounds / n_query : 0;
+      trial.within_budget = memory_budget == 0 || trial.memory <= memory_budget;
+      if( trials != NULL )
+         trials[step] = trial;
+      if( trial.within_budget && trial.seconds_per_query < best_time ) {
+         best_time = trial.seconds_per_query;
+         best_radius = radius;
+      }
+
+      free_tree( tree );
+   }
+
+   if( own_queries )
+      free( queries );
+   free( points );
+
+   return best_radius >= 0 ? best_radius : scale / 2;
+}
+
+
+// Calculate the distance between two points with
+// tuning_dist and count the calculation in
+// tuning_dist_count, both private to the calling thread, so
+// that several threads can tune at once. Used by
+// tune_target_radius.
+static double
+counting_dist( ap_Point *p1, ap_Point *p2 ) {
+
+   tuning_dist_count++;
+   return tuning_dist( p1, p2 );
+}
+
+
+// Compare two doubles for sorting in ascending order
+int
+compare_doubles( const void *a, const void *b ) {
+
+   double x = *(const double*)a, y = *(const double*)b;
+   return ( x > y ) - ( x < y );
+}
+
+
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * *
                      SEARCH FUNCTIONS
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
 
-// Search the tree recursively to find all points within
-// range of query and place them in out.
+// Search the tree to find all points within range of query
+// and append them to out.
 void
-range_search( ap_Tree *tree, ap_Point *query, double range, ap_PointList **out, DIST_FUNC ) {
+range_search( ap_Tree *tree, ap_Point *query, double range, ap_NeighborArray *out, DIST_FUNC ) {
+
+   range_search_visit( tree, query, range, out, neighbor_array_visit, NULL, dist );
+}
+
+
+// Search the tree recursively to find all points within
+// range of query, calling visit with each one and data, and
+// return the number found. Points ruled in by the triangle
+// inequality are visited with a distance of -1. If visit is
+// NULL, the points are only counted. If proxy is not NULL,
+// it must never exceed dist, and it is tried first so that
+// dist is only calculated where the proxy cannot rule a
+// point or subtree out.
+int
+range_search_visit( ap_Tree *tree, ap_Point *query, double range, void *data, VISIT_FUNC, PROXY_FUNC, DIST_FUNC ) {
+
+   int count = 0;
 
    if( !tree->is_leaf ) {
       // Calculate the distance between query and the antipoles
-      // and store these values in the ancestor list for query
-      double dist_a = dist( tree->a, query );
-      double dist_b = dist( tree->b, query );
+      // and store these values in the ancestor list for query,
+      // unless the proxy shows that neither the antipole nor its
+      // subtree can be within range
+      double dist_a = proxy == NULL || proxy( tree->a, query ) <= range + tree->radius_a ? dist( tree->a, query ) : INFINITY;
+      double dist_b = proxy == NULL || proxy( tree->b, query ) <= range + tree->radius_b ? dist( tree->b, query ) : INFINITY;
       /*
       int a_added = add_point( &(query->ancestors), tree->a, dist_a );
       int b_added = add_point( &(query->ancestors), tree->b, dist_b );
       */
 
-      // If either antipole is within range, add it to out
-      if( dist_a <= range )
-         add_point( out, tree->a, dist_a );
-      if( dist_b <= range )
-         add_point( out, tree->b, dist_b );
+      // If either antipole is within range, visit it, unless it
+      // was already checked by an ancestor
+      if( tree->try_a && dist_a <= range ) {
+         if( visit != NULL )
+            visit( tree->a, dist_a, data );
+         count++;
+      }
+      if( tree->try_b && dist_b <= range ) {
+         if( visit != NULL )
+            visit( tree->b, dist_b, data );
+         count++;
+      }
 
       // Use the triangle inequality to determine if each subtree
       // is within range of the query, and descend those subtrees
       // that are
       if( dist_a <= range + tree->radius_a )
-         range_search( tree->left, query, range, out, dist );
+         count += range_search_visit( tree->left, query, range, data, visit, proxy, dist );
       if( dist_b <= range + tree->radius_b )
-         range_search( tree->right, query, range, out, dist );
+         count += range_search_visit( tree->right, query, range, data, visit, proxy, dist );
 
       /*
       // Once the search has returned from both subtrees, remove
@@ -208,65 +507,93 @@ range_search( ap_Tree *tree, ap_Point *query, double range, ap_PointList **out,
    } else {
       // If tree is a leaf, search its cluster for points within
       // range of query
-      range_search_cluster( tree->cluster, query, range, out, dist );
+      count = range_search_cluster_visit( tree->cluster, query, range, data, visit, proxy, dist );
    }
+
+   return count;
 }
 
 
 // Find all members of the cluster that are within range of
-// query and place them in out.
-void
-range_search_cluster( ap_Cluster *cluster, ap_Point *query, double range, ap_PointList **out, DIST_FUNC ) {
+// query, calling visit with each one and data, and return
+// the number found. If visit is NULL, the points are only
+// counted. Points that were antipoles of an ancestor of the
+// cluster's leaf have already been checked and are skipped.
+// If proxy is not NULL, it is tried before each distance.
+int
+range_search_cluster_visit( ap_Cluster *cluster, ap_Point *query, double range, void *data, VISIT_FUNC, PROXY_FUNC, DIST_FUNC ) {
+
+   int count = 0, n_members = cluster->size - cluster->n_antipoles;
 
    // Calculate the distance between the query and the centroid
-   // and add it to out if it is within range
-   double d, dist_centroid = dist( cluster->centroid, query );
-   if( dist_centroid <= range )
-      add_point( out, cluster->centroid, dist_centroid );
+   // and visit it if it is within range, unless the proxy shows
+   // that no part of the cluster can be within range
+   double d, dist_centroid = proxy == NULL || proxy( cluster->centroid, query ) <= range + cluster->radius ? dist( cluster->centroid, query ) : INFINITY;
+   if( !cluster->centroid_is_antipole && dist_centroid <= range ) {
+      if( visit != NULL )
+         visit( cluster->centroid, dist_centroid, data );
+      count++;
+   }
 
    // Use the triangle inequality with the cluster radius to
    // determine if the entire cluster can be excluded as a
    // group
    if( dist_centroid > range + cluster->radius )
-      return;
+      return count;
 
    // Use the triangle inequality with the cluster radius to
    // determine if the entire cluster can be included as a
    // group
+   int i;
    if( dist_centroid <= range - cluster->radius ) {
-      ap_PointList *index = cluster->members;
-      while( index != NULL ) {
-         add_point( out, index->p, -1 );
-         index = index->next;
+      if( visit != NULL )
+         for( i = 0; i < n_members; i++ )
+            visit( cluster->members[i], -1, data );
+      return count + n_members;
+   }
+
+   // If the cluster is small, calculate the distance to every
+   // member in one pass rather than checking bounds first
+   if( n_members < LEAF_SCAN_SIZE ) {
+      double dists[LEAF_SCAN_SIZE];
+      for( i = 0; i < n_members; i++ )
+         dists[i] = proxy == NULL || proxy( cluster->members[i], query ) <= range ? dist( cluster->members[i], query ) : INFINITY;
+      for( i = 0; i < n_members; i++ ) {
+         if( dists[i] <= range ) {
+            if( visit != NULL )
+               visit( cluster->members[i], dists[i], data );
+            count++;
+         }
       }
-      return;
+      return count;
    }
 
    // Check each member of the cluster
-   ap_PointList *index = cluster->members;
    /*
    ap_PointList *query_ancestors, *cluster_ancestors;
    */
-   while( index != NULL ) {
+   for( i = 0; i < n_members; i++ ) {
       // Use the triangle inequality with the cluster member's
       // distance to centroid to determine if the point is
       // definitely out of range
-      if( dist_centroid > range + index->dist )
-         goto next_cluster_member;
+      if( dist_centroid > range + cluster->dists[i] )
+         continue;
 
       // Use the triangle inequality with the cluster member's
       // distance to centroid to determine if the point is
       // definitely within range
-      if( dist_centroid <= range - index->dist ) {
-         add_point( out, index->p, -1 );
-         goto next_cluster_member;
+      if( dist_centroid <= range - cluster->dists[i] ) {
+         if( visit != NULL )
+            visit( cluster->members[i], -1, data );
+         count++;
+         continue;
       }
 
       /*
       // Check the ancestors of the query and the member of the
       // cluster
       query_ancestors = query->ancestors;
-      cluster_ancestors = index->p->ancestors;
+      cluster_ancestors = cluster->members[i]->ancestors;
       while( query_ancestors != NULL ) {
          assert( query_ancestors->p == cluster_ancestors->p );
 
@@ -280,7 +607,7 @@ range_search_cluster( ap_Cluster *cluster, ap_Point *query, double range, ap_Poi
          // distance to ancestor to determine if the point is
          // definitely within range
          if( query_ancestors->dist <= range - cluster_ancestors->dist ) {
-            add_point( out, index->p, -1 );
+            add_point( out, cluster->members[i], -1 );
             goto next_cluster_member;
          }
 
@@ -289,40 +616,62 @@ range_search_cluster( ap_Cluster *cluster, ap_Point *query, double range, ap_Poi
       }
       */
 
+      // Use the proxy to determine if the point is definitely
+      // out of range
+      if( proxy != NULL && proxy( cluster->members[i], query ) > range )
+         continue;
+
       // Finally, if all methods of using precalculated distances
       // to rule-out or rule-in the cluster member have failed,
       // calculate the distance between the query and the cluster
-      // member and add it to out if it is within range
-      d = dist( index->p, query );
-      if( d <= range )
-         add_point( out, index->p, d );
-
-next_cluster_member:
-      index = index->next;
+      // member and visit it if it is within range
+      d = dist( cluster->members[i], query );
+      if( d <= range ) {
+         if( visit != NULL )
+            visit( cluster->members[i], d, data );
+         count++;
+      }
    }
+
+   return count;
 }
 
 
-// Search the tree using a priority queue for the subtrees
-// to find the k points nearest the query and place them in
-// out.
+// Search the tree to find the k points nearest the query
+// and place them in out.
 void
 nearest_neighbor_search( ap_Tree *tree, ap_Point *query, int k, ap_PointList **out, DIST_FUNC ) {
 
+   nearest_neighbor_search_within( tree, query, k, INFINITY, out, NULL, dist );
+}
+
+
+// Search the tree using a priority queue for the subtrees
+// to find up to k points nearest the query that are within
+// range of it, and place them in out sorted by distance.
+// Subtrees are pruned by whichever is smaller of range and
+// the distance to the kth nearest point found so far. If
+// proxy is not NULL, it must never exceed dist, and it is
+// tried first so that dist is only calculated where the
+// proxy cannot rule a point or subtree out; the results are
+// the same as without it.
+void
+nearest_neighbor_search_within( ap_Tree *tree, ap_Point *query, int k, double range, ap_PointList **out, PROXY_FUNC, DIST_FUNC ) {
+
    double dist_a, dist_b;
    ap_Tree *index;
 
-   // Create the tree priority queue as a min-heap with no
-   // maximum size
-   ap_Heap *tree_pq = create_heap( false, 0 );
+   // Create the tree priority queue
+   ap_TreeQueue *tree_pq = create_tree_queue();
 
-   // Create the point priority queue as a max-heap with a
-   // maximum size k
-   ap_Heap *point_pq = create_heap( true, k );
+   // Create the point priority queue with a maximum size k,
+   // accepting only points within range
+   ap_PointQueue *point_pq = create_point_queue( k );
+   point_queue_limit( point_pq, range );
 
    // Initialize the tree priority queue with the root of the
    // tree
-   heap_insert( tree_pq, tree, -1 );
+   tree_queue_insert( tree_pq, tree, -1 );
 
    // Search through the subtrees in order of proximity to the
    // query until there are no more subtrees to search or the
@@ -333,109 +682,137 @@ nearest_neighbor_search( ap_Tree *tree, ap_Point *query, int k, ap_PointList **o
       // If point_pq already has k points and the next nearest
       // subtree is not nearer than the farthest member of
       // point_pq, then stop searching
-      if( heap_is_full( point_pq ) && tree_pq->dists[0] >= point_pq->dists[0] )
+      if( tree_pq->items[0].dist >= point_pq->bound )
          break;
 
       // Get the next subtree in the tree priority queue
-      index = (ap_Tree*)heap_pop( tree_pq );
+      index = tree_queue_pop( tree_pq );
 
       if( !index->is_leaf ) {
          // Calculate the distance between query and the antipoles
-         // and store these values in the ancestor list for query
-         dist_a = dist( index->a, query );
-         dist_b = dist( index->b, query );
+         // and store these values in the ancestor list for query,
+         // unless the proxy shows that neither the antipole nor its
+         // subtree can be nearer than the farthest member of
+         // point_pq
+         dist_a = proxy == NULL || proxy( index->a, query ) - index->radius_a < point_pq->bound ? dist( index->a, query ) : INFINITY;
+         dist_b = proxy == NULL || proxy( index->b, query ) - index->radius_b < point_pq->bound ? dist( index->b, query ) : INFINITY;
          /*
          add_point( &(query->ancestors), index->a, dist_a );
          add_point( &(query->ancestors), index->b, dist_b );
          */
 
          // If either antipole is nearer to the query than the point
-         // priority queue's farthest member, add it to point_pq
-         nearest_neighbor_search_try_point( point_pq, index->a, dist_a );
-         nearest_neighbor_search_try_point( point_pq, index->b, dist_b );
-
-         // Add the subtree's children to the tree priority queue
-         heap_insert( tree_pq, index->left,  dist_a - index->radius_a );
-         heap_insert( tree_pq, index->right, dist_b - index->radius_b );
+         // priority queue's farthest member, add it to point_pq,
+         // unless it was already offered by an ancestor
+         if( index->try_a )
+            point_queue_insert( point_pq, index->a, dist_a );
+         if( index->try_b )
+            point_queue_insert( point_pq, index->b, dist_b );
+
+         // Add the subtree's children to the tree priority queue if
+         // they could contain a point nearer than the farthest
+         // member of point_pq
+         if( dist_a - index->radius_a < point_pq->bound )
+            tree_queue_insert( tree_pq, index->left,  dist_a - index->radius_a );
+         if( dist_b - index->radius_b < point_pq->bound )
+            tree_queue_insert( tree_pq, index->right, dist_b - index->radius_b );
       } else {
 
          // If tree is a leaf, search its cluster for points that
          // should be added to the point priority queue
-         nearest_neighbor_search_cluster( index->cluster, query, point_pq, dist );
+         nearest_neighbor_search_cluster( index->cluster, query, point_pq, false, proxy, dist );
       }
    }
 
    // Convert the point priority queue into an ap_PointList
    // and store it in out
-   *out = heap_to_list( point_pq );
+   *out = point_queue_to_list( point_pq );
 
    // Free up the memory used by the tree and point priority
    // queues
-   free_heap( tree_pq );
-   free_heap( point_pq );
+   free_tree_queue( tree_pq );
+   free_point_queue( point_pq );
 }
 
 
 // Find any members of the cluster that are nearer to the
 // query than any of the k points already found in the point
-// priority queue and place them in point_pq.
+// priority queue and place them in point_pq. Points that
+// were antipoles of an ancestor of the cluster's leaf have
+// already been offered to point_pq during a normal search
+// and are skipped unless include_antipoles is true.
 void
-nearest_neighbor_search_cluster( ap_Cluster *cluster, ap_Point *query, ap_Heap *point_pq, DIST_FUNC ) {
+nearest_neighbor_search_cluster( ap_Cluster *cluster, ap_Point *query, ap_PointQueue *point_pq, bool include_antipoles, PROXY_FUNC, DIST_FUNC ) {
+
+   int n_members = include_antipoles ? cluster->size : cluster->size - cluster->n_antipoles;
 
    // Calculate the distance between the query and the centroid
    // and add it to point_pq if it is nearer than the queue's
-   // farthest member
-   double d, dist_centroid = dist( cluster->centroid, query );
-   nearest_neighbor_search_try_point( point_pq, cluster->centroid, dist_centroid );
+   // farthest member, unless the proxy shows that no part of
+   // the cluster can be
+   double d, dist_centroid = proxy == NULL || proxy( cluster->centroid, query ) - cluster->radius < point_pq->bound ? dist( cluster->centroid, query ) : INFINITY;
+   if( include_antipoles || !cluster->centroid_is_antipole )
+      point_queue_insert( point_pq, cluster->centroid, dist_centroid );
 
    // Use the triangle inequality with the cluster radius to
    // determine if the entire cluster can be excluded as a
    // group
-   if( heap_is_full( point_pq ) && dist_centroid >= point_pq->dists[0] + cluster->radius )
+   if( dist_centroid >= point_pq->bound + cluster->radius )
+      return;
+
+   // If the cluster is small, calculate the distance to every
+   // member in one pass rather than checking bounds first
+   int i;
+   if( n_members < LEAF_SCAN_SIZE ) {
+      double dists[LEAF_SCAN_SIZE];
+      for( i = 0; i < n_members; i++ )
+         dists[i] = proxy == NULL || proxy( cluster->members[i], query ) < point_pq->bound ? dist( cluster->members[i], query ) : INFINITY;
+      for( i = 0; i < n_members; i++ )
+         point_queue_insert( point_pq, cluster->members[i], dists[i] );
       return;
+   }
 
    // Check each member of the cluster
-   ap_PointList *index = cluster->members;
    /*
    ap_PointList *query_ancestors, *cluster_ancestors;
    */
-   while( index != NULL ) {
+   for( i = 0; i < n_members; i++ ) {
       // Use the triangle inequality with the cluster member's
       // distance to centroid to determine if the point is
       // definitely farther away than the farthest member of
       // point_pq
-      if( heap_is_full( point_pq ) && dist_centroid > point_pq->dists[0] + index->dist )
-         goto next_cluster_member;
+      if( dist_centroid > point_pq->bound + cluster->dists[i] )
+         continue;
 
       // Use the triangle inequality with the cluster member's
       // distance to centroid to determine if the point is
       // definitely nearer than the farthest member of point_pq
-      if( dist_centroid <= point_pq->dists[0] - index->dist ) {
-         d = dist( index->p, query );
-         nearest_neighbor_search_try_point( point_pq, index->p, d );
-         goto next_cluster_member;
+      if( dist_centroid <= point_pq->bound - cluster->dists[i] ) {
+         d = dist( cluster->members[i], query );
+         point_queue_insert( point_pq, cluster->members[i], d );
+         continue;
       }
 
       /*
       // Check the ancestors of the query and the member of the
       // cluster
       for( query_ancestors = query->ancestors; query_ancestors != NULL; query_ancestors = query_ancestors->next ) {
-         for( cluster_ancestors = index->p->ancestors; cluster_ancestors != NULL; cluster_ancestors = cluster_ancestors->next ) {
+         for( cluster_ancestors = cluster->members[i]->ancestors; cluster_ancestors != NULL; cluster_ancestors = cluster_ancestors->next ) {
             if( query_ancestors->p == cluster_ancestors->p ) {
 
                // Use the triangle inequality with the cluster member's
                // distance to ancestor to determine if the point is
                // definitely farther away than the farthest member of
                // point_pq
-               if( heap_is_full( point_pq ) && query_ancestors->dist > point_pq->dists[0] + cluster_ancestors->dist )
+               if( query_ancestors->dist > point_pq->bound + cluster_ancestors->dist )
                   goto next_cluster_member;
 
                // Use the triangle inequality with the cluster member's
                // distance to ancestor to determine if the point is
                // definitely nearer than the farthest member of point_pq
-               if( query_ancestors->dist <= point_pq->dists[0] - cluster_ancestors->dist ) {
-                  d = dist( index->p, query );
-                  nearest_neighbor_search_try_point( point_pq, index->p, d );
+               if( query_ancestors->dist <= point_pq->bound - cluster_ancestors->dist ) {
+                  d = dist( cluster->members[i], query );
+                  point_queue_insert( point_pq, cluster->members[i], d );
                   goto next_cluster_member;
                }
             }
@@ -443,56 +820,882 @@ nearest_neighbor_search_cluster( ap_Cluster *cluster, ap_Point *query, ap_Heap *
       }
       */
 
+      // Use the proxy to determine if the point is definitely
+      // farther away than the farthest member of point_pq
+      if( proxy != NULL && proxy( cluster->members[i], query ) >= point_pq->bound )
+         continue;
+
       // Finally, if all methods of using precalculated distances
       // to rule-out or rule-in the cluster member have failed,
       // calculate the distance between the query and the cluster
       // member and add it to point_pq if it is nearer than the
       // queue's farthest member
-      d = dist( index->p, query );
-      nearest_neighbor_search_try_point( point_pq, index->p, d );
+      d = dist( cluster->members[i], query );
+      point_queue_insert( point_pq, cluster->members[i], d );
+   }
+}
 
-next_cluster_member:
-      index = index->next;
+
+// Search the tree for the k points nearest each of n_query
+// queries and place them in out[0..n_query-1]. Rather than
+// walking the tree once per query, all queries descend the
+// tree together, so that each antipole and each cluster is
+// loaded once and compared against every query routed to
+// it. The results are identical to calling
+// nearest_neighbor_search for each query.
+void
+nearest_neighbor_search_batch( ap_Tree *tree, ap_Point **queries, int n_query, int k, ap_PointList **out, DIST_FUNC ) {
+
+   int i;
+
+   if( n_query < 1 )
+      return;
+
+   // Create a point priority queue for each query, and start
+   // with every query active at the root
+   ap_PointQueue **point_pqs = malloc( n_query * sizeof( ap_PointQueue* ) );
+   int *active = malloc( n_query * sizeof( int ) );
+   assert( point_pqs && active );
+   for( i = 0; i < n_query; i++ ) {
+      point_pqs[i] = create_point_queue( k );
+      active[i] = i;
+   }
+
+   double start = trace_begin();
+   nearest_neighbor_search_batch_node( tree, queries, point_pqs, active, n_query, dist );
+   trace_end( "search", "nearest_neighbor_search_batch", start );
+
+   // Convert the point priority queues into ap_PointLists and
+   // store them in out
+   for( i = 0; i < n_query; i++ ) {
+      out[i] = point_queue_to_list( point_pqs[i] );
+      free_point_queue( point_pqs[i] );
    }
+   free( point_pqs );
+   free( active );
 }
 
 
-// Attempt to insert p into the point priority queue. Point
-// p will be inserted if point_pq is not yet full. If
-// point_pq is full, p will only be inserted if it is nearer
-// than the farthest member of point_pq. In this case, the
-// farthest member is removed to make room for p. Point p is
-// never inserted if it already exists in point_pq. This
-// function assumes that the items in point_pq are
-// ap_Points. Returns true if p was inserted, or false
-// otherwise.
-bool
-nearest_neighbor_search_try_point( ap_Heap *point_pq, ap_Point *p, double dist ) {
+// Descend a subtree with the n_active queries whose indices
+// are listed in active. Each query visits the child nearest
+// to it first so that its point priority queue tightens as
+// early as possible, and a query only enters a child if the
+// child could contain a point nearer than the farthest
+// member of its point priority queue.
+void
+nearest_neighbor_search_batch_node( ap_Tree *tree, ap_Point **queries, ap_PointQueue **point_pqs, int *active, int n_active, DIST_FUNC ) {
+
+   int i, j, n_subset;
+   double dist_a, dist_b;
+   ap_PointQueue *point_pq;
+
+   // If tree is a leaf, search its cluster with every active
+   // query
+   if( tree->is_leaf ) {
+      nearest_neighbor_search_batch_cluster( tree->cluster, queries, point_pqs, active, n_active, dist );
+      return;
+   }
+
+   double *bound_left  = malloc( n_active * sizeof( double ) );
+   double *bound_right = malloc( n_active * sizeof( double ) );
+   bool *left_first = malloc( n_active * sizeof( bool ) );
+   int *subset = malloc( n_active * sizeof( int ) );
+   assert( bound_left && bound_right && left_first && subset );
+
+   // Calculate the distance between each query and the
+   // antipoles, offer the antipoles to each query's point
+   // priority queue, and find the lower bound on the distance
+   // from each query to each subtree
+   for( i = 0; i < n_active; i++ ) {
+      j = active[i];
+      dist_a = dist( tree->a, queries[j] );
+      dist_b = dist( tree->b, queries[j] );
+      if( tree->try_a )
+         point_queue_insert( point_pqs[j], tree->a, dist_a );
+      if( tree->try_b )
+         point_queue_insert( point_pqs[j], tree->b, dist_b );
+      bound_left[i]  = dist_a - tree->radius_a;
+      bound_right[i] = dist_b - tree->radius_b;
+      left_first[i] = bound_left[i] <= bound_right[i];
+   }
+
+   // Send the queries that are nearer the left subtree into
+   // it first
+   for( i = 0, n_subset = 0; i < n_active; i++ ) {
+      point_pq = point_pqs[active[i]];
+      if( left_first[i] && bound_left[i] < point_pq->bound )
+         subset[n_subset++] = active[i];
+   }
+   if( n_subset > 0 )
+      nearest_neighbor_search_batch_node( tree->left, queries, point_pqs, subset, n_subset, dist );
+
+   // Send the queries that are nearer the right subtree into
+   // it, together with those that have already searched the
+   // left subtree but still need to search the right
+   for( i = 0, n_subset = 0; i < n_active; i++ ) {
+      point_pq = point_pqs[active[i]];
+      if( bound_right[i] < point_pq->bound )
+         subset[n_subset++] = active[i];
+   }
+   if( n_subset > 0 )
+      nearest_neighbor_search_batch_node( tree->right, queries, point_pqs, subset, n_subset, dist );
+
+   // Finally, send the queries that searched the right subtree
+   // first into the left subtree if they still need it
+   for( i = 0, n_subset = 0; i < n_active; i++ ) {
+      point_pq = point_pqs[active[i]];
+      if( !left_first[i] && bound_left[i] < point_pq->bound )
+         subset[n_subset++] = active[i];
+   }
+   if( n_subset > 0 )
+      nearest_neighbor_search_batch_node( tree->left, queries, point_pqs, subset, n_subset, dist );
+
+   free( bound_left );
+   free( bound_right );
+   free( left_first );
+   free( subset );
+}
+
+
+// Search a cluster with the n_active queries whose indices
+// are listed in active. The members are visited in the
+// outer loop, so each member is loaded once and compared
+// against every query that could still use it. As in
+// nearest_neighbor_search_cluster, points that were
+// antipoles of an ancestor are skipped.
+void
+nearest_neighbor_search_batch_cluster( ap_Cluster *cluster, ap_Point **queries, ap_PointQueue **point_pqs, int *active, int n_active, DIST_FUNC ) {
+
+   int i, j, n_near = 0, n_members = cluster->size - cluster->n_antipoles;
+   double d;
+   ap_PointQueue *point_pq;
+   ap_Point *member;
+
+   double *dist_centroid = malloc( n_active * sizeof( double ) );
+   int *near = malloc( n_active * sizeof( int ) );
+   assert( dist_centroid && near );
+
+   // Calculate the distance between each query and the
+   // centroid, offer the centroid to each query's point
+   // priority queue, and keep only the queries that cannot
+   // exclude the entire cluster using the triangle inequality
+   for( i = 0; i < n_active; i++ ) {
+      j = active[i];
+      d = dist( cluster->centroid, queries[j] );
+      if( !cluster->centroid_is_antipole )
+         point_queue_insert( point_pqs[j], cluster->centroid, d );
+      if( d < point_pqs[j]->bound + cluster->radius ) {
+         near[n_near] = j;
+         dist_centroid[n_near] = d;
+         n_near++;
+      }
+   }
+
+   for( i = 0; i < n_members; i++ ) {
+      member = cluster->members[i];
+      for( j = 0; j < n_near; j++ ) {
+         point_pq = point_pqs[near[j]];
+
+         // Small clusters are scanned without checking bounds,
+         // and larger ones use the triangle inequality with the
+         // member's distance to centroid to skip members that are
+         // definitely too far away
+         if( n_members >= LEAF_SCAN_SIZE && dist_centroid[j] > point_pq->bound + cluster->dists[i] )
+            continue;
+
+         d = dist( member, queries[near[j]] );
+         point_queue_insert( point_pq, member, d );
+      }
+   }
+
+   free( dist_centroid );
+   free( near );
+}
+
+
+// Search the tree for the k points nearest each of n_query
+// queries and place them in out[0..n_query-1], using a
+// second antipole tree built over the queries themselves
+// (with build_tree). Pairs of query and data subtrees are
+// compared as a whole, so that when nearby queries share
+// their nearest data subtrees, those subtrees are found
+// once for the group and distant subtrees are pruned for
+// the group at once. query_tree must be built over exactly
+// the queries.
+void
+nearest_neighbor_search_dual_tree( ap_Tree *query_tree, ap_Tree *tree, ap_Point **queries, int n_query, int k, ap_PointList **out, DIST_FUNC ) {
+
+   int i, j, pos, n_leaves = 0, n_slots = 0;
+
+   if( n_query < 1 )
+      return;
+
+   // Sort a copy of the queries by address so that each point
+   // of query_tree can be matched to its query
+   ap_Point **sorted_queries = malloc( n_query * sizeof( ap_Point* ) );
+   ap_PointQueue **point_pqs = malloc( n_query * sizeof( ap_PointQueue* ) );
+   bool *covered = calloc( n_query, sizeof( bool ) );
+   assert( sorted_queries && point_pqs && covered );
+   for( i = 0; i < n_query; i++ ) {
+      sorted_queries[i] = queries[i];
+      point_pqs[i] = create_point_queue( k );
+   }
+   qsort( sorted_queries, n_query, sizeof( ap_Point* ), compare_point_addresses );
+
+   // Point each leaf of the query tree at the point priority
+   // queues of its centroid and members once, so that visiting
+   // a leaf needs no lookups beyond finding the leaf, sorting
+   // the leaves by address for that
+   ap_DualTreeLeaf *leaves = malloc( count_tree_leaves( query_tree ) * sizeof( ap_DualTreeLeaf ) );
+   assert( leaves );
+   collect_tree_leaves( query_tree, leaves, &n_leaves );
+   qsort( leaves, n_leaves, sizeof( ap_DualTreeLeaf ), compare_dual_tree_leaves );
+   for( i = 0; i < n_leaves; i++ )
+      n_slots += leaves[i].cluster->size + 1;
+   ap_PointQueue **slots = malloc( n_slots * sizeof( ap_PointQueue* ) );
+   assert( slots );
+   for( i = 0, n_slots = 0; i < n_leaves; i++ ) {
+      leaves[i].point_pqs = slots + n_slots;
+      for( j = -1; j < leaves[i].cluster->size; j++ ) {
+         pos = find_point( sorted_queries, n_query, j < 0 ? leaves[i].cluster->centroid : leaves[i].cluster->members[j] );
+         assert( pos >= 0 );
+         covered[pos] = true;
+         slots[n_slots++] = point_pqs[pos];
+      }
+   }
+   for( i = 0; i < n_query; i++ )
+      assert( covered[i] );
+
+   // Compare the root of the query tree with the root of the
+   // tree, neither of which has a bounding ball
+   nearest_neighbor_search_dual_tree_node( query_tree, NULL, INFINITY, tree, NULL, INFINITY, INFINITY, leaves, n_leaves, dist );
+
+   // Convert the point priority queues into ap_PointLists and
+   // store them in out
+   for( i = 0; i < n_query; i++ ) {
+      out[i] = point_queue_to_list( point_pqs[find_point( sorted_queries, n_query, queries[i] )] );
+   }
+   for( i = 0; i < n_query; i++ )
+      free_point_queue( point_pqs[i] );
+   free( sorted_queries );
+   free( point_pqs );
+   free( covered );
+   free( leaves );
+   free( slots );
+}
+
+
+// Compare the subtree query_node of the query tree, whose
+// queries all lie within query_radius of query_center, with
+// the subtree node of the data tree, whose points all lie
+// within radius of center (a NULL center means no bound is
+// known). bound is an upper bound on the distance from any
+// query in query_node to the farthest member of its point
+// priority queue; the pair is skipped if the two balls are
+// farther apart than this. Returns an updated upper bound
+// for query_node.
+double
+nearest_neighbor_search_dual_tree_node( ap_Tree *query_node, ap_Point *query_center, double query_radius, ap_Tree *node, ap_Point *center, double radius, double bound, ap_DualTreeLeaf *leaves, int n_leaves, DIST_FUNC ) {
 
-   // Return if p is already in the point priority queue
    int i;
-   for( i = 0; i < point_pq->size; i++ )
-      if( p == (ap_Point*)point_pq->items[i] )
-         return false;
+   double bound_a, bound_b;
+   ap_PointQueue *point_pq;
+   ap_DualTreeLeaf *leaf;
+
+   // A leaf is bounded by its own cluster
+   if( query_node->is_leaf ) {
+      query_center = query_node->cluster->centroid;
+      query_radius = query_node->cluster->radius;
+   }
+   if( node->is_leaf ) {
+      center = node->cluster->centroid;
+      radius = node->cluster->radius;
+   }
+
+   // If both are leaves, search the data cluster with every
+   // query in the query cluster that could be near enough to
+   // use it, and find the new bound as the distance to the
+   // farthest member of any of their point priority queues
+   if( query_node->is_leaf && node->is_leaf ) {
+      double center_dist = dist( query_center, center );
+      if( center_dist - query_radius - radius >= bound )
+         return bound;
+
+      ap_DualTreeLeaf key = { query_node->cluster, NULL };
+      leaf = bsearch( &key, leaves, n_leaves, sizeof( ap_DualTreeLeaf ), compare_dual_tree_leaves );
+      bound = 0;
+      for( i = -1; i < query_node->cluster->size; i++ ) {
+         ap_Point *query = i < 0 ? query_node->cluster->centroid : query_node->cluster->members[i];
+         double query_dist = i < 0 ? 0 : query_node->cluster->dists[i];
+         point_pq = leaf->point_pqs[i + 1];
+
+         // Use the triangle inequality with the query's distance
+         // to its own centroid to determine if the entire data
+         // cluster can be excluded for this query
+         if( center_dist - query_dist - radius < point_pq->bound )
+            nearest_neighbor_search_cluster( node->cluster, query, point_pq, true, NULL, dist );
+         bound = fmax( bound, point_pq->bound );
+      }
+      return bound;
+   }
 
-   // If the point priority queue is not full, insert p
-   if( !heap_is_full( point_pq ) ) {
-      return heap_insert( point_pq, p, dist );
+   // Split whichever side is larger, always splitting the data
+   // side if the query side is a leaf
+   if( query_node->is_leaf || ( !node->is_leaf && radius >= query_radius ) ) {
+
+      // Use the triangle inequality to find lower bounds on the
+      // distance between the queries and each data subtree
+      if( query_center != NULL ) {
+         bound_a = dist( node->a, query_center ) - query_radius - node->radius_a;
+         bound_b = dist( node->b, query_center ) - query_radius - node->radius_b;
+      } else {
+         bound_a = bound_b = -INFINITY;
+      }
+
+      // Descend the nearer data subtree first, and skip either
+      // subtree if it is farther away than the bound
+      if( bound_a <= bound_b ) {
+         if( bound_a < bound )
+            bound = nearest_neighbor_search_dual_tree_node( query_node, query_center, query_radius, node->left, node->a, node->radius_a, bound, leaves, n_leaves, dist );
+         if( bound_b < bound )
+            bound = nearest_neighbor_search_dual_tree_node( query_node, query_center, query_radius, node->right, node->b, node->radius_b, bound, leaves, n_leaves, dist );
+      } else {
+         if( bound_b < bound )
+            bound = nearest_neighbor_search_dual_tree_node( query_node, query_center, query_radius, node->right, node->b, node->radius_b, bound, leaves, n_leaves, dist );
+         if( bound_a < bound )
+            bound = nearest_neighbor_search_dual_tree_node( query_node, query_center, query_radius, node->left, node->a, node->radius_a, bound, leaves, n_leaves, dist );
+      }
+      return bound;
    } else {
 
-      // If the point priority queue is full and p is nearer than
-      // the farthest member of point_pq, remove the farthest
-      // member of point_pq and insert p
-      if( dist < point_pq->dists[0] ) {
-         heap_pop( point_pq );
-         return heap_insert( point_pq, p, dist );
+      // Use the triangle inequality to find lower bounds on the
+      // distance between each query subtree and the data
+      if( center != NULL ) {
+         bound_a = dist( query_node->a, center ) - query_node->radius_a - radius;
+         bound_b = dist( query_node->b, center ) - query_node->radius_b - radius;
       } else {
+         bound_a = bound_b = -INFINITY;
+      }
 
-         // If the point priority queue is full and p is not nearer
-         // than the farthest member of point_pq, do not insert p
-         return false;
+      // Descend each query subtree that is not farther away than
+      // the bound, and combine their updated bounds
+      if( bound_a < bound )
+         bound_a = nearest_neighbor_search_dual_tree_node( query_node->left, query_node->a, query_node->radius_a, node, center, radius, bound, leaves, n_leaves, dist );
+      else
+         bound_a = bound;
+      if( bound_b < bound )
+         bound_b = nearest_neighbor_search_dual_tree_node( query_node->right, query_node->b, query_node->radius_b, node, center, radius, bound, leaves, n_leaves, dist );
+      else
+         bound_b = bound;
+      return fmax( bound_a, bound_b );
+   }
+}
+
+
+// Search the tree for the k points nearest any of several
+// variants of one query, such as the rotations and mirror
+// images of a tile descriptor, in a single traversal, and
+// place them in out sorted by distance. The distance to a
+// point is the smallest of its distances to the variants,
+// and the lower bound for a subtree is the smallest of the
+// variants' bounds, so pruning stays exact for the set as a
+// whole. If orientations is not NULL, the index of the
+// variant nearest each result is stored in
+// orientations[0..k-1], in the same order as out.
+void
+nearest_neighbor_search_variants( ap_Tree *tree, ap_Point **variants, int n_variants, int k, ap_PointList **out, int *orientations, DIST_FUNC ) {
+
+   int i;
+   double dist_a, dist_b;
+   ap_Tree *index;
+   ap_PointList *result;
+
+   // Create the tree and point priority queues, shared by all
+   // variants
+   ap_TreeQueue *tree_pq = create_tree_queue();
+   ap_PointQueue *point_pq = create_point_queue( k );
+   double *dists = malloc( n_variants * sizeof( double ) );
+   assert( dists );
+
+   tree_queue_insert( tree_pq, tree, -1 );
+   while( tree_pq->size > 0 ) {
+
+      // Stop once the nearest remaining subtree is not nearer
+      // to any variant than the farthest member of point_pq
+      if( tree_pq->items[0].dist >= point_pq->bound )
+         break;
+
+      index = tree_queue_pop( tree_pq );
+
+      if( !index->is_leaf ) {
+         dist_a = variants_dist( index->a, variants, n_variants, NULL, NULL, dist );
+         dist_b = variants_dist( index->b, variants, n_variants, NULL, NULL, dist );
+         if( index->try_a )
+            point_queue_insert( point_pq, index->a, dist_a );
+         if( index->try_b )
+            point_queue_insert( point_pq, index->b, dist_b );
+         if( dist_a - index->radius_a < point_pq->bound )
+            tree_queue_insert( tree_pq, index->left,  dist_a - index->radius_a );
+         if( dist_b - index->radius_b < point_pq->bound )
+            tree_queue_insert( tree_pq, index->right, dist_b - index->radius_b );
+      } else {
+         nearest_neighbor_search_variants_cluster( index->cluster, variants, n_variants, dists, point_pq, dist );
+      }
+   }
+
+   *out = point_queue_to_list( point_pq );
+
+   // Find which variant each result matched
+   if( orientations != NULL )
+      for( result = *out, i = 0; result != NULL; result = result->next, i++ )
+         variants_dist( result->p, variants, n_variants, NULL, &orientations[i], dist );
+
+   free( dists );
+   free_tree_queue( tree_pq );
+   free_point_queue( point_pq );
+}
+
+
+// Find any members of the cluster that are nearer to any of
+// the variants than the farthest point already found in the
+// point priority queue and place them in point_pq. dists
+// must have room for n_variants distances. A member is
+// skipped without calculating its distance when, for every
+// variant, the triangle inequality with the member's
+// distance to centroid shows it is too far away.
+void
+nearest_neighbor_search_variants_cluster( ap_Cluster *cluster, ap_Point **variants, int n_variants, double *dists, ap_PointQueue *point_pq, DIST_FUNC ) {
+
+   int i, v;
+   double d, dist_centroid = variants_dist( cluster->centroid, variants, n_variants, dists, NULL, dist );
+
+   if( !cluster->centroid_is_antipole )
+      point_queue_insert( point_pq, cluster->centroid, dist_centroid );
+   if( dist_centroid >= point_pq->bound + cluster->radius )
+      return;
+
+   for( i = 0; i < cluster->size - cluster->n_antipoles; i++ ) {
+      for( v = 0; v < n_variants; v++ )
+         if( fabs( dists[v] - cluster->dists[i] ) < point_pq->bound )
+            break;
+      if( v == n_variants )
+         continue;
+
+      d = variants_dist( cluster->members[i], variants, n_variants, NULL, NULL, dist );
+      point_queue_insert( point_pq, cluster->members[i], d );
+   }
+}
+
+
+// Return the smallest distance between p and any of the
+// variants. If dists is not NULL, the distance to each
+// variant is stored in it, and if nearest is not NULL, the
+// index of the nearest variant is stored in it.
+double
+variants_dist( ap_Point *p, ap_Point **variants, int n_variants, double *dists, int *nearest, DIST_FUNC ) {
+
+   int v;
+   double d, min_dist = INFINITY;
+
+   if( nearest != NULL )
+      *nearest = 0;
+   for( v = 0; v < n_variants; v++ ) {
+      d = dist( p, variants[v] );
+      if( dists != NULL )
+         dists[v] = d;
+      if( d < min_dist ) {
+         min_dist = d;
+         if( nearest != NULL )
+            *nearest = v;
+      }
+   }
+
+   return min_dist;
+}
+
+
+// Create an iterator that yields the points of the tree in
+// order of distance to the query, one at a time, so that a
+// caller that rejects some neighbors can keep pulling more
+// without repeating the search. If tree is NULL, the
+// iterator starts empty.
+ap_NeighborIterator*
+create_neighbor_iterator( ap_Tree *tree, ap_Point *query ) {
+
+   ap_NeighborIterator *iter = malloc( sizeof( ap_NeighborIterator ) );
+   assert( iter );
+   iter->query = query;
+   iter->tree_pq = create_tree_queue();
+   iter->size = 0;
+   iter->capacity = 16;
+   iter->items = malloc( iter->capacity * sizeof( ap_Candidate ) );
+   assert( iter->items );
+   iter->yielded = 0;
+
+   if( tree != NULL )
+      tree_queue_insert( iter->tree_pq, tree, -1 );
+
+   return iter;
+}
+
+
+// Return the next nearest point to the iterator's query and
+// store its distance in dist_out, or return NULL once every
+// point has been yielded. Subtrees and points wait in two
+// priority queues, by a lower bound on their distance. A
+// subtree is expanded only when its bound is below every
+// waiting point's; a point whose distance is only bounded
+// has it calculated when it reaches the front, and is
+// yielded when it reaches the front with its exact
+// distance, at which point nothing still waiting can be
+// nearer. The same dist must be passed to every call.
+ap_Point*
+neighbor_iterator_next( ap_NeighborIterator *iter, double *dist_out, DIST_FUNC ) {
+
+   ap_Candidate nearest;
+
+   while( true ) {
+      if( iter->size > 0 && ( iter->tree_pq->size == 0 || iter->items[0].dist <= iter->tree_pq->items[0].dist ) ) {
+         nearest = candidate_queue_pop( iter );
+         if( !nearest.exact ) {
+            candidate_queue_insert( iter, nearest.p, dist( nearest.p, iter->query ), true );
+            continue;
+         }
+         if( dist_out != NULL )
+            *dist_out = nearest.dist;
+         iter->yielded++;
+         return nearest.p;
+      }
+      if( iter->tree_pq->size == 0 )
+         return NULL;
+      neighbor_iterator_expand( iter, tree_queue_pop( iter->tree_pq ), dist );
+   }
+}
+
+
+// Expand a subtree popped from the iterator's tree priority
+// queue. The antipoles of an internal node become candidates
+// with their distances, unless an ancestor already offered
+// them, and its children are queued with the usual lower
+// bounds. The members of a leaf's cluster become candidates
+// bounded by the triangle inequality through the centroid,
+// so their distances are only calculated if they are needed.
+void
+neighbor_iterator_expand( ap_NeighborIterator *iter, ap_Tree *tree, DIST_FUNC ) {
+
+   int i;
+   double dist_a, dist_b, dist_centroid;
+   ap_Cluster *cluster;
+
+   if( !tree->is_leaf ) {
+      dist_a = dist( tree->a, iter->query );
+      dist_b = dist( tree->b, iter->query );
+      if( tree->try_a )
+         candidate_queue_insert( iter, tree->a, dist_a, true );
+      if( tree->try_b )
+         candidate_queue_insert( iter, tree->b, dist_b, true );
+      tree_queue_insert( iter->tree_pq, tree->left, dist_a - tree->radius_a );
+      tree_queue_insert( iter->tree_pq, tree->right, dist_b - tree->radius_b );
+   } else {
+      cluster = tree->cluster;
+      dist_centroid = dist( cluster->centroid, iter->query );
+      if( !cluster->centroid_is_antipole )
+         candidate_queue_insert( iter, cluster->centroid, dist_centroid, true );
+      for( i = 0; i < cluster->size - cluster->n_antipoles; i++ )
+         candidate_queue_insert( iter, cluster->members[i], fabs( dist_centroid - cluster->dists[i] ), false );
+   }
+}
+
+
+// Find all points in the array within range of query by
+// checking every point and append them to out.
+void
+flat_range_search( ap_Point **points, int size, ap_Point *query, double range, ap_NeighborArray *out, DIST_FUNC ) {
+
+   flat_range_search_visit( points, size, query, range, out, neighbor_array_visit, NULL, dist );
+}
+
+
+// Find all points in the array within range of query by
+// checking every point, calling visit with each one and
+// data, and return the number found. If visit is NULL, the
+// points are only counted. If proxy is not NULL, it is
+// tried before each distance.
+int
+flat_range_search_visit( ap_Point **points, int size, ap_Point *query, double range, void *data, VISIT_FUNC, PROXY_FUNC, DIST_FUNC ) {
+
+   int i, count = 0;
+   double d;
+   for( i = 0; i < size; i++ ) {
+      if( proxy != NULL && proxy( points[i], query ) > range )
+         continue;
+      d = dist( points[i], query );
+      if( d <= range ) {
+         if( visit != NULL )
+            visit( points[i], d, data );
+         count++;
+      }
+   }
+
+   return count;
+}
+
+
+// Find the k points in the array nearest the query and place
+// them in out by checking every point.
+void
+flat_nearest_neighbor_search( ap_Point **points, int size, ap_Point *query, int k, ap_PointList **out, DIST_FUNC ) {
+
+   flat_nearest_neighbor_search_within( points, size, query, k, INFINITY, out, NULL, dist );
+}
+
+
+// Find up to k points in the array nearest the query that
+// are within range of it and place them in out sorted by
+// distance, by checking every point. Distances are
+// calculated a block at a time in a single pass before any
+// are compared against the point priority queue. If proxy
+// is not NULL, it is tried before each distance.
+void
+flat_nearest_neighbor_search_within( ap_Point **points, int size, ap_Point *query, int k, double range, ap_PointList **out, PROXY_FUNC, DIST_FUNC ) {
+
+   int i, j, block;
+   double dists[LEAF_SCAN_SIZE];
+
+   // Create the point priority queue with a maximum size k,
+   // accepting only points within range
+   ap_PointQueue *point_pq = create_point_queue( k );
+   point_queue_limit( point_pq, range );
+
+   for( i = 0; i < size; i += LEAF_SCAN_SIZE ) {
+      block = min( LEAF_SCAN_SIZE, size - i );
+      for( j = 0; j < block; j++ )
+         dists[j] = proxy == NULL || proxy( points[i+j], query ) < point_pq->bound ? dist( points[i+j], query ) : INFINITY;
+      for( j = 0; j < block; j++ )
+         point_queue_insert( point_pq, points[i+j], dists[j] );
+   }
+
+   *out = point_queue_to_list( point_pq );
+   free_point_queue( point_pq );
+}
+
+
+// Find the k points in the array nearest each of n_query
+// queries and place them in out[0..n_query-1] by checking
+// every point. The points are visited in the outer loop a
+// block at a time, so that each block is loaded once and
+// compared against every query.
+void
+flat_nearest_neighbor_search_batch( ap_Point **points, int size, ap_Point **queries, int n_query, int k, ap_PointList **out, DIST_FUNC ) {
+
+   int i, j, q, block;
+   double dists[LEAF_SCAN_SIZE];
+
+   if( n_query < 1 )
+      return;
+
+   ap_PointQueue **point_pqs = malloc( n_query * sizeof( ap_PointQueue* ) );
+   assert( point_pqs );
+   for( q = 0; q < n_query; q++ )
+      point_pqs[q] = create_point_queue( k );
+
+   double start = trace_begin();
+   for( i = 0; i < size; i += LEAF_SCAN_SIZE ) {
+      block = min( LEAF_SCAN_SIZE, size - i );
+      for( q = 0; q < n_query; q++ ) {
+         for( j = 0; j < block; j++ )
+            dists[j] = dist( points[i+j], queries[q] );
+         for( j = 0; j < block; j++ )
+            point_queue_insert( point_pqs[q], points[i+j], dists[j] );
+      }
+   }
+   trace_end( "search", "flat_nearest_neighbor_search_batch", start );
+
+   for( q = 0; q < n_query; q++ ) {
+      out[q] = point_queue_to_list( point_pqs[q] );
+      free_point_queue( point_pqs[q] );
+   }
+   free( point_pqs );
+}
+
+
+// Find the k points in the array nearest any of several
+// variants of one query by checking every point against
+// every variant, and place them in out sorted by distance.
+// If orientations is not NULL, the index of the variant
+// nearest each result is stored in orientations[0..k-1].
+void
+flat_nearest_neighbor_search_variants( ap_Point **points, int size, ap_Point **variants, int n_variants, int k, ap_PointList **out, int *orientations, DIST_FUNC ) {
+
+   int i;
+   ap_PointList *result;
+   ap_PointQueue *point_pq = create_point_queue( k );
+
+   for( i = 0; i < size; i++ )
+      point_queue_insert( point_pq, points[i], variants_dist( points[i], variants, n_variants, NULL, NULL, dist ) );
+
+   *out = point_queue_to_list( point_pq );
+   if( orientations != NULL )
+      for( result = *out, i = 0; result != NULL; result = result->next, i++ )
+         variants_dist( result->p, variants, n_variants, NULL, &orientations[i], dist );
+   free_point_queue( point_pq );
+}
+
+
+// Search an ap_Index to find all points within range of
+// query and append them to out.
+void
+index_range_search( ap_Index *index, ap_Point *query, double range, ap_NeighborArray *out, DIST_FUNC ) {
+
+   index_range_search_visit( index, query, range, out, neighbor_array_visit, NULL, dist );
+}
+
+
+// Search an ap_Index to count the points within range of
+// query without collecting them.
+int
+index_range_count( ap_Index *index, ap_Point *query, double range, DIST_FUNC ) {
+
+   return index_range_search_visit( index, query, range, NULL, NULL, NULL, dist );
+}
+
+
+// Search an ap_Index to find all points within range of
+// query, calling visit with each one and data, and return
+// the number found. If visit is NULL, the points are only
+// counted. If proxy is not NULL, it must never exceed dist,
+// and is used to avoid calculating dist where possible.
+int
+index_range_search_visit( ap_Index *index, ap_Point *query, double range, void *data, VISIT_FUNC, PROXY_FUNC, DIST_FUNC ) {
+
+   if( index->type == INDEX_TREE )
+      return range_search_visit( index->tree, query, range, data, visit, proxy, dist );
+   else
+      return flat_range_search_visit( index->points, index->size, query, range, data, visit, proxy, dist );
+}
+
+
+// Search an ap_Index to find the k points nearest the query
+// and place them in out.
+void
+index_nearest_neighbor_search( ap_Index *index, ap_Point *query, int k, ap_PointList **out, DIST_FUNC ) {
+
+   if( index->type == INDEX_TREE )
+      nearest_neighbor_search( index->tree, query, k, out, dist );
+   else
+      flat_nearest_neighbor_search( index->points, index->size, query, k, out, dist );
+}
+
+
+// Search an ap_Index to find up to k points nearest the
+// query that are within range of it and place them in out
+// sorted by distance. If proxy is not NULL, it must never
+// exceed dist, and is used to avoid calculating dist where
+// possible.
+void
+index_nearest_neighbor_search_within( ap_Index *index, ap_Point *query, int k, double range, ap_PointList **out, PROXY_FUNC, DIST_FUNC ) {
+
+   if( index->type == INDEX_TREE )
+      nearest_neighbor_search_within( index->tree, query, k, range, out, proxy, dist );
+   else
+      flat_nearest_neighbor_search_within( index->points, index->size, query, k, range, out, proxy, dist );
+}
+
+
+// Search an ap_Index to find the k points nearest the query
+// and place them in out sorted by distance, given the n
+// neighbors, sorted by distance, of an earlier search for
+// old_query. Returns true if the old neighbors were reused
+// without a search, or false otherwise.
+//
+// If the query lies delta from old_query, no point outside
+// the old neighbors can be nearer than their old kth distance
+// minus delta. So when every old neighbor is still within
+// that distance of the query, they remain the k nearest and
+// are returned re-sorted after only n + 1 distance
+// calculations; fewer than k old neighbors means the index
+// holds no other points. Otherwise the index is searched with
+// the old neighbors' new distances as an initial bound, since
+// at least k points lie within it. The bound is padded by
+// RESEED_TOLERANCE, because the search prunes subtrees whose
+// lower bound merely equals it and a neighbor on the boundary
+// of a subtree would otherwise be lost to rounding; should a
+// search still come up short, it is repeated without a bound.
+// Either way the result is exact.
+bool
+reseed_nearest_neighbor_search( ap_Index *index, ap_Point *query, int k, ap_Point *old_query, ap_Neighbor *old_neighbors, int n, ap_PointList **out, PROXY_FUNC, DIST_FUNC ) {
+
+   int i;
+   bool reused = false;
+
+   // Find the old neighbors' distances to the query, sorted,
+   // along with the old kth distance
+   double delta = dist( old_query, query );
+   ap_PointQueue *point_pq = create_point_queue( k );
+   for( i = 0; i < n; i++ )
+      point_queue_insert( point_pq, old_neighbors[i].p, dist( old_neighbors[i].p, query ) );
+   double last_bound = n > 0 ? old_neighbors[n-1].dist : 0;
+
+   if( n < k || point_pq->bound <= last_bound - delta ) {
+      *out = point_queue_to_list( point_pq );
+      reused = true;
+   } else {
+      index_nearest_neighbor_search_within( index, query, k, point_pq->bound * ( 1 + RESEED_TOLERANCE ) + RESEED_TOLERANCE, out, proxy, dist );
+      if( list_size( *out ) < k ) {
+         free_list( *out );
+         index_nearest_neighbor_search_within( index, query, k, INFINITY, out, proxy, dist );
       }
    }
+   free_point_queue( point_pq );
+
+   return reused;
+}
+
+
+// Search an ap_Index to find the k points nearest each of
+// n_query queries and place them in out[0..n_query-1].
+void
+index_nearest_neighbor_search_batch( ap_Index *index, ap_Point **queries, int n_query, int k, ap_PointList **out, DIST_FUNC ) {
+
+   if( index->type == INDEX_TREE )
+      nearest_neighbor_search_batch( index->tree, queries, n_query, k, out, dist );
+   else
+      flat_nearest_neighbor_search_batch( index->points, index->size, queries, n_query, k, out, dist );
+}
+
+
+// Search an ap_Index to find the k points nearest any of
+// several variants of one query and place them in out,
+// storing the index of the variant each matched in
+// orientations if it is not NULL.
+void
+index_nearest_neighbor_search_variants( ap_Index *index, ap_Point **variants, int n_variants, int k, ap_PointList **out, int *orientations, DIST_FUNC ) {
+
+   if( index->type == INDEX_TREE )
+      nearest_neighbor_search_variants( index->tree, variants, n_variants, k, out, orientations, dist );
+   else
+      flat_nearest_neighbor_search_variants( index->points, index->size, variants, n_variants, k, out, orientations, dist );
+}
+
+
+// Create an iterator that yields the points of an ap_Index
+// in order of distance to the query. A flat index starts
+// with every point as a candidate bounded by 0, so the
+// first call to neighbor_iterator_next calculates every
+// distance, much as a flat search would.
+ap_NeighborIterator*
+create_index_neighbor_iterator( ap_Index *index, ap_Point *query ) {
+
+   int i;
+
+   if( index->type == INDEX_TREE )
+      return create_neighbor_iterator( index->tree, query );
+
+   ap_NeighborIterator *iter = create_neighbor_iterator( NULL, query );
+   for( i = 0; i < index->size; i++ )
+      candidate_queue_insert( iter, index->points[i], 0, false );
+
+   return iter;
 }
 
 
@@ -542,11 +1745,19 @@ exact_1_median( ap_PointList *set, ap_Point **median, DIST_FUNC ) {
 // of points and store it in median. The user should
 // initialize the random number generator using srand.
 void
-approx_1_median( ap_PointList *set, ap_Point **median, int dimensionality, DIST_FUNC ) {
+approx_1_median( ap_PointList *set, ap_Point **median, int dimensionality, ap_Arena *scratch, DIST_FUNC ) {
 
    *median = NULL;
 
-   ap_PointList *contestants = copy_list( set ), *tournament, *winners;
+   // The temporary lists are allocated from scratch (or from
+   // an arena of their own if scratch is NULL), so losers can
+   // simply be dropped and all released together at the end
+   ap_Arena *own_scratch = NULL;
+   if( scratch == NULL )
+      scratch = own_scratch = create_arena( ARENA_BLOCK_SIZE );
+   ap_ArenaMark mark = arena_mark( scratch );
+
+   ap_PointList *contestants = copy_list( set, scratch ), *tournament, *winners;
    int i, contestants_size = list_size( contestants ), tournament_size = dimensionality + 1, winners_size;
    int final_round_size = max( pow( tournament_size, 2 ) - 1, round( sqrt( list_size( set ) ) ) );
 
@@ -567,14 +1778,12 @@ approx_1_median( ap_PointList *set, ap_Point **median, int dimensionality, DIST_
          exact_1_median( tournament, median, dist );
          move_point( *median, &tournament, &winners );
          winners_size++;
-         free_list( tournament );
       }
       // Find the winner among the remaining contestants and
       // discard the losers
       exact_1_median( contestants, median, dist );
       move_point( *median, &contestants, &winners );
       winners_size++;
-      free_list( contestants );
 
       // Fill the pool of contestants with all the winners in
       // preparation for the next round
@@ -584,7 +1793,8 @@ approx_1_median( ap_PointList *set, ap_Point **median, int dimensionality, DIST_
    
    // Find the overall winner and discard the losers
    exact_1_median( contestants, median, dist );
-   free_list( contestants );
+   arena_release( scratch, mark );
+   free_arena( own_scratch );
 }
 
 
@@ -620,12 +1830,20 @@ exact_antipoles( ap_PointList *set, ap_Point **antipole_a, ap_Point **antipole_b
 // The user should initialize the random number generator
 // using srand.
 void
-approx_antipoles( ap_PointList *set, ap_Point **antipole_a, ap_Point **antipole_b, int dimensionality, DIST_FUNC ) {
+approx_antipoles( ap_PointList *set, ap_Point **antipole_a, ap_Point **antipole_b, int dimensionality, ap_Arena *scratch, DIST_FUNC ) {
 
    *antipole_a = NULL;
    *antipole_b = NULL;
 
-   ap_PointList *contestants = copy_list( set ), *tournament, *winners;
+   // The temporary lists are allocated from scratch (or from
+   // an arena of their own if scratch is NULL), so losers can
+   // simply be dropped and all released together at the end
+   ap_Arena *own_scratch = NULL;
+   if( scratch == NULL )
+      scratch = own_scratch = create_arena( ARENA_BLOCK_SIZE );
+   ap_ArenaMark mark = arena_mark( scratch );
+
+   ap_PointList *contestants = copy_list( set, scratch ), *tournament, *winners;
    int i, contestants_size = list_size( contestants ), tournament_size = dimensionality + 1, winners_size;
    int final_round_size = max( pow( tournament_size, 2 ) - 1, round( sqrt( list_size( set ) ) ) );
 
@@ -647,7 +1865,6 @@ approx_antipoles( ap_PointList *set, ap_Point **antipole_a, ap_Point **antipole_
          move_point( *antipole_a, &tournament, &winners );
          move_point( *antipole_b, &tournament, &winners );
          winners_size += 2;
-         free_list( tournament );
       }
       // Find the winners among the remaining contestants and
       // discard the losers
@@ -655,7 +1872,6 @@ approx_antipoles( ap_PointList *set, ap_Point **antipole_a, ap_Point **antipole_
       move_point( *antipole_a, &contestants, &winners );
       move_point( *antipole_b, &contestants, &winners );
       winners_size += 2;
-      free_list( contestants );
 
       // Fill the pool of contestants with all the winners in
       // preparation for the next round
@@ -665,7 +1881,8 @@ approx_antipoles( ap_PointList *set, ap_Point **antipole_a, ap_Point **antipole_
    
    // Find the overall winners and discard the losers
    exact_antipoles( contestants, antipole_a, antipole_b, dist );
-   free_list( contestants );
+   arena_release( scratch, mark );
+   free_arena( own_scratch );
 }
 
 
@@ -759,6 +1976,22 @@ add_point( ap_PointList **list, ap_Point *p, double dist ) {
 }
 
 
+// Prepend to an ap_PointList an ap_Point with a distance
+// value without checking whether the point is already in
+// the list, so the caller must know that it is not. The new
+// list member is allocated from arena, or with malloc if
+// arena is NULL.
+void
+prepend_point( ap_PointList **list, ap_Point *p, double dist, ap_Arena *arena ) {
+
+   ap_PointList *new_list_member = arena_alloc( arena, sizeof( ap_PointList ) );
+   new_list_member->p = p;
+   new_list_member->dist = dist;
+   new_list_member->next = *list;
+   *list = new_list_member;
+}
+
+
 // Move the first instance of point p found in the
 // ap_PointList *from into the ap_PointList *to. Requires
 // the addresses of the ap_PointList pointers so that the
@@ -843,19 +2076,34 @@ move_nth_point( int n, ap_PointList **from, ap_PointList **to ) {
 
 
 // Create a new ap_PointList with the same contents as list
-// (the order will be reversed).
+// (the order will be reversed), allocated from arena, or
+// with malloc if arena is NULL.
 ap_PointList*
-copy_list( ap_PointList *list ) {
+copy_list( ap_PointList *list, ap_Arena *arena ) {
 
    ap_PointList *new_list = NULL;
    while( list != NULL ) {
-      add_point( &new_list, list->p, list->dist );
+      prepend_point( &new_list, list->p, list->dist, arena );
       list = list->next;
    }
    return new_list;
 }
 
 
+// Return true if point p is in the list, or false
+// otherwise.
+bool
+list_contains( ap_PointList *list, ap_Point *p ) {
+
+   while( list != NULL ) {
+      if( list->p == p )
+         return true;
+      list = list->next;
+   }
+   return false;
+}
+
+
 // Find the size of the list of points
 int
 list_size( ap_PointList *list ) {
@@ -869,257 +2117,495 @@ list_size( ap_PointList *list ) {
 }
 
 
+// Return the number of leaves in the tree.
+int
+count_tree_leaves( ap_Tree *tree ) {
+
+   if( tree->is_leaf )
+      return 1;
+
+   return count_tree_leaves( tree->left ) + count_tree_leaves( tree->right );
+}
+
+
+// Store the cluster of each leaf of the tree in
+// leaves[*n_leaves], counting them in n_leaves.
+void
+collect_tree_leaves( ap_Tree *tree, ap_DualTreeLeaf *leaves, int *n_leaves ) {
+
+   if( tree->is_leaf ) {
+      leaves[*n_leaves].cluster = tree->cluster;
+      leaves[*n_leaves].point_pqs = NULL;
+      (*n_leaves)++;
+   } else {
+      collect_tree_leaves( tree->left, leaves, n_leaves );
+      collect_tree_leaves( tree->right, leaves, n_leaves );
+   }
+}
+
+
+// Compare the cluster addresses of two ap_DualTreeLeafs for
+// use with qsort and bsearch.
+int
+compare_dual_tree_leaves( const void *a, const void *b ) {
+
+   ap_Cluster *c1 = ((ap_DualTreeLeaf*)a)->cluster, *c2 = ((ap_DualTreeLeaf*)b)->cluster;
+   return ( c1 > c2 ) - ( c1 < c2 );
+}
+
+
+// Compare the addresses of two ap_Points for use with qsort
+// and bsearch on an array of ap_Point pointers.
+int
+compare_point_addresses( const void *a, const void *b ) {
+
+   ap_Point *p1 = *(ap_Point**)a, *p2 = *(ap_Point**)b;
+   return ( p1 > p2 ) - ( p1 < p2 );
+}
+
+
+// Find the position of p in an array of points sorted by
+// compare_point_addresses. Returns -1 if p is not found.
+int
+find_point( ap_Point **sorted, int size, ap_Point *p ) {
+
+   ap_Point **found = bsearch( &p, sorted, size, sizeof( ap_Point* ), compare_point_addresses );
+   return found == NULL ? -1 : (int)( found - sorted );
+}
+
+
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * *
-                     HEAP OPERATIONS
+                PRIORITY QUEUE OPERATIONS
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
 
-// Create a new ap_Heap object. The heap is a min-heap if
-// is_max_heap is false or a max-heap otherwise. If
-// max_size < 1, the heap will have no maximum size.
-ap_Heap*
-create_heap( bool is_max_heap, int max_size ) {
+// Create a new ap_PointQueue that holds at most max_size
+// points and keeps the nearest ones. Small queues are kept
+// as an array sorted by distance, and large ones as a
+// max-heap.
+ap_PointQueue*
+create_point_queue( int max_size ) {
 
-   ap_Heap *heap = malloc( sizeof( ap_Heap ) );
-   assert( heap );
-   heap->is_max_heap = is_max_heap;
-   heap->max_size = max_size;
-   heap->size = 0;
-   if( max_size < 1 )
-      heap->capacity = 10;
-   else
-      heap->capacity = max_size;
-   heap->items = calloc( heap->capacity, sizeof( void* ) );
-   heap->dists = calloc( heap->capacity, sizeof( double ) );
-   assert( heap->items && heap->dists );
+   ap_PointQueue *point_pq = malloc( sizeof( ap_PointQueue ) );
+   assert( point_pq );
+   point_pq->max_size = max( max_size, 0 );
+   point_pq->size = 0;
+   point_pq->is_sorted = max_size <= SORTED_QUEUE_SIZE;
+   point_pq->bound = max_size > 0 ? INFINITY : -INFINITY;
+   point_pq->items = malloc( max( max_size, 1 ) * sizeof( ap_Neighbor ) );
+   assert( point_pq->items );
 
-   return heap;
+   return point_pq;
 }
 
 
-// Return false if the heap has no maximum size or if the
-// current heap size is smaller than the maximum size, or
-// return true otherwise.
+// Attempt to insert p into the point priority queue. Point
+// p will be inserted if point_pq is not yet full. If
+// point_pq is full, p will only be inserted if it is nearer
+// than the farthest member of point_pq, which is removed to
+// make room for p. The caller must not offer the same point
+// twice. Returns true if p was inserted, or false otherwise.
 bool
-heap_is_full( ap_Heap *heap ) {
+point_queue_insert( ap_PointQueue *point_pq, ap_Point *p, double dist ) {
+
+   int i, parent, child;
+   ap_Neighbor *items = point_pq->items;
 
-   if( heap->max_size < 1 || heap->size < heap->max_size )
+   if( dist >= point_pq->bound )
       return false;
-   else
-      return true;
+
+   if( point_pq->is_sorted ) {
+
+      // Shift farther members toward the end of the array,
+      // dropping the farthest if the queue is full, and place p
+      // in the gap
+      i = point_pq->size < point_pq->max_size ? point_pq->size++ : point_pq->size - 1;
+      while( i > 0 && items[i-1].dist > dist ) {
+         items[i] = items[i-1];
+         i--;
+      }
+      items[i].dist = dist;
+      items[i].p = p;
+
+      if( point_pq->size == point_pq->max_size )
+         point_pq->bound = items[point_pq->size-1].dist;
+   } else if( point_pq->size < point_pq->max_size ) {
+
+      // Sift p upward from the end of the max-heap
+      i = point_pq->size++;
+      while( i > 0 && items[parent = ( i - 1 ) / 2].dist < dist ) {
+         items[i] = items[parent];
+         i = parent;
+      }
+      items[i].dist = dist;
+      items[i].p = p;
+
+      if( point_pq->size == point_pq->max_size )
+         point_pq->bound = items[0].dist;
+   } else {
+
+      // Replace the farthest member at the root of the full
+      // max-heap with p and sift it downward
+      i = 0;
+      while( ( child = 2 * i + 1 ) < point_pq->size ) {
+         if( child + 1 < point_pq->size && items[child+1].dist > items[child].dist )
+            child++;
+         if( items[child].dist <= dist )
+            break;
+         items[i] = items[child];
+         i = child;
+      }
+      items[i].dist = dist;
+      items[i].p = p;
+
+      point_pq->bound = items[0].dist;
+   }
+
+   return true;
 }
 
 
-// Increase the capacity of heap
+// Restrict the point priority queue to points within range
+// of the query. The bound starts just above range, so that
+// points at exactly range are still accepted, and tightens
+// as usual once the queue is full.
 void
-heap_grow( ap_Heap *heap ) {
+point_queue_limit( ap_PointQueue *point_pq, double range ) {
+
+   point_pq->bound = fmin( point_pq->bound, nextafter( range, INFINITY ) );
+}
+
+
+// Compare the distances of two ap_Neighbors for use with
+// qsort.
+int
+compare_neighbors( const void *a, const void *b ) {
+
+   double d1 = ((ap_Neighbor*)a)->dist, d2 = ((ap_Neighbor*)b)->dist;
+   return ( d1 > d2 ) - ( d1 < d2 );
+}
+
 
-   heap->capacity *= 2;
-   void  **temp_items = calloc( heap->capacity, sizeof( void* ) );
-   double *temp_dists = calloc( heap->capacity, sizeof( double ) );
-   assert( temp_items && temp_dists );
+// Create an ap_PointList from an ap_PointQueue. The points
+// in the list will be sorted by distance in ascending
+// order.
+ap_PointList*
+point_queue_to_list( ap_PointQueue *point_pq ) {
 
    int i;
-   for( i = 0; i < heap->size; i++ ) {
-      temp_items[i] = heap->items[i];
-      temp_dists[i] = heap->dists[i];
+   ap_PointList *new_list = NULL;
+   ap_Neighbor *items = point_pq->items;
+
+   // A heap must first be sorted (a copy is made because the
+   // queue may still be in use)
+   if( !point_pq->is_sorted ) {
+      items = malloc( max( point_pq->size, 1 ) * sizeof( ap_Neighbor ) );
+      assert( items );
+      for( i = 0; i < point_pq->size; i++ )
+         items[i] = point_pq->items[i];
+      qsort( items, point_pq->size, sizeof( ap_Neighbor ), compare_neighbors );
    }
 
-   free( heap->items );
-   free( heap->dists );
-   heap->items = temp_items;
-   heap->dists = temp_dists;
-}
+   // Prepending from the farthest point leaves the nearest at
+   // the front of the list
+   for( i = point_pq->size - 1; i >= 0; i-- )
+      prepend_point( &new_list, items[i].p, items[i].dist, NULL );
 
+   if( items != point_pq->items )
+      free( items );
 
-// Swap items at positions i and j in heap. Returns true if
-// a swap occurred or false if the indices were
-// inapproriate.
-bool
-heap_swap( ap_Heap *heap, int i, int j ) {
+   return new_list;
+}
 
-   // Return if the indices match or are out of bounds
-   if( i == j || i >= heap->size || j >= heap->size || i < 0 || j < 0 )
-      return false;
 
-   void *temp_item  = heap->items[i];
-   double temp_dist = heap->dists[i];
-   heap->items[i] = heap->items[j];
-   heap->dists[i] = heap->dists[j];
-   heap->items[j] = temp_item;
-   heap->dists[j] = temp_dist;
+// Create a new, empty ap_TreeQueue.
+ap_TreeQueue*
+create_tree_queue( void ) {
 
-   return true;
+   ap_TreeQueue *tree_pq = malloc( sizeof( ap_TreeQueue ) );
+   assert( tree_pq );
+   tree_pq->size = 0;
+   tree_pq->capacity = 16;
+   tree_pq->items = malloc( tree_pq->capacity * sizeof( ap_TreeEntry ) );
+   assert( tree_pq->items );
+
+   return tree_pq;
 }
 
 
-// Sift upward the item at position index in heap until it
-// is properly positioned.
+// Add a subtree to the tree priority queue with a lower
+// bound on its distance to the query used for sorting. The
+// queue is a 4-ary min-heap, which is shallower than a
+// binary heap and keeps each node's children adjacent in
+// memory.
 void
-heap_sift_up( ap_Heap* heap, int index ) {
+tree_queue_insert( ap_TreeQueue *tree_pq, ap_Tree *tree, double dist ) {
 
-   int parent;
+   int i, parent;
+   ap_TreeEntry *items;
 
-   // Repeatedly sift the item upward, stopping if it
-   // becomes the root
-   while( index > 0 ) {
+   // Grow the array if necessary
+   if( tree_pq->size == tree_pq->capacity ) {
+      tree_pq->capacity *= 2;
+      tree_pq->items = realloc( tree_pq->items, tree_pq->capacity * sizeof( ap_TreeEntry ) );
+      assert( tree_pq->items );
+   }
 
-      parent = ( index - 1 ) / 2;
+   // Sift the new subtree upward from the end of the heap
+   items = tree_pq->items;
+   i = tree_pq->size++;
+   while( i > 0 && items[parent = ( i - 1 ) / 4].dist > dist ) {
+      items[i] = items[parent];
+      i = parent;
+   }
+   items[i].dist = dist;
+   items[i].tree = tree;
+}
 
-      // If index has a greater/lesser dist than its parent and
-      // the heap is a max-/min-heap, swap index and its parent
-      // and continue sifting upward
-      if( ( heap->is_max_heap && heap->dists[index] > heap->dists[parent] ) ||
-         ( !heap->is_max_heap && heap->dists[index] < heap->dists[parent] ) ) {
-         heap_swap( heap, index, parent );
-         index = parent;
-      } else {
 
-         // Stop if index is properly positioned
+// Remove the nearest subtree from the tree priority queue
+// and return it. Returns NULL if the queue is empty.
+ap_Tree*
+tree_queue_pop( ap_TreeQueue *tree_pq ) {
+
+   int i, child, first, last;
+   ap_TreeEntry *items = tree_pq->items, moved;
+
+   if( tree_pq->size == 0 )
+      return NULL;
+
+   ap_Tree *nearest = items[0].tree;
+
+   // Sift the last subtree downward from the root
+   moved = items[--tree_pq->size];
+   i = 0;
+   while( ( first = 4 * i + 1 ) < tree_pq->size ) {
+      last = min( first + 4, tree_pq->size );
+      for( child = first++; first < last; first++ )
+         if( items[first].dist < items[child].dist )
+            child = first;
+      if( items[child].dist >= moved.dist )
          break;
-      }
+      items[i] = items[child];
+      i = child;
    }
+   items[i] = moved;
+
+   return nearest;
 }
 
 
-// Sift downward the item at position index in heap until it
-// is properly positioned.
+// Add a point to the iterator's candidate queue with either
+// its distance to the query or, if exact is false, a lower
+// bound on it. The queue is a 4-ary min-heap like the tree
+// priority queue.
 void
-heap_sift_down( ap_Heap *heap, int index ) {
+candidate_queue_insert( ap_NeighborIterator *iter, ap_Point *p, double dist, bool exact ) {
 
-   int left, right, child;
+   int i, parent;
+   ap_Candidate *items;
 
-   // Repeatedly sift the item downward, stopping if it becomes
-   // a leaf
-   while( index < heap->size / 2 ) {
-
-      left  = 2 * index + 1;
-      right = 2 * index + 2;
-
-      // If index only has one child, find its index
-      if( right >= heap->size ) {
-         child = left;
-      } else {
+   // Grow the array if necessary
+   if( iter->size == iter->capacity ) {
+      iter->capacity *= 2;
+      iter->items = realloc( iter->items, iter->capacity * sizeof( ap_Candidate ) );
+      assert( iter->items );
+   }
 
-         // Find the child with the greater/lesser dist if the heap
-         // is a max-/min-heap
-         if( ( heap->is_max_heap && heap->dists[left] > heap->dists[right] ) ||
-            ( !heap->is_max_heap && heap->dists[left] < heap->dists[right] ) )
-            child = left;
-         else
-            child = right;
-      }
+   // Sift the new candidate upward from the end of the heap
+   items = iter->items;
+   i = iter->size++;
+   while( i > 0 && items[parent = ( i - 1 ) / 4].dist > dist ) {
+      items[i] = items[parent];
+      i = parent;
+   }
+   items[i].dist = dist;
+   items[i].p = p;
+   items[i].exact = exact;
+}
 
-      // If index has a lesser/greater dist than one of its
-      // children and the heap is a max-/min-heap, swap index and
-      // the greater/lesser child and continue sifting upward
-      if( ( heap->is_max_heap && heap->dists[index] < heap->dists[child] ) ||
-         ( !heap->is_max_heap && heap->dists[index] > heap->dists[child] ) ) {
-         heap_swap( heap, index, child );
-         index = child;
-      } else {
 
-         // Stop if index is properly positioned
+// Remove the candidate with the smallest distance or bound
+// from the iterator's candidate queue and return it. The
+// queue must not be empty.
+ap_Candidate
+candidate_queue_pop( ap_NeighborIterator *iter ) {
+
+   int i, child, first, last;
+   ap_Candidate *items = iter->items, moved;
+   ap_Candidate nearest = items[0];
+
+   // Sift the last candidate downward from the root
+   moved = items[--iter->size];
+   i = 0;
+   while( ( first = 4 * i + 1 ) < iter->size ) {
+      last = min( first + 4, iter->size );
+      for( child = first++; first < last; first++ )
+         if( items[first].dist < items[child].dist )
+            child = first;
+      if( items[child].dist >= moved.dist )
          break;
-      }
+      items[i] = items[child];
+      i = child;
    }
+   items[i] = moved;
+
+   return nearest;
 }
 
 
-// Add an item to an ap_Heap with a distance value used for
-// sorting. The item will be inserted only if the heap does
-// not already contain the maximum number of items. Returns
-// true if the item was inserted or false if the heap was
-// full.
-bool
-heap_insert( ap_Heap *heap, void *item, double dist ) {
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+                NEIGHBOR ARRAY OPERATIONS
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
-   int i;
 
-   // Add the item to the heap only if it is not full
-   if( !heap_is_full( heap ) ) {
-      
-      // Grow the data arrays if necessary
-      if( heap->size == heap->capacity )
-         heap_grow( heap );
+// Create a new, empty ap_NeighborArray. An array can be
+// reused by setting its size to 0.
+ap_NeighborArray*
+create_neighbor_array( void ) {
 
-      // Insert the new item at the end of the array
-      i = heap->size;
-      heap->items[i] = item;
-      heap->dists[i] = dist;
-      heap->size++;
+   ap_NeighborArray *array = malloc( sizeof( ap_NeighborArray ) );
+   assert( array );
+   array->size = 0;
+   array->capacity = NEIGHBOR_ARRAY_SIZE;
+   array->items = malloc( array->capacity * sizeof( ap_Neighbor ) );
+   assert( array->items );
 
-      // Sift the new item upward
-      heap_sift_up( heap, i );
+   return array;
+}
 
-      return true;
-   } else {
 
-      // Return if the heap has reached its maximum size
-      return false;
+// Append point p with a distance value to the array, doubling
+// its capacity when full. The caller must know that p is not
+// already in the array.
+void
+neighbor_array_append( ap_NeighborArray *array, ap_Point *p, double dist ) {
+
+   if( array->size == array->capacity ) {
+      array->capacity *= 2;
+      array->items = realloc( array->items, array->capacity * sizeof( ap_Neighbor ) );
+      assert( array->items );
    }
+   array->items[array->size].dist = dist;
+   array->items[array->size].p = p;
+   array->size++;
+}
+
+
+// Visitor that appends each point to the ap_NeighborArray
+// passed as data.
+void
+neighbor_array_visit( ap_Point *p, double dist, void *data ) {
+
+   neighbor_array_append( (ap_NeighborArray*)data, p, dist );
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+                    ARENA OPERATIONS
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+
+// Create a new, empty ap_Arena. Memory is reserved from the
+// system in blocks of at least block_size bytes, growing
+// geometrically as the arena fills.
+ap_Arena*
+create_arena( size_t block_size ) {
+
+   ap_Arena *arena = malloc( sizeof( ap_Arena ) );
+   assert( arena );
+   arena->block_size = max( block_size, 1024 );
+   arena->blocks = NULL;
+   arena->spare = NULL;
+   arena->reserved = 0;
+
+   return arena;
 }
 
 
-// Remove the first item in the heap and return a pointer to
-// it. Returns NULL if the heap is empty.
+// Allocate size bytes from arena. The memory is aligned for
+// any type and cannot be freed on its own; it is released
+// by arena_release, reset_arena, or free_arena. If arena is
+// NULL, the memory is allocated with malloc instead.
 void*
-heap_pop( ap_Heap *heap ) {
+arena_alloc( ap_Arena *arena, size_t size ) {
 
-   // Return if the heap is empty
-   if( heap->size == 0 )
-      return NULL;
+   void *ptr;
+   ap_ArenaBlock *block;
+
+   if( arena == NULL ) {
+      ptr = malloc( max( size, 1 ) );
+      assert( ptr );
+      return ptr;
+   }
+
+   size = ( size + ARENA_ALIGNMENT - 1 ) & ~(size_t)( ARENA_ALIGNMENT - 1 );
+
+   // Start a new block if the current one is full, reusing a
+   // spare block if it is large enough
+   block = arena->blocks;
+   if( block == NULL || block->used + size > block->size ) {
+      if( arena->spare != NULL && arena->spare->size >= size ) {
+         block = arena->spare;
+         arena->spare = block->next;
+      } else {
+         size_t block_size = max( arena->block_size, size );
+         block = malloc( sizeof( ap_ArenaBlock ) + block_size );
+         assert( block );
+         block->size = block_size;
+         arena->reserved += block_size;
+         arena->block_size = min( 2 * arena->block_size, ARENA_MAX_BLOCK_SIZE );
+      }
+      block->used = 0;
+      block->next = arena->blocks;
+      arena->blocks = block;
+   }
+
+   ptr = block->data + block->used;
+   block->used += size;
+
+   return ptr;
+}
 
-   void* first_item = heap->items[0];
 
-   // Replace the root with the last item in the list
-   heap->items[0] = heap->items[heap->size-1];
-   heap->dists[0] = heap->dists[heap->size-1];
-   heap->size--;
+// Record the current extent of arena, so that everything
+// allocated after this point can later be released with
+// arena_release.
+ap_ArenaMark
+arena_mark( ap_Arena *arena ) {
 
-   // Sift the moved item downward
-   heap_sift_down( heap, 0 );
+   ap_ArenaMark mark;
+   mark.block = arena->blocks;
+   mark.used = arena->blocks != NULL ? arena->blocks->used : 0;
 
-   return first_item;
+   return mark;
 }
 
 
-// Create an ap_PointList from an ap_Heap. The points in the
-// list will be sorted by distance in ascending/descending
-// order if the heap is a max-/min-heap. This function
-// assumes the items in the heap are ap_Points.
-ap_PointList*
-heap_to_list( ap_Heap *heap ) {
+// Release everything allocated from arena since mark was
+// taken. Blocks that become empty are kept for reuse.
+void
+arena_release( ap_Arena *arena, ap_ArenaMark mark ) {
+
+   ap_ArenaBlock *block;
+   while( arena->blocks != mark.block ) {
+      block = arena->blocks;
+      arena->blocks = block->next;
+      block->next = arena->spare;
+      arena->spare = block;
+   }
+   if( mark.block != NULL )
+      mark.block->used = mark.used;
+}
 
-   int i;
-   double dist;
-   ap_PointList *new_list = NULL;
 
-   // Create a copy of the heap (because it will be destroyed
-   // below)
-   ap_Heap *new_heap = malloc( sizeof( ap_Heap ) );
-   assert( new_heap );
-   new_heap->is_max_heap = heap->is_max_heap;
-   new_heap->max_size = heap->max_size;
-   new_heap->size = heap->size;
-   new_heap->capacity = heap->capacity;
-   new_heap->items = calloc( new_heap->capacity, sizeof( void* ) );
-   new_heap->dists = calloc( new_heap->capacity, sizeof( double ) );
-   assert( new_heap->items && new_heap->dists );
-   for( i = 0; i < heap->size; i++ ) {
-      new_heap->items[i] = heap->items[i];
-      new_heap->dists[i] = heap->dists[i];
-   }
-
-   // Copy the points from the heap into a list (the sequence
-   // of calls to add_point reverses the order)
-   while( new_heap->size > 0 ) {
-      dist = new_heap->dists[0];
-      add_point( &new_list, (ap_Point*)heap_pop( new_heap ), dist );
-   }
-   free_heap( new_heap );
+// Release everything allocated from arena, keeping its
+// blocks for reuse.
+void
+reset_arena( ap_Arena *arena ) {
 
-   return new_list;
+   ap_ArenaMark empty = { NULL, 0 };
+   arena_release( arena, empty );
 }
 
 
@@ -1128,51 +2614,118 @@ heap_to_list( ap_Heap *heap ) {
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
 
-// Recursively free up memory used by an ap_Tree.
+// Free up memory used by an ap_Tree. The tree must be a
+// root created by build_tree; all of its memory, including
+// the ancestor lists of its points, is released at once.
 void
 free_tree( ap_Tree *tree ) {
 
    if( tree != NULL ) {
-      if( tree->is_leaf ) {
-         free_cluster( tree->cluster );
-      } else {
-         free_tree( tree->left );
-         free_tree( tree->right );
-      }
-      free( tree );
+      assert( tree->arena );
+      free_arena( tree->arena );
    }
 }
 
 
-// Free up memory used by an ap_Cluster.
+// Free up memory used by an ap_Cluster that was created by
+// build_cluster without an arena.
 void
 free_cluster( ap_Cluster *cluster ) {
 
    if( cluster != NULL ) {
-      free_list( cluster->members );
+      free( cluster->members );
+      free( cluster->dists );
       free( cluster );
    }
 }
 
 
-// Recursively free up memory used by an ap_PointList.
+// Free up memory used by an ap_PointList whose members were
+// allocated with malloc.
 void
 free_list( ap_PointList *list ) {
 
-   if( list != NULL ) {
-      free_list( list->next );
+   ap_PointList *next;
+   while( list != NULL ) {
+      next = list->next;
       free( list );
+      list = next;
    }
 }
 
 
-// Free up memory used by an ap_Heap.
-void free_heap( ap_Heap *heap ) {
+// Free up memory used by an ap_PointQueue.
+void
+free_point_queue( ap_PointQueue *point_pq ) {
+
+   if( point_pq != NULL ) {
+      free( point_pq->items );
+      free( point_pq );
+   }
+}
+
+
+// Free up memory used by an ap_TreeQueue.
+void
+free_tree_queue( ap_TreeQueue *tree_pq ) {
+
+   if( tree_pq != NULL ) {
+      free( tree_pq->items );
+      free( tree_pq );
+   }
+}
+
+
+// Free up memory used by an ap_NeighborArray.
+void
+free_neighbor_array( ap_NeighborArray *array ) {
+
+   if( array != NULL ) {
+      free( array->items );
+      free( array );
+   }
+}
+
+
+// Free up memory used by an ap_NeighborIterator.
+void
+free_neighbor_iterator( ap_NeighborIterator *iter ) {
+
+   if( iter != NULL ) {
+      free_tree_queue( iter->tree_pq );
+      free( iter->items );
+      free( iter );
+   }
+}
+
+
+// Free up memory used by an ap_Arena, including everything
+// allocated from it.
+void
+free_arena( ap_Arena *arena ) {
+
+   ap_ArenaBlock *block;
+   if( arena != NULL ) {
+      reset_arena( arena );
+      while( arena->spare != NULL ) {
+         block = arena->spare;
+         arena->spare = block->next;
+         free( block );
+      }
+      free( arena );
+   }
+}
+
+
+// Free up memory used by an ap_Index. The points themselves
+// are not freed.
+void
+free_index( ap_Index *index ) {
 
-   if( heap != NULL ) {
-      free( heap->items );
-      free( heap->dists );
-      free( heap );
+   if( index != NULL ) {
+      free_tree( index->tree );
+      free( index->points );
+      free( index );
    }
 }
 
@@ -22,14 +22,48 @@
 #define ANTIPOLE_H 
 
 #include <stdbool.h>
+#include <stddef.h>
 
 #define DIST_FUNC double (*dist)( ap_Point *p1, ap_Point *p2 )
+#define PROXY_FUNC double (*proxy)( ap_Point *p1, ap_Point *p2 )
+#define VISIT_FUNC void (*visit)( ap_Point *p, double dist, void *data )
+
+#define LEAF_SCAN_SIZE 16        /* clusters smaller than this are scanned without per-member bound checks */
+#define CALIBRATION_QUERIES 32   /* number of sample queries used to choose an index type */
+#define CALIBRATION_K 5          /* number of neighbors sought by calibration queries */
+#define SORTED_QUEUE_SIZE 32     /* point priority queues up to this size are kept as sorted arrays */
+#define NEIGHBOR_ARRAY_SIZE 16   /* initial capacity of a neighbor array */
+#define ARENA_BLOCK_SIZE 65536   /* size of the first block reserved by an arena */
+#define ARENA_MAX_BLOCK_SIZE 67108864  /* size beyond which arena blocks stop growing */
+#define ARENA_ALIGNMENT 16       /* alignment of every arena allocation */
+#define TUNE_STEPS 8             /* number of candidate radii tried when tuning target_radius */
+#define TUNE_PAIRS 256           /* number of pairs of points whose distances give the scale of the data */
+#define TUNE_QUERIES 64          /* number of points of the set used as queries when tuning without a workload */
+#define RESEED_TOLERANCE 1e-9    /* relative and absolute slack added to the bound of a reseeded search */
 
 typedef struct ap_Point ap_Point;
 typedef struct ap_PointList ap_PointList;
 typedef struct ap_Cluster ap_Cluster;
 typedef struct ap_Tree ap_Tree;
-typedef struct ap_Heap ap_Heap;
+typedef struct ap_Neighbor ap_Neighbor;
+typedef struct ap_NeighborArray ap_NeighborArray;
+typedef struct ap_PointQueue ap_PointQueue;
+typedef struct ap_TreeEntry ap_TreeEntry;
+typedef struct ap_TreeQueue ap_TreeQueue;
+typedef struct ap_Candidate ap_Candidate;
+typedef struct ap_NeighborIterator ap_NeighborIterator;
+typedef struct ap_Index ap_Index;
+typedef struct ap_Arena ap_Arena;
+typedef struct ap_ArenaBlock ap_ArenaBlock;
+typedef struct ap_ArenaMark ap_ArenaMark;
+typedef struct ap_RadiusTrial ap_RadiusTrial;
+typedef struct ap_DualTreeLeaf ap_DualTreeLeaf;
+
+typedef enum {
+   INDEX_AUTO,                /* choose between tree and flat by calibration */
+   INDEX_TREE,                /* antipole tree */
+   INDEX_FLAT                 /* brute-force scan of every point */
+} ap_IndexType;
 
 struct ap_Point {
    int id;                    /* point id */
@@ -45,63 +79,199 @@ struct ap_PointList {
 
 struct ap_Cluster {
    ap_Point *centroid;        /* geometric median of cluster */
+   bool centroid_is_antipole; /* whether the centroid is an antipole of an ancestor node */
    double radius;             /* distance from centroid to farthest point in cluster */
-   ap_PointList *members;     /* list of points in cluster */
+   int size;                  /* number of members in cluster (not counting the centroid) */
+   int n_antipoles;           /* number of members, at the end of the arrays, that are antipoles of ancestor nodes */
+   ap_Point **members;        /* array of points in cluster */
+   double *dists;             /* array of distances from members to centroid */
 };
 
 struct ap_Tree {
    bool is_leaf;              /* can be a leaf or an internal node */
    ap_Point *a, *b;           /* if internal node, pointers to antipoles */
    double radius_a, radius_b; /* if internal node, distances from antipoles to their farthest point in cluster */
+   bool try_a, try_b;         /* if internal node, whether the antipoles are not also antipoles of an ancestor */
    ap_Tree *left, *right;     /* if internal node, left and right branches */
    ap_Cluster *cluster;       /* if leaf, pointer to cluster */
+   ap_Arena *arena;           /* if root, memory pool owning the whole tree, or NULL otherwise */
+};
+
+struct ap_Neighbor {
+   double dist;               /* distance to query */
+   ap_Point *p;               /* point found */
+};
+
+struct ap_NeighborArray {
+   int size;                  /* number of neighbors in array */
+   int capacity;              /* number of neighbors allocated */
+   ap_Neighbor *items;        /* array of neighbors found */
+};
+
+struct ap_PointQueue {
+   int max_size;              /* max number of points the queue is permitted to contain */
+   int size;                  /* number of points in the queue */
+   bool is_sorted;            /* can be an array sorted by distance or a max-heap */
+   double bound;              /* distance to farthest point if the queue is full, or the range limit (infinity by default) otherwise */
+   ap_Neighbor *items;        /* array of points in queue */
+};
+
+struct ap_TreeEntry {
+   double dist;               /* lower bound on distance from query to subtree */
+   ap_Tree *tree;             /* subtree */
+};
+
+struct ap_TreeQueue {
+   int size;                  /* number of subtrees in the queue */
+   int capacity;              /* number of subtrees that can be stored before the array needs to grow */
+   ap_TreeEntry *items;       /* array of subtrees in queue, as a 4-ary min-heap */
+};
+
+struct ap_Candidate {
+   double dist;               /* distance to query if exact, or a lower bound on it otherwise */
+   ap_Point *p;               /* point not yet yielded */
+   bool exact;                /* whether dist has been calculated */
 };
 
-struct ap_Heap {
-   bool is_max_heap;          /* can be a max-heap or a min-heap */
-   int max_size;              /* max number of items the heap is permitted to contain */
-   int size;                  /* number of items in the heap */
-   int capacity;              /* number of items that can be stored before the arrays need to grow */
-   void **items;              /* array of items in heap, either *ap_Points or *ap_Trees */
-   double *dists;             /* array of distances to query */
+struct ap_NeighborIterator {
+   ap_Point *query;           /* point whose neighbors are yielded */
+   ap_TreeQueue *tree_pq;     /* subtrees not yet expanded, by lower bound on their distance */
+   int size;                  /* number of candidates in the queue */
+   int capacity;              /* number of candidates that can be stored before the array needs to grow */
+   ap_Candidate *items;       /* array of points not yet yielded, as a 4-ary min-heap */
+   int yielded;               /* number of neighbors yielded so far */
+};
+
+struct ap_ArenaBlock {
+   ap_ArenaBlock *next;       /* pointer to the previously used block */
+   size_t size;               /* number of bytes of data in block */
+   size_t used;               /* number of bytes of data allocated */
+   _Alignas(ARENA_ALIGNMENT) char data[]; /* memory handed out by the arena */
+};
+
+struct ap_Arena {
+   ap_ArenaBlock *blocks;     /* blocks in use, most recent first */
+   ap_ArenaBlock *spare;      /* released blocks kept for reuse */
+   size_t block_size;         /* size of the next block to reserve */
+   size_t reserved;           /* total number of bytes of data reserved from the system */
+};
+
+struct ap_ArenaMark {
+   ap_ArenaBlock *block;      /* most recent block when mark was taken */
+   size_t used;               /* number of bytes of that block in use */
+};
+
+struct ap_Index {
+   ap_IndexType type;         /* either INDEX_TREE or INDEX_FLAT once built */
+   int size;                  /* number of points in index */
+   ap_Point **points;         /* array of all points in index */
+   ap_Tree *tree;             /* if tree index, root of the antipole tree */
+   double target_radius;      /* target_radius the index was built with */
+};
+
+struct ap_RadiusTrial {
+   double target_radius;      /* candidate target_radius */
+   size_t memory;             /* number of bytes reserved by the trial tree */
+   double seconds_per_query;  /* mean time to search the trial tree */
+   double dists_per_query;    /* mean number of distances calculated per search */
+   bool within_budget;        /* whether the trial tree fit the memory budget */
+};
+
+struct ap_DualTreeLeaf {
+   ap_Cluster *cluster;       /* cluster of a leaf of the query tree */
+   ap_PointQueue **point_pqs; /* point priority queue of the centroid, then of each member */
 };
 
 ap_Tree* build_tree( ap_PointList *set, double target_radius, ap_Point *antipole_a, ap_Point *antipole_b, int dimensionality, DIST_FUNC );
-ap_Cluster* build_cluster( ap_PointList *set, int dimensionality, DIST_FUNC );
+ap_Tree* build_subtree( ap_PointList *set, double target_radius, ap_Point *antipole_a, ap_Point *antipole_b, int dimensionality, ap_Arena *arena, ap_Arena *scratch, DIST_FUNC );
+ap_Cluster* build_cluster( ap_PointList *set, int dimensionality, ap_Arena *arena, ap_Arena *scratch, DIST_FUNC );
+ap_Index* build_index( ap_PointList *set, double target_radius, ap_IndexType type, int dimensionality, DIST_FUNC );
+double tune_target_radius( ap_PointList *set, ap_Point **queries, int n_query, int k, size_t memory_budget, int dimensionality, ap_RadiusTrial *trials, DIST_FUNC );
+int compare_doubles( const void *a, const void *b );
 
-void range_search( ap_Tree *tree, ap_Point *query, double range, ap_PointList **out, DIST_FUNC );
-void range_search_cluster( ap_Cluster *cluster, ap_Point *query, double range, ap_PointList **out, DIST_FUNC );
+void range_search( ap_Tree *tree, ap_Point *query, double range, ap_NeighborArray *out, DIST_FUNC );
+int range_search_visit( ap_Tree *tree, ap_Point *query, double range, void *data, VISIT_FUNC, PROXY_FUNC, DIST_FUNC );
+int range_search_cluster_visit( ap_Cluster *cluster, ap_Point *query, double range, void *data, VISIT_FUNC, PROXY_FUNC, DIST_FUNC );
 void nearest_neighbor_search( ap_Tree *tree, ap_Point *query, int k, ap_PointList **out, DIST_FUNC );
-void nearest_neighbor_search_cluster( ap_Cluster *cluster, ap_Point *query, ap_Heap *point_pq, DIST_FUNC );
-bool nearest_neighbor_search_try_point( ap_Heap *point_pq, ap_Point *p, double dist );
+void nearest_neighbor_search_within( ap_Tree *tree, ap_Point *query, int k, double range, ap_PointList **out, PROXY_FUNC, DIST_FUNC );
+void nearest_neighbor_search_cluster( ap_Cluster *cluster, ap_Point *query, ap_PointQueue *point_pq, bool include_antipoles, PROXY_FUNC, DIST_FUNC );
+void nearest_neighbor_search_batch( ap_Tree *tree, ap_Point **queries, int n_query, int k, ap_PointList **out, DIST_FUNC );
+void nearest_neighbor_search_batch_node( ap_Tree *tree, ap_Point **queries, ap_PointQueue **point_pqs, int *active, int n_active, DIST_FUNC );
+void nearest_neighbor_search_batch_cluster( ap_Cluster *cluster, ap_Point **queries, ap_PointQueue **point_pqs, int *active, int n_active, DIST_FUNC );
+void nearest_neighbor_search_dual_tree( ap_Tree *query_tree, ap_Tree *tree, ap_Point **queries, int n_query, int k, ap_PointList **out, DIST_FUNC );
+double nearest_neighbor_search_dual_tree_node( ap_Tree *query_node, ap_Point *query_center, double query_radius, ap_Tree *node, ap_Point *center, double radius, double bound, ap_DualTreeLeaf *leaves, int n_leaves, DIST_FUNC );
+int count_tree_leaves( ap_Tree *tree );
+void collect_tree_leaves( ap_Tree *tree, ap_DualTreeLeaf *leaves, int *n_leaves );
+int compare_dual_tree_leaves( const void *a, const void *b );
+void nearest_neighbor_search_variants( ap_Tree *tree, ap_Point **variants, int n_variants, int k, ap_PointList **out, int *orientations, DIST_FUNC );
+void nearest_neighbor_search_variants_cluster( ap_Cluster *cluster, ap_Point **variants, int n_variants, double *dists, ap_PointQueue *point_pq, DIST_FUNC );
+double variants_dist( ap_Point *p, ap_Point **variants, int n_variants, double *dists, int *nearest, DIST_FUNC );
+ap_NeighborIterator* create_neighbor_iterator( ap_Tree *tree, ap_Point *query );
+ap_Point* neighbor_iterator_next( ap_NeighborIterator *iter, double *dist_out, DIST_FUNC );
+void neighbor_iterator_expand( ap_NeighborIterator *iter, ap_Tree *tree, DIST_FUNC );
+void flat_range_search( ap_Point **points, int size, ap_Point *query, double range, ap_NeighborArray *out, DIST_FUNC );
+int flat_range_search_visit( ap_Point **points, int size, ap_Point *query, double range, void *data, VISIT_FUNC, PROXY_FUNC, DIST_FUNC );
+void flat_nearest_neighbor_search( ap_Point **points, int size, ap_Point *query, int k, ap_PointList **out, DIST_FUNC );
+void flat_nearest_neighbor_search_within( ap_Point **points, int size, ap_Point *query, int k, double range, ap_PointList **out, PROXY_FUNC, DIST_FUNC );
+void flat_nearest_neighbor_search_batch( ap_Point **points, int size, ap_Point **queries, int n_query, int k, ap_PointList **out, DIST_FUNC );
+void flat_nearest_neighbor_search_variants( ap_Point **points, int size, ap_Point **variants, int n_variants, int k, ap_PointList **out, int *orientations, DIST_FUNC );
+void index_range_search( ap_Index *index, ap_Point *query, double range, ap_NeighborArray *out, DIST_FUNC );
+int index_range_count( ap_Index *index, ap_Point *query, double range, DIST_FUNC );
+int index_range_search_visit( ap_Index *index, ap_Point *query, double range, void *data, VISIT_FUNC, PROXY_FUNC, DIST_FUNC );
+void index_nearest_neighbor_search( ap_Index *index, ap_Point *query, int k, ap_PointList **out, DIST_FUNC );
+void index_nearest_neighbor_search_within( ap_Index *index, ap_Point *query, int k, double range, ap_PointList **out, PROXY_FUNC, DIST_FUNC );
+bool reseed_nearest_neighbor_search( ap_Index *index, ap_Point *query, int k, ap_Point *old_query, ap_Neighbor *old_neighbors, int n, ap_PointList **out, PROXY_FUNC, DIST_FUNC );
+void index_nearest_neighbor_search_batch( ap_Index *index, ap_Point **queries, int n_query, int k, ap_PointList **out, DIST_FUNC );
+void index_nearest_neighbor_search_variants( ap_Index *index, ap_Point **variants, int n_variants, int k, ap_PointList **out, int *orientations, DIST_FUNC );
+ap_NeighborIterator* create_index_neighbor_iterator( ap_Index *index, ap_Point *query );
 
 void exact_1_median( ap_PointList *set, ap_Point **median, DIST_FUNC );
-void approx_1_median( ap_PointList *set, ap_Point **median, int dimensionality, DIST_FUNC );
+void approx_1_median( ap_PointList *set, ap_Point **median, int dimensionality, ap_Arena *scratch, DIST_FUNC );
 void exact_antipoles( ap_PointList *set, ap_Point **antipole_a, ap_Point **antipole_b, DIST_FUNC );
-void approx_antipoles( ap_PointList *set, ap_Point **antipole_a, ap_Point **antipole_b, int dimensionality, DIST_FUNC );
+void approx_antipoles( ap_PointList *set, ap_Point **antipole_a, ap_Point **antipole_b, int dimensionality, ap_Arena *scratch, DIST_FUNC );
 void first_approx_antipoles( ap_PointList *set, ap_Point **antipole_a, ap_Point **antipole_b, double target_radius, DIST_FUNC );
 void check_ancestors_for_antipoles( ap_PointList *set, double target_radius, ap_Point *ancestor, ap_Point **antipole_a, ap_Point **antipole_b );
 
 bool add_point( ap_PointList **set, ap_Point *p, double dist );
+void prepend_point( ap_PointList **set, ap_Point *p, double dist, ap_Arena *arena );
 bool move_point( ap_Point *p, ap_PointList **from, ap_PointList **to );
 bool move_nth_point( int n, ap_PointList **from, ap_PointList **to );
-ap_PointList* copy_list( ap_PointList *set );
+ap_PointList* copy_list( ap_PointList *set, ap_Arena *arena );
+bool list_contains( ap_PointList *set, ap_Point *p );
 int list_size( ap_PointList *set );
+int compare_point_addresses( const void *a, const void *b );
+int find_point( ap_Point **sorted, int size, ap_Point *p );
+
+ap_PointQueue* create_point_queue( int max_size );
+bool point_queue_insert( ap_PointQueue *point_pq, ap_Point *p, double dist );
+void point_queue_limit( ap_PointQueue *point_pq, double range );
+int compare_neighbors( const void *a, const void *b );
+ap_PointList* point_queue_to_list( ap_PointQueue *point_pq );
+ap_TreeQueue* create_tree_queue( void );
+void tree_queue_insert( ap_TreeQueue *tree_pq, ap_Tree *tree, double dist );
+ap_Tree* tree_queue_pop( ap_TreeQueue *tree_pq );
+void candidate_queue_insert( ap_NeighborIterator *iter, ap_Point *p, double dist, bool exact );
+ap_Candidate candidate_queue_pop( ap_NeighborIterator *iter );
+
+ap_NeighborArray* create_neighbor_array( void );
+void neighbor_array_append( ap_NeighborArray *array, ap_Point *p, double dist );
+void neighbor_array_visit( ap_Point *p, double dist, void *data );
 
-ap_Heap* create_heap( bool is_max_heap, int max_size );
-bool heap_is_full( ap_Heap *heap );
-void heap_grow( ap_Heap *heap );
-bool heap_swap( ap_Heap *heap, int i, int j );
-void heap_sift_down( ap_Heap *heap, int index );
-void heap_sift_up( ap_Heap *heap, int index );
-bool heap_insert( ap_Heap *heap, void *item, double dist );
-void* heap_pop( ap_Heap *heap );
-ap_PointList* heap_to_list( ap_Heap *heap );
+ap_Arena* create_arena( size_t block_size );
+void* arena_alloc( ap_Arena *arena, size_t size );
+ap_ArenaMark arena_mark( ap_Arena *arena );
+void arena_release( ap_Arena *arena, ap_ArenaMark mark );
+void reset_arena( ap_Arena *arena );
 
 void free_tree( ap_Tree *tree );
 void free_cluster( ap_Cluster *cluster );
 void free_list( ap_PointList *set );
-void free_heap( ap_Heap *heap );
+void free_point_queue( ap_PointQueue *point_pq );
+void free_tree_queue( ap_TreeQueue *tree_pq );
+void free_neighbor_array( ap_NeighborArray *array );
+void free_neighbor_iterator( ap_NeighborIterator *iter );
+void free_arena( ap_Arena *arena );
+void free_index( ap_Index *index );
 
 #endif /* ANTIPOLE_H */
 
@@ -0,0 +1,324 @@
+/* atlas.c
+ *
+ * Copyright (c) 2011, Jeffrey P. Gill
+ *
+ * This file is part of photomosaic.
+ *
+ * photomosaic is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * photomosaic is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with photomosaic.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>  /* assert */
+#include <fcntl.h>   /* open */
+#include <stdlib.h>  /* NULL, malloc */
+#include <string.h>  /* memcpy, memcmp, memset */
+#include <sys/mman.h> /* mmap, msync, munmap */
+#include <sys/stat.h> /* fstat */
+#include <unistd.h>  /* ftruncate, pwrite, close */
+#include "atlas.h"
+#include "trace.h"
+
+#define min(a,b) ((a) < (b) ? (a) : (b))
+#define max(a,b) ((a) > (b) ? (a) : (b))
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+                    ATLAS FILE FUNCTIONS
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+
+// Create an empty atlas file at path with a slot for each
+// tile id from 0 to n_tiles-1, holding every power-of-two
+// size of the tile from min_size up to max_size pixels
+// square (sizes that are not powers of two are rounded up).
+// Slots are fixed-size so a tile is found by id alone, and
+// the file is sparse until tiles are added. Returns NULL if
+// the file could not be created.
+ap_Atlas*
+create_atlas( const char *path, int n_tiles, int min_size, int max_size ) {
+
+   int level;
+   ap_AtlasHeader header;
+
+   memset( &header, 0, sizeof( ap_AtlasHeader ) );
+   memcpy( header.magic, ATLAS_MAGIC, sizeof( header.magic ) );
+   header.version = ATLAS_VERSION;
+   header.channels = ATLAS_CHANNELS;
+   header.min_level = atlas_log2( max( min_size, 1 ) );
+   header.max_level = max( atlas_log2( max( max_size, 1 ) ), (int)header.min_level );
+   if( header.max_level - header.min_level >= ATLAS_MAX_LEVELS || n_tiles < 0 )
+      return NULL;
+   header.n_tiles = n_tiles;
+   header.tile_bytes = 0;
+   for( level = header.min_level; level <= (int)header.max_level; level++ )
+      header.tile_bytes += ( (uint64_t)1 << ( 2 * level ) ) * ATLAS_CHANNELS;
+
+   // Start the tile slots on a page boundary after the header
+   // and the table of present flags
+   long page_size = sysconf( _SC_PAGESIZE );
+   header.data_offset = ( sizeof( ap_AtlasHeader ) + n_tiles + page_size - 1 ) / page_size * page_size;
+
+   int fd = open( path, O_RDWR | O_CREAT | O_TRUNC, 0644 );
+   if( fd < 0 )
+      return NULL;
+   if( pwrite( fd, &header, sizeof( ap_AtlasHeader ), 0 ) != sizeof( ap_AtlasHeader ) ||
+         ftruncate( fd, header.data_offset + header.n_tiles * header.tile_bytes ) != 0 ) {
+      close( fd );
+      return NULL;
+   }
+
+   return map_atlas( fd, true );
+}
+
+
+// Open an existing atlas file at path for rendering. Returns
+// NULL if the file could not be opened or is not an atlas.
+ap_Atlas*
+open_atlas( const char *path ) {
+
+   int fd = open( path, O_RDONLY );
+   if( fd < 0 )
+      return NULL;
+
+   return map_atlas( fd, false );
+}
+
+
+// Map the whole of an open atlas file into memory, taking
+// ownership of fd. Returns NULL, closing fd, if the file is
+// not a valid atlas.
+ap_Atlas*
+map_atlas( int fd, bool writable ) {
+
+   int i;
+   struct stat st;
+   ap_AtlasHeader header;
+
+   if( fstat( fd, &st ) != 0 || (size_t)st.st_size < sizeof( ap_AtlasHeader ) ) {
+      close( fd );
+      return NULL;
+   }
+   uint8_t *map = mmap( NULL, st.st_size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0 );
+   if( map == MAP_FAILED ) {
+      close( fd );
+      return NULL;
+   }
+
+   memcpy( &header, map, sizeof( ap_AtlasHeader ) );
+   if( memcmp( header.magic, ATLAS_MAGIC, sizeof( header.magic ) ) != 0 || header.version != ATLAS_VERSION ||
+         header.channels != ATLAS_CHANNELS || header.max_level < header.min_level ||
+         header.max_level - header.min_level >= ATLAS_MAX_LEVELS || header.data_offset < sizeof( ap_AtlasHeader ) + header.n_tiles ||
+         header.data_offset + header.n_tiles * header.tile_bytes > (uint64_t)st.st_size ) {
+      munmap( map, st.st_size );
+      close( fd );
+      return NULL;
+   }
+
+   // Create the new ap_Atlas
+   ap_Atlas *atlas = malloc( sizeof( ap_Atlas ) );
+   assert( atlas );
+   atlas->fd = fd;
+   atlas->writable = writable;
+   atlas->min_level = header.min_level;
+   atlas->max_level = header.max_level;
+   atlas->n_tiles = header.n_tiles;
+   atlas->tile_bytes = header.tile_bytes;
+   atlas->map_size = st.st_size;
+   atlas->map = map;
+   atlas->present = map + sizeof( ap_AtlasHeader );
+   atlas->tiles = map + header.data_offset;
+
+   // Lay the levels out largest first within each slot
+   atlas->level_offsets[0] = 0;
+   for( i = 1; i <= atlas->max_level - atlas->min_level; i++ )
+      atlas->level_offsets[i] = atlas->level_offsets[i-1] + ( (size_t)1 << ( 2 * ( atlas->max_level - i + 1 ) ) ) * ATLAS_CHANNELS;
+
+   return atlas;
+}
+
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+                    TILE INGESTION FUNCTIONS
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+
+// Store a decoded tile in its slot at every level. pixels
+// holds width x height pixels of ATLAS_CHANNELS bytes, with
+// rows stride bytes apart. The largest centered square of
+// the tile is area-averaged down to the largest level, and
+// each smaller level is averaged from the one above it, so
+// the source only has to be decoded and scaled once. Returns
+// true if the tile was stored, or false otherwise.
+bool
+atlas_add_tile( ap_Atlas *atlas, int id, const uint8_t *pixels, int width, int height, size_t stride ) {
+
+   int x, y, sx, sy, x0, x1, y0, y1, c, level;
+   unsigned sums[ATLAS_CHANNELS];
+
+   if( !atlas->writable || id < 0 || id >= atlas->n_tiles || width < 1 || height < 1 )
+      return false;
+
+   double start = trace_begin();
+
+   // Crop the largest centered square
+   int side = min( width, height );
+   pixels += ( height - side ) / 2 * stride + ( width - side ) / 2 * ATLAS_CHANNELS;
+
+   // Average the source pixels covered by each pixel of the
+   // largest level
+   int size = 1 << atlas->max_level;
+   uint8_t *dst = atlas_tile( atlas, id, atlas->max_level );
+   for( y = 0; y < size; y++ ) {
+      y0 = (long)y * side / size;
+      y1 = max( (long)( y + 1 ) * side / size, y0 + 1 );
+      for( x = 0; x < size; x++ ) {
+         x0 = (long)x * side / size;
+         x1 = max( (long)( x + 1 ) * side / size, x0 + 1 );
+         memset( sums, 0, sizeof( sums ) );
+         for( sy = y0; sy < y1; sy++ )
+            for( sx = x0; sx < x1; sx++ )
+               for( c = 0; c < ATLAS_CHANNELS; c++ )
+                  sums[c] += pixels[sy * stride + sx * ATLAS_CHANNELS + c];
+         for( c = 0; c < ATLAS_CHANNELS; c++ )
+            dst[( y * size + x ) * ATLAS_CHANNELS + c] = ( sums[c] + ( y1 - y0 ) * ( x1 - x0 ) / 2 ) / ( ( y1 - y0 ) * ( x1 - x0 ) );
+      }
+   }
+
+   // Build the rest of the pyramid
+   for( level = atlas->max_level; level > atlas->min_level; level-- )
+      atlas_downsample( atlas_tile( atlas, id, level ), 1 << level, atlas_tile( atlas, id, level - 1 ) );
+
+   atlas->present[id] = 1;
+   trace_end( "ingest", "atlas_add_tile", start );
+
+   return true;
+}
+
+
+// Average each 2 x 2 block of pixels of a src_size x
+// src_size level into one pixel of the next smaller level
+void
+atlas_downsample( const uint8_t *src, int src_size, uint8_t *dst ) {
+
+   int x, y, c;
+   int size = src_size / 2;
+   size_t row = src_size * ATLAS_CHANNELS;
+
+   for( y = 0; y < size; y++ ) {
+      for( x = 0; x < size; x++ ) {
+         const uint8_t *s = src + 2 * y * row + 2 * x * ATLAS_CHANNELS;
+         for( c = 0; c < ATLAS_CHANNELS; c++ )
+            dst[( y * size + x ) * ATLAS_CHANNELS + c] = ( s[c] + s[ATLAS_CHANNELS + c] + s[row + c] + s[row + ATLAS_CHANNELS + c] + 2 ) / 4;
+      }
+   }
+}
+
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+                    RENDERING FUNCTIONS
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+
+// Return the pixels of one level of a tile, a square of
+// 2^level pixels on a side, or NULL if the id or level is
+// out of range
+uint8_t*
+atlas_tile( ap_Atlas *atlas, int id, int level ) {
+
+   if( id < 0 || id >= atlas->n_tiles || level < atlas->min_level || level > atlas->max_level )
+      return NULL;
+
+   return atlas->tiles + (size_t)id * atlas->tile_bytes + atlas->level_offsets[atlas->max_level - level];
+}
+
+
+// Return the level to draw a tile from at the given cell
+// size: the smallest level at least as large as the cell,
+// or the largest level if none is
+int
+atlas_level( ap_Atlas *atlas, int cell_size ) {
+
+   return min( max( atlas_log2( max( cell_size, 1 ) ), atlas->min_level ), atlas->max_level );
+}
+
+
+// Draw a tile into a cell_size x cell_size square of an
+// output image whose rows are dst_stride bytes apart. When
+// the cell size is one of the atlas's levels, each row is a
+// single memcpy; otherwise the nearest level is sampled.
+// Returns true if the tile was drawn, or false if the atlas
+// holds no tile with that id.
+bool
+atlas_blit( ap_Atlas *atlas, int id, int cell_size, uint8_t *dst, size_t dst_stride ) {
+
+   int x, y, sx, sy;
+
+   if( id < 0 || id >= atlas->n_tiles || !atlas->present[id] )
+      return false;
+
+   double start = trace_begin();
+   int level = atlas_level( atlas, cell_size );
+   int size = 1 << level;
+   const uint8_t *src = atlas_tile( atlas, id, level );
+
+   if( size == cell_size ) {
+      for( y = 0; y < size; y++ )
+         memcpy( dst + y * dst_stride, src + (size_t)y * size * ATLAS_CHANNELS, size * ATLAS_CHANNELS );
+      trace_end( "render", "atlas_blit", start );
+      return true;
+   }
+
+   for( y = 0; y < cell_size; y++ ) {
+      sy = (long)y * size / cell_size;
+      for( x = 0; x < cell_size; x++ ) {
+         sx = (long)x * size / cell_size;
+         memcpy( dst + y * dst_stride + x * ATLAS_CHANNELS, src + ( (size_t)sy * size + sx ) * ATLAS_CHANNELS, ATLAS_CHANNELS );
+      }
+   }
+   trace_end( "render", "atlas_blit", start );
+
+   return true;
+}
+
+
+// Return the base-2 logarithm of size, rounded up
+int
+atlas_log2( int size ) {
+
+   int level = 0;
+   while( ( 1 << level ) < size )
+      level++;
+
+   return level;
+}
+
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+                   MEMORY FREEING FUNCTIONS
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+
+// Unmap and close the atlas, first writing any added tiles
+// back to the file
+void
+free_atlas( ap_Atlas *atlas ) {
+
+   if( atlas->writable )
+      msync( atlas->map, atlas->map_size, MS_SYNC );
+   munmap( atlas->map, atlas->map_size );
+   close( atlas->fd );
+   free( atlas );
+}
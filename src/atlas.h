@@ -0,0 +1,72 @@
+/* atlas.h
+ *
+ * Copyright (c) 2011, Jeffrey P. Gill
+ *
+ * This file is part of photomosaic.
+ *
+ * photomosaic is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * photomosaic is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with photomosaic.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ATLAS_H
+#define ATLAS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define ATLAS_MAGIC "APATLAS"    /* identifies a tile atlas file */
+#define ATLAS_VERSION 1          /* version of the tile atlas format */
+#define ATLAS_CHANNELS 3         /* number of 8-bit channels in each pixel */
+#define ATLAS_MAX_LEVELS 16      /* largest number of mip levels in an atlas */
+
+typedef struct ap_AtlasHeader ap_AtlasHeader;
+typedef struct ap_Atlas ap_Atlas;
+
+struct ap_AtlasHeader {
+   char magic[8];             /* ATLAS_MAGIC */
+   uint32_t version;          /* ATLAS_VERSION */
+   uint32_t channels;         /* ATLAS_CHANNELS */
+   uint32_t min_level;        /* log2 of the size of the smallest level */
+   uint32_t max_level;        /* log2 of the size of the largest level */
+   uint64_t n_tiles;          /* number of tile slots, one for each id from 0 to n_tiles-1 */
+   uint64_t tile_bytes;       /* number of bytes of every level of one tile */
+   uint64_t data_offset;      /* position of the first tile slot in the file */
+};                            /* followed by n_tiles bytes flagging which slots hold a tile */
+
+struct ap_Atlas {
+   int fd;                    /* open atlas file */
+   bool writable;             /* whether tiles may be added */
+   int min_level, max_level;  /* log2 of the sizes of the smallest and largest levels */
+   int n_tiles;               /* number of tile slots */
+   size_t tile_bytes;         /* number of bytes of every level of one tile */
+   size_t level_offsets[ATLAS_MAX_LEVELS];  /* position of each level within a tile slot, largest level first */
+   size_t map_size;           /* number of bytes mapped */
+   uint8_t *map;              /* the whole file mapped into memory */
+   uint8_t *present;          /* flag for each slot that holds a tile */
+   uint8_t *tiles;            /* the first tile slot */
+};
+
+ap_Atlas* create_atlas( const char *path, int n_tiles, int min_size, int max_size );
+ap_Atlas* open_atlas( const char *path );
+ap_Atlas* map_atlas( int fd, bool writable );
+bool atlas_add_tile( ap_Atlas *atlas, int id, const uint8_t *pixels, int width, int height, size_t stride );
+void atlas_downsample( const uint8_t *src, int src_size, uint8_t *dst );
+uint8_t* atlas_tile( ap_Atlas *atlas, int id, int level );
+int atlas_level( ap_Atlas *atlas, int cell_size );
+bool atlas_blit( ap_Atlas *atlas, int id, int cell_size, uint8_t *dst, size_t dst_stride );
+int atlas_log2( int size );
+
+void free_atlas( ap_Atlas *atlas );
+
+#endif
@@ -0,0 +1,199 @@
+/* bench.c
+ *
+ * Copyright (c) 2011, Jeffrey P. Gill
+ *
+ * This file is part of photomosaic.
+ *
+ * photomosaic is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * photomosaic is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with photomosaic.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>     /* assert */
+#include <math.h>       /* sqrt */
+#include <stdio.h>      /* printf */
+#include <stdlib.h>     /* atoi, getenv, rand */
+#include <time.h>       /* clock_gettime */
+#include "antipole.h"
+#include "disk.h"
+#include "numa.h"
+#include "perf.h"
+#include "trace.h"
+
+int DIM = 4;               /* dimensionality of the benchmark data */
+
+// Calculate the Euclidian distance between two points
+double
+dist( ap_Point *p1, ap_Point *p2 ) {
+
+   int i;
+   double d, sum = 0;
+   for( i = 0; i < DIM; i++ ) {
+      d = ((double*)p1->vec)[i] - ((double*)p2->vec)[i];
+      sum += d * d;
+   }
+
+   return sqrt( sum );
+}
+
+
+// Return the time in seconds from a monotonic clock
+double
+now( void ) {
+
+   struct timespec ts;
+   clock_gettime( CLOCK_MONOTONIC, &ts );
+   return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+// Create a point with a random position vector
+ap_Point*
+random_point( int id ) {
+
+   int i;
+   ap_Point *p = malloc( sizeof( ap_Point ) );
+   double *vec = malloc( DIM * sizeof( double ) );
+   assert( p && vec );
+   for( i = 0; i < DIM; i++ )
+      vec[i] = (double)rand() / (double)RAND_MAX;
+   p->id = id;
+   p->vec = vec;
+   p->ancestors = NULL;
+
+   return p;
+}
+
+
+// Search the tree with one query at a time on this thread
+// and report the throughput and the counters per query
+void
+run_serial( ap_Tree *tree, ap_Point **queries, int n_query, int k, ap_PerfCounters *counters ) {
+
+   int i;
+   ap_PointList *out;
+
+   perf_start( counters );
+   double start = now();
+   for( i = 0; i < n_query; i++ ) {
+      nearest_neighbor_search( tree, queries[i], k, &out, dist );
+      free_list( out );
+   }
+   double elapsed = now() - start;
+   perf_stop( counters );
+
+   printf("(* %-10s %10.0f queries/s *)\n", "serial", n_query / elapsed);
+   print_perf_counters( counters, "query", n_query, stdout );
+}
+
+
+// Search the parallel index with every query and report
+// the overall throughput, the counters per query, and the
+// throughput of the threads on each NUMA node
+void
+run_parallel( const char *name, ap_ParallelIndex *pindex, ap_Point **queries, int n_query, int k, int n_threads, ap_PerfCounters *counters ) {
+
+   int i;
+   int node_queries[NUMA_MAX_NODES];
+   ap_PointList **out = malloc( n_query * sizeof( ap_PointList* ) );
+   assert( out );
+
+   perf_start( counters );
+   double start = now();
+   parallel_nearest_neighbor_search_batch( pindex, queries, n_query, k, out, n_threads, node_queries, dist );
+   double elapsed = now() - start;
+   perf_stop( counters );
+
+   printf("(* %-10s %10.0f queries/s *)\n", name, n_query / elapsed);
+   print_perf_counters( counters, "query", n_query, stdout );
+   for( i = 0; i < pindex->topology->n_nodes; i++ )
+      printf("(*    node %-3d %10.0f queries/s (%d queries) *)\n", pindex->topology->nodes[i].id, node_queries[i] / elapsed, node_queries[i]);
+
+   for( i = 0; i < n_query; i++ )
+      free_list( out[i] );
+   free( out );
+}
+
+
+int
+main( int argc, char **argv ) {
+
+   int i;
+   int n_data = argc > 1 ? atoi( argv[1] ) : 200000;
+   int n_query = argc > 2 ? atoi( argv[2] ) : 100000;
+   int k = argc > 3 ? atoi( argv[3] ) : 5;
+   int n_threads = argc > 4 ? atoi( argv[4] ) : 0;
+   DIM = argc > 5 ? atoi( argv[5] ) : DIM;
+   double bounded_radius = 0.05 * sqrt( DIM );
+   srand( 1 );
+
+   const char *trace_path = getenv( TRACE_ENV );
+   if( trace_path != NULL )
+      start_trace();
+
+   // Build the data set, queries, and tree
+   ap_PointList *s = NULL;
+   for( i = 0; i < n_data; i++ )
+      prepend_point( &s, random_point( i ), 0, NULL );
+   ap_Point **queries = malloc( n_query * sizeof( ap_Point* ) );
+   assert( queries );
+   for( i = 0; i < n_query; i++ )
+      queries[i] = random_point( -1 );
+
+   // Open the hardware counters, which many virtual machines
+   // do not provide
+   ap_PerfCounters *counters = create_perf_counters();
+   if( counters->n_hardware == 0 )
+      printf("(* hardware performance counters are unavailable *)\n");
+
+   perf_start( counters );
+   double start = now();
+   ap_Tree *tree = build_tree( s, bounded_radius, NULL, NULL, DIM, dist );
+   double elapsed = now() - start;
+   perf_stop( counters );
+   int n_nodes = 0, n_leaves = 0, n_points = 0;
+   disk_count_tree( tree, &n_nodes, &n_leaves, NULL, &n_points );
+   printf("(* built tree of %d points in %d dimensions in %.3f s (%d nodes) *)\n", n_data, DIM, elapsed, n_nodes);
+   print_perf_counters( counters, "node", n_nodes, stdout );
+
+   // Create the shared and replicated indexes
+   ap_ParallelIndex *shared = create_parallel_index( tree, DIM * sizeof( double ), false );
+   perf_start( counters );
+   start = now();
+   ap_ParallelIndex *replicated = create_parallel_index( tree, DIM * sizeof( double ), true );
+   elapsed = now() - start;
+   perf_stop( counters );
+   printf("(* replicated tree on %d NUMA nodes in %.3f s *)\n", replicated->topology->n_nodes, elapsed);
+   print_perf_counters( counters, "node", (double)n_nodes * replicated->topology->n_nodes, stdout );
+   if( n_threads < 1 )
+      for( i = 0; i < shared->topology->n_nodes; i++ )
+         n_threads += shared->topology->nodes[i].n_cpus;
+   printf("(* searching %d queries for %d neighbors with %d threads *)\n", n_query, k, n_threads);
+
+   run_serial( tree, queries, n_query, k, counters );
+   run_parallel( "shared", shared, queries, n_query, k, n_threads, counters );
+   run_parallel( "replicated", replicated, queries, n_query, k, n_threads, counters );
+
+   free_perf_counters( counters );
+   free_parallel_index( shared );
+   free_parallel_index( replicated );
+   free_tree( tree );
+
+   // Write the trace of this run if one was asked for
+   if( trace_path != NULL ) {
+      if( !write_trace( trace_path ) )
+         fprintf( stderr, "%s: cannot write trace to %s\n", argv[0], trace_path );
+      free_trace();
+   }
+
+   return 0;
+}
@@ -0,0 +1,236 @@
+/* cache.c
+ *
+ * Copyright (c) 2011, Jeffrey P. Gill
+ *
+ * This file is part of photomosaic.
+ *
+ * photomosaic is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * photomosaic is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with photomosaic.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>  /* assert */
+#include <math.h>    /* floor, INFINITY */
+#include <stdlib.h>  /* NULL, malloc */
+#include <string.h>  /* memcmp, memcpy */
+#include "cache.h"
+
+#define max(a,b) ((a) > (b) ? (a) : (b))
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+                  RESULT CACHE FUNCTIONS
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+
+// Create a cache of up to capacity results of k nearest
+// neighbor searches of index, in front of the search. Queries
+// are keyed on their position vectors of dimensionality
+// elements of the given type, each quantized into bins of
+// width quantum, so that the near-identical descriptors of
+// flat regions of an image share an entry. The entries are
+// split into CACHE_SHARDS shards with a lock each so that
+// many threads can search through the cache at once.
+ap_ResultCache*
+create_result_cache( ap_Index *index, int capacity, int k, int dimensionality, ap_CacheElement element, double quantum ) {
+
+   int i, j;
+
+   ap_ResultCache *cache = malloc( sizeof( ap_ResultCache ) );
+   assert( cache );
+   atomic_init( &cache->index, index );
+   cache->k = k;
+   cache->dimensionality = dimensionality;
+   cache->element = element;
+   cache->vec_size = dimensionality * cache_element_size( element );
+   cache->quantum = quantum;
+   atomic_init( &cache->generation, 0 );
+   atomic_init( &cache->exact, 0 );
+   atomic_init( &cache->reused, 0 );
+   atomic_init( &cache->seeded, 0 );
+   atomic_init( &cache->missed, 0 );
+
+   // Carve each entry's neighbors, key and vector from one
+   // block per shard
+   size_t key_offset = k * sizeof( ap_Neighbor );
+   size_t vec_offset = key_offset + dimensionality * sizeof( int32_t );
+   size_t entry_size = ( vec_offset + cache->vec_size + 15 ) / 16 * 16;
+   for( i = 0; i < CACHE_SHARDS; i++ ) {
+      ap_CacheShard *shard = &(cache->shards[i]);
+      pthread_mutex_init( &shard->lock, NULL );
+      shard->n_entries = max( capacity / CACHE_SHARDS, 1 );
+      shard->entries = malloc( shard->n_entries * sizeof( ap_CacheEntry ) );
+      shard->storage = malloc( shard->n_entries * entry_size );
+      assert( shard->entries && shard->storage );
+      for( j = 0; j < shard->n_entries; j++ ) {
+         shard->entries[j].valid = false;
+         shard->entries[j].neighbors = (ap_Neighbor*)( shard->storage + j * entry_size );
+         shard->entries[j].key = (int32_t*)( shard->storage + j * entry_size + key_offset );
+         shard->entries[j].vec = shard->storage + j * entry_size + vec_offset;
+      }
+   }
+
+   return cache;
+}
+
+
+// Find the k points of the cache's index nearest the query
+// and place them in out, sorted by distance, consulting the
+// cache first. The caller owns the list.
+//
+// A query identical to the cached one is answered with the
+// cached neighbors. The cached neighbors of a query that only
+// shares the cached quantized descriptor are reused or seed
+// the search as reseed_nearest_neighbor_search describes, so
+// the result is exact.
+void
+cached_nearest_neighbor_search( ap_ResultCache *cache, ap_Point *query, ap_PointList **out, PROXY_FUNC, DIST_FUNC ) {
+
+   int i, n = 0, k = cache->k;
+   bool found = false, identical = false;
+   int32_t key[cache->dimensionality];
+   char old_vec[cache->vec_size];
+   ap_Neighbor old_neighbors[max( k, 1 )];
+   ap_PointList *results = NULL, *neighbor;
+
+   // Load the index after the generation, so that results
+   // from an index newer than the generation are merely
+   // discarded rather than reused
+   unsigned generation = atomic_load( &cache->generation );
+   ap_Index *index = atomic_load( &cache->index );
+   uint64_t hash = cache_quantize( cache, query->vec, key );
+   ap_CacheShard *shard = &(cache->shards[hash % CACHE_SHARDS]);
+   ap_CacheEntry *entry = &(shard->entries[( hash / CACHE_SHARDS ) % shard->n_entries]);
+
+   // Copy the matching entry out so that the lock is not held
+   // during the search
+   pthread_mutex_lock( &shard->lock );
+   if( entry->valid && entry->generation == generation && entry->hash == hash && memcmp( entry->key, key, sizeof( key ) ) == 0 ) {
+      found = true;
+      identical = memcmp( entry->vec, query->vec, cache->vec_size ) == 0;
+      n = entry->n_neighbors;
+      memcpy( old_neighbors, entry->neighbors, n * sizeof( ap_Neighbor ) );
+      memcpy( old_vec, entry->vec, cache->vec_size );
+   }
+   pthread_mutex_unlock( &shard->lock );
+
+   if( identical ) {
+      for( i = n - 1; i >= 0; i-- )
+         prepend_point( &results, old_neighbors[i].p, old_neighbors[i].dist, NULL );
+      atomic_fetch_add( &cache->exact, 1 );
+      *out = results;
+      return;
+   }
+
+   if( found ) {
+      ap_Point old_query = { -1, old_vec, NULL };
+      if( reseed_nearest_neighbor_search( index, query, k, &old_query, old_neighbors, n, &results, proxy, dist ) )
+         atomic_fetch_add( &cache->reused, 1 );
+      else
+         atomic_fetch_add( &cache->seeded, 1 );
+   } else {
+      index_nearest_neighbor_search_within( index, query, k, INFINITY, &results, proxy, dist );
+      atomic_fetch_add( &cache->missed, 1 );
+   }
+
+   // Remember the query and its neighbors, replacing whatever
+   // entry held the slot
+   pthread_mutex_lock( &shard->lock );
+   entry->valid = true;
+   entry->generation = generation;
+   entry->hash = hash;
+   memcpy( entry->key, key, sizeof( key ) );
+   memcpy( entry->vec, query->vec, cache->vec_size );
+   for( i = 0, neighbor = results; neighbor != NULL && i < k; i++, neighbor = neighbor->next ) {
+      entry->neighbors[i].p = neighbor->p;
+      entry->neighbors[i].dist = neighbor->dist;
+   }
+   entry->n_neighbors = i;
+   pthread_mutex_unlock( &shard->lock );
+
+   *out = results;
+}
+
+
+// Forget every cached result and search index from now on,
+// as after the index is rebuilt or the tile library changes.
+// Entries are invalidated lazily by a generation count, and
+// results of searches already in flight are never reused.
+// The old index may only be freed once those searches end.
+void
+invalidate_result_cache( ap_ResultCache *cache, ap_Index *index ) {
+
+   atomic_store( &cache->index, index );
+   atomic_fetch_add( &cache->generation, 1 );
+}
+
+
+// Quantize each element of a position vector into bins of
+// the cache's quantum, storing the bin numbers in key, and
+// return a 64-bit FNV-1a hash of the key.
+uint64_t
+cache_quantize( ap_ResultCache *cache, const void *vec, int32_t *key ) {
+
+   int i;
+   size_t j;
+   double value;
+   uint64_t hash = 14695981039346656037ULL;
+
+   for( i = 0; i < cache->dimensionality; i++ ) {
+      if( cache->element == CACHE_UINT8 )
+         value = ((const uint8_t*)vec)[i];
+      else if( cache->element == CACHE_FLOAT )
+         value = ((const float*)vec)[i];
+      else
+         value = ((const double*)vec)[i];
+      key[i] = (int32_t)floor( value / cache->quantum );
+      for( j = 0; j < sizeof( int32_t ); j++ ) {
+         hash ^= ( (uint32_t)key[i] >> ( 8 * j ) ) & 0xff;
+         hash *= 1099511628211ULL;
+      }
+   }
+
+   return hash;
+}
+
+
+// Return the number of bytes in one element of the given type
+size_t
+cache_element_size( ap_CacheElement element ) {
+
+   if( element == CACHE_UINT8 )
+      return sizeof( uint8_t );
+   if( element == CACHE_FLOAT )
+      return sizeof( float );
+   return sizeof( double );
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+               MEMORY MANAGEMENT FUNCTIONS
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+
+// Free up memory used by an ap_ResultCache, but not its
+// index.
+void
+free_result_cache( ap_ResultCache *cache ) {
+
+   int i;
+
+   for( i = 0; i < CACHE_SHARDS; i++ ) {
+      pthread_mutex_destroy( &cache->shards[i].lock );
+      free( cache->shards[i].entries );
+      free( cache->shards[i].storage );
+   }
+   free( cache );
+}
@@ -0,0 +1,83 @@
+/* cache.h
+ *
+ * Copyright (c) 2011, Jeffrey P. Gill
+ *
+ * This file is part of photomosaic.
+ *
+ * photomosaic is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * photomosaic is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with photomosaic.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "antipole.h"
+
+#define CACHE_SHARDS 64          /* number of independently locked shards of a result cache */
+
+typedef enum {
+   CACHE_UINT8,               /* position vectors are arrays of uint8_t */
+   CACHE_FLOAT,               /* position vectors are arrays of float */
+   CACHE_DOUBLE               /* position vectors are arrays of double */
+} ap_CacheElement;
+
+typedef struct ap_CacheEntry ap_CacheEntry;
+typedef struct ap_CacheShard ap_CacheShard;
+typedef struct ap_ResultCache ap_ResultCache;
+
+struct ap_CacheEntry {
+   bool valid;                /* whether the entry holds results */
+   unsigned generation;       /* generation of the cache the results were found in */
+   uint64_t hash;             /* hash of the quantized descriptor */
+   int32_t *key;              /* quantized descriptor */
+   char *vec;                 /* position vector of the query the results belong to */
+   int n_neighbors;           /* number of neighbors found */
+   ap_Neighbor *neighbors;    /* array of neighbors found, sorted by distance */
+};
+
+struct ap_CacheShard {
+   pthread_mutex_t lock;      /* guards the shard's entries */
+   int n_entries;             /* number of entries in the shard */
+   ap_CacheEntry *entries;    /* array of entries, indexed by hash */
+   char *storage;             /* keys, vectors and neighbors of every entry */
+};
+
+struct ap_ResultCache {
+   _Atomic(ap_Index*) index;  /* index searched on a miss */
+   int k;                     /* number of neighbors found for each query */
+   int dimensionality;        /* number of elements in each position vector */
+   ap_CacheElement element;   /* type of the elements of each position vector */
+   size_t vec_size;           /* number of bytes in each position vector */
+   double quantum;            /* width of the bins each element is quantized into */
+   atomic_uint generation;    /* number of times the cache has been invalidated */
+   ap_CacheShard shards[CACHE_SHARDS];  /* shards, chosen by hash */
+   atomic_long exact;         /* number of searches answered from an identical query */
+   atomic_long reused;        /* number of searches answered from a near query's neighbors without a search */
+   atomic_long seeded;        /* number of searches bounded by a near query's neighbors */
+   atomic_long missed;        /* number of searches made without a cached query */
+};
+
+ap_ResultCache* create_result_cache( ap_Index *index, int capacity, int k, int dimensionality, ap_CacheElement element, double quantum );
+void cached_nearest_neighbor_search( ap_ResultCache *cache, ap_Point *query, ap_PointList **out, PROXY_FUNC, DIST_FUNC );
+void invalidate_result_cache( ap_ResultCache *cache, ap_Index *index );
+uint64_t cache_quantize( ap_ResultCache *cache, const void *vec, int32_t *key );
+size_t cache_element_size( ap_CacheElement element );
+
+void free_result_cache( ap_ResultCache *cache );
+
+#endif
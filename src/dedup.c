@@ -0,0 +1,222 @@
+/* dedup.c
+ *
+ * Copyright (c) 2011, Jeffrey P. Gill
+ *
+ * This file is part of photomosaic.
+ *
+ * photomosaic is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * photomosaic is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with photomosaic.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>  /* assert */
+#include <pthread.h> /* pthread_create, pthread_join */
+#include <stdio.h>   /* fprintf */
+#include <stdlib.h>  /* NULL, exit, malloc, qsort */
+#include <unistd.h>  /* sysconf */
+#include "dedup.h"
+#include "trace.h"
+
+#define min(a,b) ((a) < (b) ? (a) : (b))
+#define max(a,b) ((a) > (b) ? (a) : (b))
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+                    SELF-JOIN FUNCTIONS
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+
+// Find every group of near-duplicate points in the set and
+// return a new list holding one representative of each
+// group, in the order of the set, for building a tree over
+// the deduplicated points. Two points are duplicates if
+// they are within epsilon of each other, and groups are the
+// transitive closure of that relation, so a chain of small
+// steps can join points farther apart than epsilon. Each
+// group is represented by its member earliest in the set.
+//
+// A tree is built over the set with target_radius, and
+// n_threads threads (or one per online cpu if n_threads is
+// less than 1) each range search it for the neighbors of a
+// share of the points, merging the groups of each pair in a
+// shared lock-free union-find forest. Pairs are merged as
+// they are found and never stored, so memory stays linear
+// in the size of the set. If representatives is not NULL,
+// the representative of the ith point of the set is stored
+// in representatives[i]; if pairs is not NULL, the number
+// of pairs found is stored there. The set must not hold a
+// point twice. The tree built over the points is freed
+// before returning, so their ancestor lists are left
+// dangling and must not be read until a new tree is built
+// over them.
+ap_PointList*
+deduplicate_points( ap_PointList *set, double epsilon, double target_radius, int dimensionality, int n_threads, ap_Point **representatives, long *pairs, DIST_FUNC ) {
+
+   int i, pos;
+   ap_PointList *index, *new_set = NULL;
+
+   ap_Dedup dedup;
+   dedup.size = list_size( set );
+   dedup.sorted = malloc( max( dedup.size, 1 ) * sizeof( ap_Point* ) );
+   dedup.order = malloc( max( dedup.size, 1 ) * sizeof( int ) );
+   dedup.parent = malloc( max( dedup.size, 1 ) * sizeof( atomic_int ) );
+   ap_Point **points = malloc( max( dedup.size, 1 ) * sizeof( ap_Point* ) );
+   int *positions = malloc( max( dedup.size, 1 ) * sizeof( int ) );
+   assert( dedup.sorted && dedup.order && dedup.parent && points && positions );
+
+   // Sort the points by address so that a point found by the
+   // range search can be located, and remember where each
+   // point falls in the set
+   for( i = 0, index = set; index != NULL; i++, index = index->next )
+      points[i] = dedup.sorted[i] = index->p;
+   qsort( dedup.sorted, dedup.size, sizeof( ap_Point* ), compare_point_addresses );
+   for( i = 0; i < dedup.size; i++ ) {
+      positions[i] = pos = find_point( dedup.sorted, dedup.size, points[i] );
+      dedup.order[pos] = i;
+      atomic_init( &dedup.parent[pos], pos );
+   }
+
+   dedup.tree = dedup.size > 0 ? build_tree( set, target_radius, NULL, NULL, dimensionality, dist ) : NULL;
+   dedup.epsilon = epsilon;
+   atomic_init( &dedup.next, 0 );
+   atomic_init( &dedup.pairs, 0 );
+   dedup.dist = dist;
+
+   // Join the set with itself
+   if( n_threads < 1 )
+      n_threads = max( sysconf( _SC_NPROCESSORS_ONLN ), 1 );
+   n_threads = max( min( n_threads, ( dedup.size + DEDUP_CHUNK_SIZE - 1 ) / DEDUP_CHUNK_SIZE ), 1 );
+   pthread_t *threads = malloc( n_threads * sizeof( pthread_t ) );
+   assert( threads );
+   for( i = 0; i < n_threads; i++ ) {
+      if( pthread_create( &threads[i], NULL, dedup_worker, &dedup ) != 0 ) {
+         fprintf( stderr, "deduplicate_points: failed to create thread\n" );
+         exit( EXIT_FAILURE );
+      }
+   }
+   for( i = 0; i < n_threads; i++ )
+      pthread_join( threads[i], NULL );
+
+   // Keep the roots of the forest, which are the earliest
+   // members of their groups
+   for( i = dedup.size - 1; i >= 0; i-- ) {
+      pos = dedup_find( dedup.parent, positions[i] );
+      if( pos == positions[i] )
+         prepend_point( &new_set, points[i], 0, NULL );
+      if( representatives != NULL )
+         representatives[i] = dedup.sorted[pos];
+   }
+   if( pairs != NULL )
+      *pairs = atomic_load( &dedup.pairs );
+
+   if( dedup.tree != NULL )
+      free_tree( dedup.tree );
+   free( threads );
+   free( dedup.sorted );
+   free( dedup.order );
+   free( dedup.parent );
+   free( points );
+   free( positions );
+
+   return new_set;
+}
+
+
+// Thread entry point that claims chunks of points and range
+// searches the tree for the duplicates of each until none
+// are left.
+void*
+dedup_worker( void *arg ) {
+
+   int i, start, end;
+   ap_Dedup *dedup = arg;
+   ap_DedupVisit visit;
+   visit.dedup = dedup;
+
+   double trace_start = trace_begin();
+   while( ( start = atomic_fetch_add( &dedup->next, DEDUP_CHUNK_SIZE ) ) < dedup->size ) {
+      end = min( start + DEDUP_CHUNK_SIZE, dedup->size );
+      for( i = start; i < end; i++ ) {
+         visit.i = i;
+         range_search_visit( dedup->tree, dedup->sorted[i], dedup->epsilon, &visit, dedup_visit, NULL, dedup->dist );
+      }
+   }
+   trace_end( "build", "dedup_worker", trace_start );
+
+   return NULL;
+}
+
+
+// Merge the groups of the point being joined and a point
+// the range search found within epsilon of it. Each pair is
+// found from both ends, so it is only counted from the
+// point earlier in sorted.
+void
+dedup_visit( ap_Point *p, double dist, void *data ) {
+
+   ap_DedupVisit *visit = data;
+   ap_Dedup *dedup = visit->dedup;
+   int j = find_point( dedup->sorted, dedup->size, p );
+
+   (void)dist;
+   if( j <= visit->i )
+      return;
+   atomic_fetch_add_explicit( &dedup->pairs, 1, memory_order_relaxed );
+   dedup_union( dedup, visit->i, j );
+}
+
+
+// Return the root of the group holding position i of the
+// union-find forest, halving the path to it on the way so
+// that later finds are shorter. Safe to call while other
+// threads merge groups.
+int
+dedup_find( atomic_int *parent, int i ) {
+
+   int p, gp;
+
+   while( ( p = atomic_load( &parent[i] ) ) != i ) {
+      gp = atomic_load( &parent[p] );
+      if( gp != p )
+         atomic_compare_exchange_weak( &parent[i], &p, gp );
+      i = gp;
+   }
+
+   return i;
+}
+
+
+// Merge the groups holding positions a and b of the
+// union-find forest, making the root that is earlier in the
+// set the root of the merged group. A root is only linked
+// below another if it is still a root, so concurrent merges
+// retry rather than lose a link.
+void
+dedup_union( ap_Dedup *dedup, int a, int b ) {
+
+   int t, expected;
+
+   while( true ) {
+      a = dedup_find( dedup->parent, a );
+      b = dedup_find( dedup->parent, b );
+      if( a == b )
+         return;
+      if( dedup->order[a] > dedup->order[b] ) {
+         t = a;
+         a = b;
+         b = t;
+      }
+      expected = b;
+      if( atomic_compare_exchange_strong( &dedup->parent[b], &expected, a ) )
+         return;
+   }
+}
@@ -0,0 +1,55 @@
+/* dedup.h
+ *
+ * Copyright (c) 2011, Jeffrey P. Gill
+ *
+ * This file is part of photomosaic.
+ *
+ * photomosaic is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * photomosaic is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with photomosaic.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include <stdatomic.h>
+#include "antipole.h"
+
+#define DEDUP_CHUNK_SIZE 256     /* number of points a worker thread joins at a time */
+
+typedef struct ap_Dedup ap_Dedup;
+typedef struct ap_DedupVisit ap_DedupVisit;
+
+struct ap_Dedup {
+   int size;                  /* number of points */
+   ap_Point **sorted;         /* array of the points sorted by address */
+   int *order;                /* position in the set of each point in sorted */
+   atomic_int *parent;        /* union-find forest over sorted, in which each root is the member of its group earliest in the set */
+   ap_Tree *tree;             /* tree searched for the neighbors of each point */
+   double epsilon;            /* distance within which two points are duplicates */
+   atomic_int next;           /* position in sorted of the next unclaimed point */
+   atomic_long pairs;         /* number of pairs of duplicates found */
+   double (*dist)( ap_Point *p1, ap_Point *p2 );  /* distance function */
+};
+
+struct ap_DedupVisit {
+   ap_Dedup *dedup;           /* self-join being run */
+   int i;                     /* position in sorted of the point whose neighbors are being visited */
+};
+
+ap_PointList* deduplicate_points( ap_PointList *set, double epsilon, double target_radius, int dimensionality, int n_threads, ap_Point **representatives, long *pairs, DIST_FUNC );
+void* dedup_worker( void *arg );
+void dedup_visit( ap_Point *p, double dist, void *data );
+int dedup_find( atomic_int *parent, int i );
+void dedup_union( ap_Dedup *dedup, int a, int b );
+
+#endif
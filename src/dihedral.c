@@ -0,0 +1,114 @@
+/* dihedral.c
+ *
+ * Copyright (c) 2011, Jeffrey P. Gill
+ *
+ * This file is part of photomosaic.
+ *
+ * photomosaic is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * photomosaic is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with photomosaic.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>  /* assert */
+#include <stdlib.h>  /* NULL, malloc */
+#include <string.h>  /* memcpy */
+#include "dihedral.h"
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+                   TRANSFORM FUNCTIONS
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+
+// Copy a descriptor laid out as a side x side grid of cells
+// in row-major order, each cell_size bytes, into out with
+// one of the eight symmetries of the square applied. The
+// grid is first mirrored left to right if orientation & 4,
+// then turned clockwise by a quarter turn orientation & 3
+// times. Orientation 0 is an unchanged copy. vec and out
+// must not overlap.
+void
+dihedral_transform( const void *vec, void *out, int side, size_t cell_size, int orientation ) {
+
+   int r, c, row, col, tmp, turn;
+
+   for( r = 0; r < side; r++ ) {
+      for( c = 0; c < side; c++ ) {
+         row = r;
+         col = orientation & 4 ? side - 1 - c : c;
+         for( turn = 0; turn < ( orientation & 3 ); turn++ ) {
+            tmp = row;
+            row = col;
+            col = side - 1 - tmp;
+         }
+         memcpy( (char*)out + ( row * side + col ) * cell_size, (const char*)vec + ( r * side + c ) * cell_size, cell_size );
+      }
+   }
+}
+
+
+// Return the orientation that undoes the given one. A tile
+// matched by the query variant with some orientation is
+// aligned with the query when drawn with the inverse
+// orientation. Mirrored orientations are their own inverses.
+int
+dihedral_inverse( int orientation ) {
+
+   if( orientation & 4 )
+      return orientation;
+
+   return ( 4 - orientation ) & 3;
+}
+
+
+// Create the DIHEDRAL_ORIENTATIONS variants of the query, a
+// side x side grid of cells each cell_size bytes, for use
+// with nearest_neighbor_search_variants. Variant i has
+// orientation i, so the orientations reported by the search
+// are orientations of the query, and a tile should be drawn
+// with their inverses. Every variant keeps the query's id.
+ap_Point**
+create_dihedral_variants( ap_Point *query, int side, size_t cell_size ) {
+
+   int i;
+   size_t vec_size = side * side * cell_size;
+
+   // The points and their vectors share one allocation
+   ap_Point **variants = malloc( DIHEDRAL_ORIENTATIONS * ( sizeof( ap_Point* ) + sizeof( ap_Point ) + vec_size ) );
+   assert( variants );
+   ap_Point *points = (ap_Point*)( variants + DIHEDRAL_ORIENTATIONS );
+   char *vecs = (char*)( points + DIHEDRAL_ORIENTATIONS );
+
+   for( i = 0; i < DIHEDRAL_ORIENTATIONS; i++ ) {
+      points[i].id = query->id;
+      points[i].vec = vecs + i * vec_size;
+      points[i].ancestors = NULL;
+      dihedral_transform( query->vec, points[i].vec, side, cell_size, i );
+      variants[i] = &points[i];
+   }
+
+   return variants;
+}
+
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+                   MEMORY FREEING FUNCTIONS
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+
+// Free the variants created by create_dihedral_variants
+void
+free_dihedral_variants( ap_Point **variants ) {
+
+   free( variants );
+}
@@ -0,0 +1,35 @@
+/* dihedral.h
+ *
+ * Copyright (c) 2011, Jeffrey P. Gill
+ *
+ * This file is part of photomosaic.
+ *
+ * photomosaic is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * photomosaic is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with photomosaic.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DIHEDRAL_H
+#define DIHEDRAL_H
+
+#include <stddef.h>
+#include "antipole.h"
+
+#define DIHEDRAL_ORIENTATIONS 8  /* number of rotations and mirror images of a square grid */
+
+void dihedral_transform( const void *vec, void *out, int side, size_t cell_size, int orientation );
+int dihedral_inverse( int orientation );
+ap_Point** create_dihedral_variants( ap_Point *query, int side, size_t cell_size );
+
+void free_dihedral_variants( ap_Point **variants );
+
+#endif
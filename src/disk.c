@@ -0,0 +1,708 @@
+/* disk.c
+ *
+ * Copyright (c) 2011, Jeffrey P. Gill
+ *
+ * This file is part of photomosaic.
+ *
+ * photomosaic is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * photomosaic is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with photomosaic.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>  /* assert */
+#include <fcntl.h>   /* open, posix_fadvise */
+#include <stdint.h>  /* int32_t, int64_t, uint64_t */
+#include <stdio.h>   /* FILE, fopen, fwrite */
+#include <stdlib.h>  /* NULL, malloc, qsort */
+#include <string.h>  /* memcpy, memcmp */
+#include <unistd.h>  /* pread, close */
+#include "disk.h"
+
+#define min(a,b) ((a) < (b) ? (a) : (b))
+#define max(a,b) ((a) > (b) ? (a) : (b))
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+                  INDEX FILE FUNCTIONS
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+
+// Write the tree to an index file at path so that it can be
+// searched with only its internal nodes in memory. The file
+// holds a header, a table of the points used as antipoles
+// and centroids, a table of nodes in depth-first order, a
+// table of leaves, and finally the members of every leaf
+// cluster laid out contiguously in the same order, so that
+// neighboring leaves share pages. A leaf that fits in a page
+// is never split across two. vec_size is the number of bytes
+// in each position vector. Returns true if the file was
+// written successfully, or false otherwise.
+bool
+save_disk_index( ap_Tree *tree, const char *path, size_t vec_size ) {
+
+   int i, j, n_nodes = 0, n_leaves = 0, n_points = 0, n_unique;
+   int32_t id;
+   size_t point_size = disk_point_size( vec_size ), member_size = disk_member_size( vec_size );
+   uint64_t offset, position;
+   ap_DiskHeader header;
+   bool ok;
+
+   // Count the nodes, leaves, and resident points, then
+   // collect the resident points and sort them by address,
+   // discarding duplicates, so that they can be numbered
+   // with find_point
+   disk_count_tree( tree, &n_nodes, &n_leaves, NULL, &n_points );
+   ap_Point **points = malloc( max( n_points, 1 ) * sizeof( ap_Point* ) );
+   assert( points );
+   n_nodes = n_leaves = n_points = 0;
+   disk_count_tree( tree, &n_nodes, &n_leaves, points, &n_points );
+   qsort( points, n_points, sizeof( ap_Point* ), compare_point_addresses );
+   for( i = n_unique = 0; i < n_points; i++ )
+      if( n_unique == 0 || points[i] != points[n_unique-1] )
+         points[n_unique++] = points[i];
+   n_points = n_unique;
+
+   // Flatten the tree into the node and leaf tables
+   ap_DiskNode *nodes = malloc( n_nodes * sizeof( ap_DiskNode ) );
+   ap_DiskLeaf *leaves = malloc( n_leaves * sizeof( ap_DiskLeaf ) );
+   ap_Cluster **clusters = malloc( n_leaves * sizeof( ap_Cluster* ) );
+   assert( nodes && leaves && clusters );
+   n_nodes = n_leaves = 0;
+   disk_flatten_tree( tree, nodes, &n_nodes, leaves, clusters, &n_leaves, points, n_points );
+
+   // Lay out the leaf clusters after the tables, starting on a
+   // page boundary
+   offset = sizeof( ap_DiskHeader ) + n_points * point_size + n_nodes * sizeof( ap_DiskNode ) + n_leaves * sizeof( ap_DiskLeaf );
+   offset = ( offset + DISK_PAGE_SIZE - 1 ) / DISK_PAGE_SIZE * DISK_PAGE_SIZE;
+   for( i = 0; i < n_leaves; i++ ) {
+      leaves[i].length = leaves[i].size * member_size;
+      if( leaves[i].length <= DISK_PAGE_SIZE && offset % DISK_PAGE_SIZE + leaves[i].length > DISK_PAGE_SIZE )
+         offset = ( offset + DISK_PAGE_SIZE - 1 ) / DISK_PAGE_SIZE * DISK_PAGE_SIZE;
+      leaves[i].offset = offset;
+      offset += leaves[i].length;
+   }
+
+   FILE *file = fopen( path, "wb" );
+   if( file == NULL ) {
+      free( points );
+      free( nodes );
+      free( leaves );
+      free( clusters );
+      return false;
+   }
+
+   // Write the header and tables
+   memset( &header, 0, sizeof( ap_DiskHeader ) );
+   memcpy( header.magic, DISK_MAGIC, sizeof( header.magic ) );
+   header.version = DISK_VERSION;
+   header.page_size = DISK_PAGE_SIZE;
+   header.vec_size = vec_size;
+   header.n_points = n_points;
+   header.n_nodes = n_nodes;
+   header.n_leaves = n_leaves;
+   ok = fwrite( &header, sizeof( ap_DiskHeader ), 1, file ) == 1;
+
+   char *record = calloc( 1, max( point_size, member_size ) );
+   assert( record );
+   for( i = 0; i < n_points; i++ ) {
+      id = points[i]->id;
+      memcpy( record, &id, sizeof( int32_t ) );
+      memcpy( record + 8, points[i]->vec, vec_size );
+      ok = ok && fwrite( record, point_size, 1, file ) == 1;
+   }
+   ok = ok && fwrite( nodes, sizeof( ap_DiskNode ), n_nodes, file ) == (size_t)n_nodes;
+   ok = ok && fwrite( leaves, sizeof( ap_DiskLeaf ), n_leaves, file ) == (size_t)n_leaves;
+   position = sizeof( ap_DiskHeader ) + n_points * point_size + n_nodes * sizeof( ap_DiskNode ) + n_leaves * sizeof( ap_DiskLeaf );
+
+   // Write the members of each leaf cluster, each record
+   // holding the member's id, its distance to the centroid,
+   // and its position vector
+   for( i = 0; i < n_leaves && ok; i++ ) {
+      for( ; position < leaves[i].offset; position++ )
+         ok = ok && fputc( 0, file ) != EOF;
+      for( j = 0; j < leaves[i].size; j++ ) {
+         id = clusters[i]->members[j]->id;
+         memcpy( record, &id, sizeof( int32_t ) );
+         memcpy( record + 8, &(clusters[i]->dists[j]), sizeof( double ) );
+         memcpy( record + 16, clusters[i]->members[j]->vec, vec_size );
+         ok = ok && fwrite( record, member_size, 1, file ) == 1;
+      }
+      position += leaves[i].length;
+   }
+
+   ok = fclose( file ) == 0 && ok;
+
+   free( record );
+   free( points );
+   free( nodes );
+   free( leaves );
+   free( clusters );
+
+   return ok;
+}
+
+
+// Count the nodes and leaves of the tree and the points
+// used as its antipoles and centroids, which will be kept
+// in memory. If points is not NULL, the points are also
+// stored there (possibly more than once).
+void
+disk_count_tree( ap_Tree *tree, int *n_nodes, int *n_leaves, ap_Point **points, int *n_points ) {
+
+   (*n_nodes)++;
+   if( tree->is_leaf ) {
+      (*n_leaves)++;
+      if( points != NULL )
+         points[*n_points] = tree->cluster->centroid;
+      (*n_points)++;
+   } else {
+      if( points != NULL ) {
+         points[*n_points] = tree->a;
+         points[*n_points+1] = tree->b;
+      }
+      *n_points += 2;
+      disk_count_tree( tree->left, n_nodes, n_leaves, points, n_points );
+      disk_count_tree( tree->right, n_nodes, n_leaves, points, n_points );
+   }
+}
+
+
+// Store the tree in the node and leaf tables in depth-first
+// order, recording the cluster of each leaf in clusters.
+// Antipoles and centroids are stored as their indices in
+// the sorted array of resident points. Returns the index of
+// the tree's root in the node table.
+int
+disk_flatten_tree( ap_Tree *tree, ap_DiskNode *nodes, int *n_nodes, ap_DiskLeaf *leaves, ap_Cluster **clusters, int *n_leaves, ap_Point **points, int n_points ) {
+
+   int i = (*n_nodes)++, leaf;
+   ap_DiskNode *node = &nodes[i];
+
+   memset( node, 0, sizeof( ap_DiskNode ) );
+   node->is_leaf = tree->is_leaf;
+   node->a = node->b = node->left = node->right = node->leaf = -1;
+
+   if( tree->is_leaf ) {
+      leaf = node->leaf = (*n_leaves)++;
+      memset( &leaves[leaf], 0, sizeof( ap_DiskLeaf ) );
+      leaves[leaf].centroid = find_point( points, n_points, tree->cluster->centroid );
+      leaves[leaf].centroid_is_antipole = tree->cluster->centroid_is_antipole;
+      leaves[leaf].size = tree->cluster->size;
+      leaves[leaf].n_antipoles = tree->cluster->n_antipoles;
+      leaves[leaf].radius = tree->cluster->radius;
+      clusters[leaf] = tree->cluster;
+   } else {
+      node->try_a = tree->try_a;
+      node->try_b = tree->try_b;
+      node->a = find_point( points, n_points, tree->a );
+      node->b = find_point( points, n_points, tree->b );
+      node->radius_a = tree->radius_a;
+      node->radius_b = tree->radius_b;
+      node->left = disk_flatten_tree( tree->left, nodes, n_nodes, leaves, clusters, n_leaves, points, n_points );
+      node->right = disk_flatten_tree( tree->right, nodes, n_nodes, leaves, clusters, n_leaves, points, n_points );
+   }
+
+   return i;
+}
+
+
+// Return the number of bytes in a leaf member record: the
+// point's id, its distance to the centroid, and its
+// position vector, padded so that every record is aligned.
+size_t
+disk_member_size( size_t vec_size ) {
+
+   return ( 16 + vec_size + 7 ) & ~(size_t)7;
+}
+
+
+// Return the number of bytes in a resident point record: the
+// point's id and its position vector, padded so that every
+// record is aligned.
+size_t
+disk_point_size( size_t vec_size ) {
+
+   return ( 8 + vec_size + 7 ) & ~(size_t)7;
+}
+
+
+// Read size bytes at offset of the file into buffer,
+// continuing after short reads. Returns true if all of the
+// bytes were read, or false otherwise.
+bool
+disk_read( int fd, void *buffer, size_t size, uint64_t offset ) {
+
+   ssize_t n;
+   while( size > 0 ) {
+      n = pread( fd, buffer, size, offset );
+      if( n <= 0 )
+         return false;
+      buffer = (char*)buffer + n;
+      size -= n;
+      offset += n;
+   }
+   return true;
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+                   LEAF CACHE FUNCTIONS
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+
+// Open the index file at path for searching. The internal
+// nodes of the tree, with their antipoles, and the centroids
+// and radii of the leaf clusters are read into memory, while
+// the members of the leaf clusters are loaded on demand into
+// a cache holding at most cache_pages pages of member
+// records. Returns NULL if the file cannot be read or is
+// not an index.
+ap_DiskIndex*
+open_disk_index( const char *path, size_t cache_pages ) {
+
+   int i;
+   int32_t id;
+   ap_DiskHeader header;
+   ap_DiskNode *nodes;
+   bool ok;
+
+   int fd = open( path, O_RDONLY );
+   if( fd < 0 )
+      return NULL;
+   if( !disk_read( fd, &header, sizeof( ap_DiskHeader ), 0 ) ||
+         memcmp( header.magic, DISK_MAGIC, sizeof( header.magic ) ) != 0 ||
+         header.version != DISK_VERSION || header.n_nodes < 1 ) {
+      close( fd );
+      return NULL;
+   }
+
+   // Create the new ap_DiskIndex
+   ap_DiskIndex *disk = malloc( sizeof( ap_DiskIndex ) );
+   assert( disk );
+   disk->fd = fd;
+   disk->vec_size = header.vec_size;
+   disk->page_size = header.page_size;
+   disk->n_points = header.n_points;
+   disk->n_nodes = header.n_nodes;
+   disk->n_leaves = header.n_leaves;
+   size_t point_size = disk_point_size( disk->vec_size );
+   char *table = malloc( max( disk->n_points * point_size, 1 ) );
+   nodes = malloc( disk->n_nodes * sizeof( ap_DiskNode ) );
+   disk->points = malloc( max( disk->n_points, 1 ) * sizeof( ap_Point ) );
+   disk->vecs = malloc( max( disk->n_points * disk->vec_size, 1 ) );
+   disk->nodes = malloc( disk->n_nodes * sizeof( ap_Tree ) );
+   disk->stubs = malloc( max( disk->n_leaves, 1 ) * sizeof( ap_Cluster ) );
+   disk->leaves = malloc( max( disk->n_leaves, 1 ) * sizeof( ap_DiskLeaf ) );
+   disk->cache = calloc( max( disk->n_leaves, 1 ), sizeof( ap_DiskCacheEntry* ) );
+   disk->prefetched = calloc( max( disk->n_leaves, 1 ), sizeof( unsigned ) );
+   assert( table && nodes && disk->points && disk->vecs && disk->nodes && disk->stubs && disk->leaves && disk->cache && disk->prefetched );
+   disk->newest = disk->oldest = NULL;
+   disk->cache_bytes = max( cache_pages, 1 ) * disk->page_size;
+   disk->cached_bytes = 0;
+   disk->stamp = 0;
+   disk->results = create_arena( ARENA_BLOCK_SIZE );
+   disk->loads = disk->hits = 0;
+
+   // Read the tables
+   ok = disk_read( fd, table, disk->n_points * point_size, sizeof( ap_DiskHeader ) );
+   ok = ok && disk_read( fd, nodes, disk->n_nodes * sizeof( ap_DiskNode ), sizeof( ap_DiskHeader ) + disk->n_points * point_size );
+   ok = ok && disk_read( fd, disk->leaves, disk->n_leaves * sizeof( ap_DiskLeaf ), sizeof( ap_DiskHeader ) + disk->n_points * point_size + disk->n_nodes * sizeof( ap_DiskNode ) );
+
+   // Rebuild the resident points
+   for( i = 0; ok && i < disk->n_points; i++ ) {
+      memcpy( &id, table + i * point_size, sizeof( int32_t ) );
+      disk->points[i].id = id;
+      disk->points[i].vec = disk->vecs + i * disk->vec_size;
+      disk->points[i].ancestors = NULL;
+      memcpy( disk->points[i].vec, table + i * point_size + 8, disk->vec_size );
+   }
+
+   // Rebuild the leaf clusters without their members
+   for( i = 0; ok && i < disk->n_leaves; i++ ) {
+      ok = disk->leaves[i].centroid >= 0 && disk->leaves[i].centroid < disk->n_points && disk->leaves[i].size >= 0 &&
+         disk->leaves[i].length == disk->leaves[i].size * disk_member_size( disk->vec_size );
+      if( ok ) {
+         disk->stubs[i].centroid = &(disk->points[disk->leaves[i].centroid]);
+         disk->stubs[i].centroid_is_antipole = disk->leaves[i].centroid_is_antipole;
+         disk->stubs[i].radius = disk->leaves[i].radius;
+         disk->stubs[i].size = disk->leaves[i].size;
+         disk->stubs[i].n_antipoles = disk->leaves[i].n_antipoles;
+         disk->stubs[i].members = NULL;
+         disk->stubs[i].dists = NULL;
+      }
+   }
+
+   // Rebuild the internal nodes of the tree
+   for( i = 0; ok && i < disk->n_nodes; i++ ) {
+      disk->nodes[i].is_leaf = nodes[i].is_leaf;
+      disk->nodes[i].arena = NULL;
+      if( nodes[i].is_leaf ) {
+         ok = nodes[i].leaf >= 0 && nodes[i].leaf < disk->n_leaves;
+         if( ok )
+            disk->nodes[i].cluster = &(disk->stubs[nodes[i].leaf]);
+      } else {
+         ok = nodes[i].a >= 0 && nodes[i].a < disk->n_points && nodes[i].b >= 0 && nodes[i].b < disk->n_points &&
+            nodes[i].left > i && nodes[i].left < disk->n_nodes && nodes[i].right > i && nodes[i].right < disk->n_nodes;
+         if( ok ) {
+            disk->nodes[i].a = &(disk->points[nodes[i].a]);
+            disk->nodes[i].b = &(disk->points[nodes[i].b]);
+            disk->nodes[i].radius_a = nodes[i].radius_a;
+            disk->nodes[i].radius_b = nodes[i].radius_b;
+            disk->nodes[i].try_a = nodes[i].try_a;
+            disk->nodes[i].try_b = nodes[i].try_b;
+            disk->nodes[i].left = &(disk->nodes[nodes[i].left]);
+            disk->nodes[i].right = &(disk->nodes[nodes[i].right]);
+         }
+      }
+   }
+
+   free( table );
+   free( nodes );
+
+   if( !ok ) {
+      free_disk_index( disk );
+      return NULL;
+   }
+
+   // Leaves are read in the order searches reach them, not
+   // sequentially
+   posix_fadvise( fd, 0, 0, POSIX_FADV_RANDOM );
+
+   return disk;
+}
+
+
+// Return the cluster of the leaf with its members loaded,
+// from the cache if possible or from the file otherwise.
+// The least recently used leaves are evicted to make room,
+// except that leaves used by the current search are kept
+// (letting the cache run over its limit if necessary) so
+// that the points found so far stay valid. Returns NULL if
+// the leaf could not be read.
+ap_Cluster*
+disk_load_cluster( ap_DiskIndex *disk, int leaf ) {
+
+   int j;
+   int32_t id;
+   char *block, *records;
+   ap_DiskLeaf *location = &(disk->leaves[leaf]);
+   ap_DiskCacheEntry *entry = disk->cache[leaf];
+
+   if( entry != NULL ) {
+      disk->hits++;
+
+      // Unlink the entry from its place in the cache
+      if( entry->prev != NULL )
+         entry->prev->next = entry->next;
+      else
+         disk->newest = entry->next;
+      if( entry->next != NULL )
+         entry->next->prev = entry->prev;
+      else
+         disk->oldest = entry->prev;
+   } else {
+      disk->loads++;
+
+      // Make room for the leaf's member records
+      while( disk->oldest != NULL && disk->oldest->stamp != disk->stamp && disk->cached_bytes + location->length > disk->cache_bytes )
+         disk_evict( disk, disk->oldest );
+
+      // Allocate the entry, its member pointers, points,
+      // distances, and records in a single block
+      int size = location->size;
+      block = malloc( sizeof( ap_DiskCacheEntry ) + size * ( sizeof( ap_Point* ) + sizeof( ap_Point ) + sizeof( double ) ) + location->length );
+      assert( block );
+      entry = (ap_DiskCacheEntry*)block;
+      entry->cluster = disk->stubs[leaf];
+      entry->cluster.members = (ap_Point**)( block + sizeof( ap_DiskCacheEntry ) );
+      ap_Point *points = (ap_Point*)( entry->cluster.members + size );
+      entry->cluster.dists = (double*)( points + size );
+      records = (char*)( entry->cluster.dists + size );
+
+      if( !disk_read( disk->fd, records, location->length, location->offset ) ) {
+         free( block );
+         return NULL;
+      }
+      for( j = 0; j < size; j++ ) {
+         memcpy( &id, records, sizeof( int32_t ) );
+         memcpy( &(entry->cluster.dists[j]), records + 8, sizeof( double ) );
+         points[j].id = id;
+         points[j].vec = records + 16;
+         points[j].ancestors = NULL;
+         entry->cluster.members[j] = &points[j];
+         records += disk_member_size( disk->vec_size );
+      }
+
+      entry->leaf = leaf;
+      entry->bytes = location->length;
+      disk->cache[leaf] = entry;
+      disk->cached_bytes += entry->bytes;
+   }
+
+   // Make the entry the most recently used
+   entry->stamp = disk->stamp;
+   entry->prev = NULL;
+   entry->next = disk->newest;
+   if( disk->newest != NULL )
+      disk->newest->prev = entry;
+   else
+      disk->oldest = entry;
+   disk->newest = entry;
+
+   return &(entry->cluster);
+}
+
+
+// Ask the operating system to start reading the leaves
+// among the entries at the top of the tree priority queue,
+// which are the next candidates to be searched, so that
+// they are likely to be in memory by the time they are
+// loaded. Each leaf is prefetched at most once per search.
+void
+disk_prefetch_leaves( ap_DiskIndex *disk, ap_TreeQueue *tree_pq ) {
+
+   int i, leaf;
+   ap_Tree *tree;
+   for( i = 0; i < min( tree_pq->size, DISK_PREFETCH_DEPTH ); i++ ) {
+      tree = tree_pq->items[i].tree;
+      if( tree->is_leaf ) {
+         leaf = tree->cluster - disk->stubs;
+         if( disk->cache[leaf] == NULL && disk->prefetched[leaf] != disk->stamp ) {
+            disk->prefetched[leaf] = disk->stamp;
+            posix_fadvise( disk->fd, disk->leaves[leaf].offset, disk->leaves[leaf].length, POSIX_FADV_WILLNEED );
+         }
+      }
+   }
+}
+
+
+// Remove an entry from the cache and free its memory.
+void
+disk_evict( ap_DiskIndex *disk, ap_DiskCacheEntry *entry ) {
+
+   if( entry->prev != NULL )
+      entry->prev->next = entry->next;
+   else
+      disk->newest = entry->next;
+   if( entry->next != NULL )
+      entry->next->prev = entry->prev;
+   else
+      disk->oldest = entry->prev;
+
+   disk->cache[entry->leaf] = NULL;
+   disk->cached_bytes -= entry->bytes;
+   free( entry );
+}
+
+
+// Evict the least recently used leaves until the cache is
+// back within its limit.
+void
+disk_trim_cache( ap_DiskIndex *disk ) {
+
+   while( disk->oldest != NULL && disk->cached_bytes > disk->cache_bytes )
+      disk_evict( disk, disk->oldest );
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+                     SEARCH FUNCTIONS
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+
+// Search the on-disk index to find the k points nearest the
+// query and place them in out. The points in out are copies
+// that remain valid until the next search of the index.
+// Returns false, with out set to NULL, if a leaf could not
+// be read.
+bool
+disk_nearest_neighbor_search( ap_DiskIndex *disk, ap_Point *query, int k, ap_PointList **out, DIST_FUNC ) {
+
+   reset_arena( disk->results );
+   return disk_nearest_neighbor_search_query( disk, query, k, out, dist );
+}
+
+
+// Search the on-disk index to find the k points nearest each
+// of n_query queries and place them in out[0..n_query-1].
+// The queries are searched in the order of the leaves they
+// fall in, so that queries that share leaves run one after
+// another and find those leaves in the cache. The points in
+// out are copies that remain valid until the next search of
+// the index. Returns false if a leaf could not be read, in
+// which case out is NULL for each query that needed it and
+// the other queries are still answered.
+bool
+disk_nearest_neighbor_search_batch( ap_DiskIndex *disk, ap_Point **queries, int n_query, int k, ap_PointList **out, DIST_FUNC ) {
+
+   int i;
+   bool ok = true;
+
+   reset_arena( disk->results );
+
+   // Sort the queries by leaf, keeping their original order
+   // within each leaf
+   int64_t *keys = malloc( max( n_query, 1 ) * sizeof( int64_t ) );
+   assert( keys );
+   for( i = 0; i < n_query; i++ )
+      keys[i] = (int64_t)disk_first_leaf( disk, queries[i], dist ) << 32 | i;
+   qsort( keys, n_query, sizeof( int64_t ), compare_disk_keys );
+
+   for( i = 0; i < n_query; i++ )
+      if( !disk_nearest_neighbor_search_query( disk, queries[keys[i] & 0xffffffff], k, &out[keys[i] & 0xffffffff], dist ) )
+         ok = false;
+
+   free( keys );
+
+   return ok;
+}
+
+
+// Search the on-disk index using a priority queue for the
+// subtrees to find the k points nearest the query and place
+// them in out, as nearest_neighbor_search does, loading leaf
+// clusters as they are reached. The points found are copied
+// into the index's results arena before the cache is trimmed.
+// Returns false, with out set to NULL, if a leaf could not
+// be read.
+bool
+disk_nearest_neighbor_search_query( ap_DiskIndex *disk, ap_Point *query, int k, ap_PointList **out, DIST_FUNC ) {
+
+   double dist_a, dist_b;
+   ap_Tree *index;
+   ap_Point *copy;
+   ap_PointList *list;
+   ap_Cluster *cluster;
+
+   // Start a new search, so that the leaves it uses can be
+   // told apart in the cache
+   disk->stamp++;
+
+   // Create the tree and point priority queues
+   ap_TreeQueue *tree_pq = create_tree_queue();
+   ap_PointQueue *point_pq = create_point_queue( k );
+
+   // Search through the subtrees in order of proximity to the
+   // query, exactly as in nearest_neighbor_search
+   tree_queue_insert( tree_pq, disk->nodes, -1 );
+   while( tree_pq->size > 0 ) {
+
+      if( tree_pq->items[0].dist >= point_pq->bound )
+         break;
+
+      index = tree_queue_pop( tree_pq );
+
+      if( !index->is_leaf ) {
+         dist_a = dist( index->a, query );
+         dist_b = dist( index->b, query );
+
+         if( index->try_a )
+            point_queue_insert( point_pq, index->a, dist_a );
+         if( index->try_b )
+            point_queue_insert( point_pq, index->b, dist_b );
+
+         if( dist_a - index->radius_a < point_pq->bound )
+            tree_queue_insert( tree_pq, index->left,  dist_a - index->radius_a );
+         if( dist_b - index->radius_b < point_pq->bound )
+            tree_queue_insert( tree_pq, index->right, dist_b - index->radius_b );
+      } else {
+
+         // If tree is a leaf, load its cluster and search it for
+         // points that should be added to the point priority
+         // queue, giving up on the search if it cannot be read
+         cluster = disk_load_cluster( disk, index->cluster - disk->stubs );
+         if( cluster == NULL ) {
+            *out = NULL;
+            free_tree_queue( tree_pq );
+            free_point_queue( point_pq );
+            disk_trim_cache( disk );
+            return false;
+         }
+         nearest_neighbor_search_cluster( cluster, query, point_pq, false, NULL, dist );
+      }
+
+      // Start reading the leaves that are likely to be searched
+      // next
+      disk_prefetch_leaves( disk, tree_pq );
+   }
+
+   // Convert the point priority queue into an ap_PointList,
+   // replacing the points, which may belong to cached leaves,
+   // with copies
+   *out = point_queue_to_list( point_pq );
+   for( list = *out; list != NULL; list = list->next ) {
+      copy = arena_alloc( disk->results, sizeof( ap_Point ) );
+      copy->id = list->p->id;
+      copy->vec = arena_alloc( disk->results, disk->vec_size );
+      copy->ancestors = NULL;
+      memcpy( copy->vec, list->p->vec, disk->vec_size );
+      list->p = copy;
+   }
+
+   // Free up the memory used by the tree and point priority
+   // queues, and bring the cache back within its limit
+   free_tree_queue( tree_pq );
+   free_point_queue( point_pq );
+   disk_trim_cache( disk );
+
+   return true;
+}
+
+
+// Return the leaf the query would have been placed in had
+// it been in the tree, by descending toward the nearer
+// antipole at each node.
+int
+disk_first_leaf( ap_DiskIndex *disk, ap_Point *query, DIST_FUNC ) {
+
+   ap_Tree *node = disk->nodes;
+   while( !node->is_leaf )
+      node = dist( node->a, query ) <= dist( node->b, query ) ? node->left : node->right;
+
+   return node->cluster - disk->stubs;
+}
+
+
+// Compare two batch sort keys for use with qsort.
+int
+compare_disk_keys( const void *a, const void *b ) {
+
+   int64_t k1 = *(int64_t*)a, k2 = *(int64_t*)b;
+   return ( k1 > k2 ) - ( k1 < k2 );
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+               MEMORY MANAGEMENT FUNCTIONS
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+
+// Close an ap_DiskIndex and free up the memory it uses,
+// including its cache and the results of its last search.
+void
+free_disk_index( ap_DiskIndex *disk ) {
+
+   if( disk != NULL ) {
+      while( disk->newest != NULL )
+         disk_evict( disk, disk->newest );
+      close( disk->fd );
+      free( disk->points );
+      free( disk->vecs );
+      free( disk->nodes );
+      free( disk->stubs );
+      free( disk->leaves );
+      free( disk->cache );
+      free( disk->prefetched );
+      free_arena( disk->results );
+      free( disk );
+   }
+}
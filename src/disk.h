@@ -0,0 +1,123 @@
+/* disk.h
+ *
+ * Copyright (c) 2011, Jeffrey P. Gill
+ *
+ * This file is part of photomosaic.
+ *
+ * photomosaic is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * photomosaic is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with photomosaic.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DISK_H
+#define DISK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "antipole.h"
+
+#define DISK_MAGIC "APINDEX"     /* identifies an on-disk index file */
+#define DISK_VERSION 1           /* version of the on-disk index format */
+#define DISK_PAGE_SIZE 4096      /* size of the pages that leaf clusters are laid out in */
+#define DISK_PREFETCH_DEPTH 5    /* number of entries at the top of the tree priority queue whose leaves are prefetched */
+
+typedef struct ap_DiskHeader ap_DiskHeader;
+typedef struct ap_DiskNode ap_DiskNode;
+typedef struct ap_DiskLeaf ap_DiskLeaf;
+typedef struct ap_DiskCacheEntry ap_DiskCacheEntry;
+typedef struct ap_DiskIndex ap_DiskIndex;
+
+struct ap_DiskHeader {
+   char magic[8];             /* DISK_MAGIC */
+   uint32_t version;          /* DISK_VERSION */
+   uint32_t page_size;        /* size of the pages that leaf clusters are laid out in */
+   uint64_t vec_size;         /* number of bytes in each position vector */
+   uint64_t n_points;         /* number of records in the resident point table */
+   uint64_t n_nodes;          /* number of records in the node table */
+   uint64_t n_leaves;         /* number of records in the leaf table */
+};
+
+struct ap_DiskNode {
+   uint8_t is_leaf;           /* can be a leaf or an internal node */
+   uint8_t try_a, try_b;      /* if internal node, whether the antipoles are not also antipoles of an ancestor */
+   uint8_t unused;            /* padding */
+   int32_t a, b;              /* if internal node, antipoles as indices in the point table */
+   int32_t left, right;       /* if internal node, children as indices in the node table */
+   int32_t leaf;              /* if leaf, index in the leaf table */
+   double radius_a, radius_b; /* if internal node, distances from antipoles to their farthest point in cluster */
+};
+
+struct ap_DiskLeaf {
+   int32_t centroid;          /* geometric median of cluster as an index in the point table */
+   int32_t centroid_is_antipole; /* whether the centroid is an antipole of an ancestor node */
+   int32_t size;              /* number of members in cluster (not counting the centroid) */
+   int32_t n_antipoles;       /* number of members, at the end of the records, that are antipoles of ancestor nodes */
+   double radius;             /* distance from centroid to farthest point in cluster */
+   uint64_t offset;           /* position of the member records in the file */
+   uint64_t length;           /* number of bytes of member records */
+};
+
+struct ap_DiskCacheEntry {
+   int leaf;                  /* index of the cached leaf */
+   unsigned stamp;            /* number of the search that last used the leaf */
+   size_t bytes;              /* number of bytes of member records charged to the cache for the leaf */
+   ap_Cluster cluster;        /* the leaf's cluster with its members loaded */
+   ap_DiskCacheEntry *prev;   /* more recently used entry */
+   ap_DiskCacheEntry *next;   /* less recently used entry */
+};
+
+struct ap_DiskIndex {
+   int fd;                    /* open index file */
+   size_t vec_size;           /* number of bytes in each position vector */
+   size_t page_size;          /* size of the pages that leaf clusters are laid out in */
+   int n_points;              /* number of resident points */
+   int n_nodes;               /* number of nodes in the resident tree */
+   int n_leaves;              /* number of leaf clusters on disk */
+   ap_Point *points;          /* resident points (antipoles and centroids) */
+   char *vecs;                /* position vectors of resident points */
+   ap_Tree *nodes;            /* resident tree, root first */
+   ap_Cluster *stubs;         /* leaf clusters without their members, in leaf order */
+   ap_DiskLeaf *leaves;       /* locations of leaf clusters on disk */
+   ap_DiskCacheEntry **cache; /* cache entry for each leaf, or NULL if not loaded */
+   unsigned *prefetched;      /* number of the search that last prefetched each leaf */
+   ap_DiskCacheEntry *newest; /* most recently used cache entry */
+   ap_DiskCacheEntry *oldest; /* least recently used cache entry */
+   size_t cache_bytes;        /* number of bytes of member records the cache may hold */
+   size_t cached_bytes;       /* number of bytes of member records the cache holds */
+   unsigned stamp;            /* number of the current search */
+   ap_Arena *results;         /* copies of the points returned by the last search */
+   long loads, hits;          /* number of leaf loads from disk and from the cache */
+};
+
+bool save_disk_index( ap_Tree *tree, const char *path, size_t vec_size );
+void disk_count_tree( ap_Tree *tree, int *n_nodes, int *n_leaves, ap_Point **points, int *n_points );
+int disk_flatten_tree( ap_Tree *tree, ap_DiskNode *nodes, int *n_nodes, ap_DiskLeaf *leaves, ap_Cluster **clusters, int *n_leaves, ap_Point **points, int n_points );
+size_t disk_member_size( size_t vec_size );
+size_t disk_point_size( size_t vec_size );
+bool disk_read( int fd, void *buffer, size_t size, uint64_t offset );
+
+ap_DiskIndex* open_disk_index( const char *path, size_t cache_pages );
+ap_Cluster* disk_load_cluster( ap_DiskIndex *disk, int leaf );
+void disk_prefetch_leaves( ap_DiskIndex *disk, ap_TreeQueue *tree_pq );
+void disk_evict( ap_DiskIndex *disk, ap_DiskCacheEntry *entry );
+void disk_trim_cache( ap_DiskIndex *disk );
+
+bool disk_nearest_neighbor_search( ap_DiskIndex *disk, ap_Point *query, int k, ap_PointList **out, DIST_FUNC );
+bool disk_nearest_neighbor_search_batch( ap_DiskIndex *disk, ap_Point **queries, int n_query, int k, ap_PointList **out, DIST_FUNC );
+bool disk_nearest_neighbor_search_query( ap_DiskIndex *disk, ap_Point *query, int k, ap_PointList **out, DIST_FUNC );
+int disk_first_leaf( ap_DiskIndex *disk, ap_Point *query, DIST_FUNC );
+int compare_disk_keys( const void *a, const void *b );
+
+void free_disk_index( ap_DiskIndex *disk );
+
+#endif
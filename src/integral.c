@@ -0,0 +1,235 @@
+/* integral.c
+ *
+ * Copyright (c) 2011, Jeffrey P. Gill
+ *
+ * This file is part of photomosaic.
+ *
+ * photomosaic is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * photomosaic is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with photomosaic.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>  /* assert */
+#include <stdlib.h>  /* NULL, malloc, calloc */
+#include "integral.h"
+#include "trace.h"
+
+#define max(a,b) ((a) > (b) ? (a) : (b))
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+                 INTEGRAL IMAGE FUNCTIONS
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+
+// Create the summed-area tables of an image of width x
+// height pixels, each channels 8-bit values, with rows stride
+// bytes apart. Entry (x, y) of each channel's table holds the
+// sum over the pixels above and to the left of corner (x, y),
+// so the sum over any rectangle takes four lookups. The sums
+// of squared values, for cell variances, are only built if
+// squares is true. The image is read once.
+ap_IntegralImage*
+create_integral_image( const uint8_t *pixels, int width, int height, int channels, size_t stride, bool squares ) {
+
+   int x, y, c;
+   double start = trace_begin();
+
+   ap_IntegralImage *image = malloc( sizeof( ap_IntegralImage ) );
+   assert( image );
+   image->width = width;
+   image->height = height;
+   image->channels = channels;
+   image->stride = ( width + 1 ) * channels;
+   image->sums = calloc( ( height + 1 ) * image->stride, sizeof( uint64_t ) );
+   image->squares = squares ? calloc( ( height + 1 ) * image->stride, sizeof( uint64_t ) ) : NULL;
+   assert( image->sums && ( image->squares || !squares ) );
+
+   // Add the running sum along each row to the sums above it;
+   // the first row and column of each table stay zero
+   uint64_t row_sums[channels], row_squares[channels];
+   for( y = 0; y < height; y++ ) {
+      const uint8_t *pixel = pixels + y * stride;
+      uint64_t *above = image->sums + y * image->stride + channels;
+      uint64_t *sum = above + image->stride;
+      for( c = 0; c < channels; c++ )
+         row_sums[c] = row_squares[c] = 0;
+      for( x = 0; x < width; x++ ) {
+         for( c = 0; c < channels; c++, pixel++ ) {
+            row_sums[c] += *pixel;
+            sum[x * channels + c] = above[x * channels + c] + row_sums[c];
+         }
+      }
+      if( squares ) {
+         pixel = pixels + y * stride;
+         above = image->squares + y * image->stride + channels;
+         sum = above + image->stride;
+         for( x = 0; x < width; x++ ) {
+            for( c = 0; c < channels; c++, pixel++ ) {
+               row_squares[c] += (uint64_t)*pixel * *pixel;
+               sum[x * channels + c] = above[x * channels + c] + row_squares[c];
+            }
+         }
+      }
+   }
+
+   trace_end( "extract", "create_integral_image", start );
+
+   return image;
+}
+
+
+// Return the sum of one channel over the w x h rectangle of
+// the image whose top left pixel is (x, y).
+uint64_t
+integral_sum( ap_IntegralImage *image, int x, int y, int w, int h, int channel ) {
+
+   const uint64_t *top = image->sums + y * image->stride + channel;
+   const uint64_t *bottom = top + h * image->stride;
+
+   return bottom[( x + w ) * image->channels] - bottom[x * image->channels] - top[( x + w ) * image->channels] + top[x * image->channels];
+}
+
+
+// Store the mean of each channel over the w x h rectangle of
+// the image whose top left pixel is (x, y) in mean.
+void
+integral_mean( ap_IntegralImage *image, int x, int y, int w, int h, double *mean ) {
+
+   int c;
+
+   for( c = 0; c < image->channels; c++ )
+      mean[c] = (double)integral_sum( image, x, y, w, h, c ) / ( w * h );
+}
+
+
+// Store the variance of each channel over the w x h
+// rectangle of the image whose top left pixel is (x, y) in
+// variance. The image must have been created with squares.
+void
+integral_variance( ap_IntegralImage *image, int x, int y, int w, int h, double *variance ) {
+
+   int c;
+   double mean, mean_square;
+
+   assert( image->squares );
+
+   const uint64_t *top = image->squares + y * image->stride;
+   const uint64_t *bottom = top + h * image->stride;
+   for( c = 0; c < image->channels; c++ ) {
+      mean = (double)integral_sum( image, x, y, w, h, c ) / ( w * h );
+      mean_square = (double)( bottom[( x + w ) * image->channels + c] - bottom[x * image->channels + c] - top[( x + w ) * image->channels + c] + top[x * image->channels + c] ) / ( w * h );
+      variance[c] = max( mean_square - mean * mean, 0 );
+   }
+}
+
+
+// Store the descriptor of the size x size cell of the image
+// whose top left pixel is (x, y) in vec: the rounded mean
+// color of each of a side x side grid of sub-cells, in
+// row-major order, laid out as dihedral_transform expects
+// with cells of image->channels bytes. When side does not
+// divide size, the sub-cells differ in size by one pixel.
+void
+integral_descriptor( ap_IntegralImage *image, int x, int y, int size, int side, uint8_t *vec ) {
+
+   int r, col, c, x0, x1, y0, y1;
+   uint64_t area;
+
+   assert( size >= side );
+
+   for( r = 0; r < side; r++ ) {
+      y0 = y + r * size / side;
+      y1 = y + ( r + 1 ) * size / side;
+      for( col = 0; col < side; col++ ) {
+         x0 = x + col * size / side;
+         x1 = x + ( col + 1 ) * size / side;
+         area = (uint64_t)( x1 - x0 ) * ( y1 - y0 );
+         for( c = 0; c < image->channels; c++, vec++ )
+            *vec = ( integral_sum( image, x0, y0, x1 - x0, y1 - y0, c ) + area / 2 ) / area;
+      }
+   }
+}
+
+
+// Create the descriptors of every cell_size x cell_size cell
+// of a grid laid over the image with its first cell's top
+// left corner at (offset_x, offset_y), keeping only the cells
+// that lie wholly within the image. Trying another cell size
+// or offset costs one descriptor per cell, without reading
+// the image again. The descriptors are ready to be passed to
+// the batch searches as queries.
+ap_DescriptorGrid*
+create_descriptor_grid( ap_IntegralImage *image, int cell_size, int offset_x, int offset_y, int side ) {
+
+   int i, row, col;
+   double start = trace_begin();
+
+   assert( offset_x >= 0 && offset_y >= 0 );
+
+   ap_DescriptorGrid *grid = malloc( sizeof( ap_DescriptorGrid ) );
+   assert( grid );
+   grid->n_cols = max( ( image->width - offset_x ) / cell_size, 0 );
+   grid->n_rows = max( ( image->height - offset_y ) / cell_size, 0 );
+   grid->cell_size = cell_size;
+   grid->offset_x = offset_x;
+   grid->offset_y = offset_y;
+   grid->side = side;
+   grid->vec_size = side * side * image->channels;
+
+   int n_cells = grid->n_cols * grid->n_rows;
+   grid->points = malloc( max( n_cells, 1 ) * sizeof( ap_Point ) );
+   grid->queries = malloc( max( n_cells, 1 ) * sizeof( ap_Point* ) );
+   grid->vecs = malloc( max( n_cells, 1 ) * grid->vec_size );
+   assert( grid->points && grid->queries && grid->vecs );
+
+   for( row = 0, i = 0; row < grid->n_rows; row++ ) {
+      for( col = 0; col < grid->n_cols; col++, i++ ) {
+         grid->points[i].id = i;
+         grid->points[i].vec = grid->vecs + i * grid->vec_size;
+         grid->points[i].ancestors = NULL;
+         grid->queries[i] = &(grid->points[i]);
+         integral_descriptor( image, offset_x + col * cell_size, offset_y + row * cell_size, cell_size, side, grid->vecs + i * grid->vec_size );
+      }
+   }
+
+   trace_end( "extract", "create_descriptor_grid", start );
+
+   return grid;
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+               MEMORY MANAGEMENT FUNCTIONS
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+
+// Free up memory used by an ap_IntegralImage.
+void
+free_integral_image( ap_IntegralImage *image ) {
+
+   free( image->sums );
+   free( image->squares );
+   free( image );
+}
+
+
+// Free up memory used by an ap_DescriptorGrid, including its
+// descriptors.
+void
+free_descriptor_grid( ap_DescriptorGrid *grid ) {
+
+   free( grid->points );
+   free( grid->queries );
+   free( grid->vecs );
+   free( grid );
+}
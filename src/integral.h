@@ -0,0 +1,61 @@
+/* integral.h
+ *
+ * Copyright (c) 2011, Jeffrey P. Gill
+ *
+ * This file is part of photomosaic.
+ *
+ * photomosaic is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * photomosaic is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with photomosaic.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef INTEGRAL_H
+#define INTEGRAL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "antipole.h"
+
+typedef struct ap_IntegralImage ap_IntegralImage;
+typedef struct ap_DescriptorGrid ap_DescriptorGrid;
+
+struct ap_IntegralImage {
+   int width, height;         /* size of the image in pixels */
+   int channels;              /* number of 8-bit channels in each pixel */
+   size_t stride;             /* number of sums in each row of the tables, (width + 1) * channels */
+   uint64_t *sums;            /* sum of each channel over the pixels above and to the left of each corner */
+   uint64_t *squares;         /* the same sums of squared channels, or NULL if they were not requested */
+};
+
+struct ap_DescriptorGrid {
+   int n_cols, n_rows;        /* number of cells across and down the image */
+   int cell_size;             /* width and height of each cell in pixels */
+   int offset_x, offset_y;    /* position of the first cell's top left corner */
+   int side;                  /* number of sub-cells across and down each descriptor */
+   size_t vec_size;           /* number of bytes in each descriptor */
+   ap_Point *points;          /* descriptor of each cell, in row-major order, with the cell's index as its id */
+   ap_Point **queries;        /* pointer to each descriptor, for the batch searches */
+   uint8_t *vecs;             /* position vectors of the descriptors */
+};
+
+ap_IntegralImage* create_integral_image( const uint8_t *pixels, int width, int height, int channels, size_t stride, bool squares );
+uint64_t integral_sum( ap_IntegralImage *image, int x, int y, int w, int h, int channel );
+void integral_mean( ap_IntegralImage *image, int x, int y, int w, int h, double *mean );
+void integral_variance( ap_IntegralImage *image, int x, int y, int w, int h, double *variance );
+void integral_descriptor( ap_IntegralImage *image, int x, int y, int size, int side, uint8_t *vec );
+ap_DescriptorGrid* create_descriptor_grid( ap_IntegralImage *image, int cell_size, int offset_x, int offset_y, int side );
+
+void free_integral_image( ap_IntegralImage *image );
+void free_descriptor_grid( ap_DescriptorGrid *grid );
+
+#endif
@@ -19,12 +19,25 @@
  */
 
 #include <assert.h>     /* assert */
-#include <math.h>       /* sqrt, pow */
+#include <math.h>       /* sqrt, pow, fabs, fmax */
 #include <stdint.h>     /* uint8_t */
-#include <stdio.h>      /* printf */
-#include <stdlib.h>     /* rand */
+#include <stdio.h>      /* printf, snprintf, fopen */
+#include <stdlib.h>     /* getenv, rand, mkstemp, mkdtemp */
+#include <string.h>     /* memcmp */
 #include <time.h>       /* time */
+#include <unistd.h>     /* close, unlink, rmdir */
 #include "antipole.h"
+#include "atlas.h"
+#include "cache.h"
+#include "dedup.h"
+#include "dihedral.h"
+#include "disk.h"
+#include "integral.h"
+#include "pca.h"
+#include "quadtree.h"
+#include "temporal.h"
+#include "tileio.h"
+#include "trace.h"
 
 const int DIM = 2;         /* dimensionality of the mean RGB data */
 typedef uint8_t VEC_TYPE;  /* data type of the mean RGB data */
@@ -36,6 +49,13 @@ typedef uint8_t VEC_TYPE;  /* data type of the mean RGB data */
 //#define VEC_DOMAIN 1.0
 //#define RAND_DATA VEC_DOMAIN*(double)rand()/(double)RAND_MAX
 
+#define DESCRIPTOR_SIDE 2        /* number of cells across and down each tile descriptor */
+#define DESCRIPTOR_CHANNELS 3    /* number of 8-bit channels in each descriptor cell */
+#define DESCRIPTOR_SIZE ( DESCRIPTOR_SIDE * DESCRIPTOR_SIDE * DESCRIPTOR_CHANNELS )
+
+#define TILE_FILE_SIZE(index) ( 4096 + (size_t)(index) * 1237 )          /* number of bytes in each test tile file */
+#define TILE_FILE_BYTE(index, i) (uint8_t)( (index) * 31 + (i) * 7 )    /* contents of each test tile file */
+
 // Calculate the Euclidian distance between two points
 double
 dist( ap_Point *p1, ap_Point *p2 ) {
@@ -49,6 +69,102 @@ dist( ap_Point *p1, ap_Point *p2 ) {
 }
 
 
+// Calculate the Chebyshev distance between two points, which
+// is never greater than the Euclidian distance and so can
+// serve as a cheap proxy for it during searches
+double
+chebyshev_dist( ap_Point *p1, ap_Point *p2 ) {
+
+   int i;
+   double max_diff = 0;
+   for( i = 0; i < DIM; i++ )
+      max_diff = fmax( max_diff, fabs( (double)((VEC_TYPE*)p1->vec)[i] - (double)((VEC_TYPE*)p2->vec)[i] ) );
+
+   return max_diff;
+}
+
+
+// Calculate the Euclidian distance between two points whose
+// position vectors are arrays of DIM doubles
+double
+double_dist( ap_Point *p1, ap_Point *p2 ) {
+
+   int i;
+   double sum = 0;
+   for( i = 0; i < DIM; i++ )
+      sum += pow( ((double*)p1->vec)[i] - ((double*)p2->vec)[i], 2 );
+
+   return sqrt( sum );
+}
+
+
+// Calculate the Euclidian distance between two tile
+// descriptors of DESCRIPTOR_SIZE bytes
+double
+descriptor_dist( ap_Point *p1, ap_Point *p2 ) {
+
+   int i;
+   double sum = 0;
+   for( i = 0; i < DESCRIPTOR_SIZE; i++ )
+      sum += pow( ((uint8_t*)p1->vec)[i] - ((uint8_t*)p2->vec)[i], 2 );
+
+   return sqrt( sum );
+}
+
+
+// Find the k points of data nearest the query by calculating
+// the distance to every one, for checking the searches
+ap_PointList*
+naive_nearest_neighbor_search( ap_Point **data, int n_data, ap_Point *query, int k, DIST_FUNC ) {
+
+   int i;
+   ap_PointList *out;
+
+   ap_PointQueue *point_pq = create_point_queue( k );
+   for( i = 0; i < n_data; i++ )
+      point_queue_insert( point_pq, data[i], dist( data[i], query ) );
+   out = point_queue_to_list( point_pq );
+   free_point_queue( point_pq );
+
+   return out;
+}
+
+
+// Return true if two lists of neighbors sorted by distance
+// hold the same number of points at the same distances. Ties
+// may be broken differently, so the points themselves are
+// not compared.
+bool
+same_neighbors( ap_PointList *a, ap_PointList *b ) {
+
+   for( ; a != NULL && b != NULL; a = a->next, b = b->next )
+      if( a->dist != b->dist )
+         return false;
+
+   return a == NULL && b == NULL;
+}
+
+
+// Check the contents of a test tile file read by a tile
+// reader, recording in the slot of arg for its index 1 if
+// they are right, 0 if they are wrong, or -1 if the file
+// could not be read
+void
+check_tile_file( int index, uint8_t *data, size_t size, void *arg ) {
+
+   size_t i;
+   int *checks = arg;
+
+   if( data == NULL ) {
+      checks[index] = -1;
+      return;
+   }
+   checks[index] = size == TILE_FILE_SIZE( index );
+   for( i = 0; i < size && checks[index]; i++ )
+      checks[index] = data[i] == TILE_FILE_BYTE( index, i );
+}
+
+
 int
 main() {
 
@@ -56,16 +172,23 @@ main() {
 
    int i, j;
    int n_data = 20, n_query = 10, n_neighbor = 5;
-   double bounded_radius = VEC_DOMAIN * 0.05 * sqrt(DIM);
+   double bounded_radius;
    double range = VEC_DOMAIN * 0.1;
    int seed = time(NULL);
    srand(seed);
 
+   // Record a trace of the run's phases if the environment
+   // names a file for it
+   const char *trace_path = getenv( TRACE_ENV );
+   if( trace_path != NULL )
+      start_trace();
+
    ap_Point *data[n_data];
    ap_Point *query[n_query];
    ap_PointList *results[n_query];
+   ap_NeighborArray *range_results[n_query];
    ap_PointList *s;
-   ap_Tree *tree;
+   ap_Index *search_index;
 
    printf("(* parameters *)\n");
    printf("dim = %d;\n", DIM);
@@ -118,21 +241,30 @@ main() {
    ap_Point *median;
    exact_1_median( s, &median, dist );
    printf("exactMedian = %d;\n", median->id);
-   approx_1_median( s, &median, DIM, dist );
+   approx_1_median( s, &median, DIM, NULL, dist );
    printf("approxMedian = %d;\n", median->id);
 
    // Find the antipole pair
    ap_Point *antipole_a, *antipole_b;
    exact_antipoles( s, &antipole_a, &antipole_b, dist );
    printf("exactAntipoles = {%d,%d};\n", antipole_a->id, antipole_b->id);
-   approx_antipoles( s, &antipole_a, &antipole_b, DIM, dist );
+   approx_antipoles( s, &antipole_a, &antipole_b, DIM, NULL, dist );
    printf("approxAntipoles = {%d,%d};\n", antipole_a->id, antipole_b->id);
    */
 
-   // Construct a tree
-   printf("(* building tree... *)\n");
-   tree = build_tree( s, bounded_radius, NULL, NULL, DIM, dist );
+   // Tune the target radius on the data, using points of the
+   // set as the query workload
+   printf("(* tuning target radius... ");
+   bounded_radius = tune_target_radius( s, NULL, 0, n_neighbor, 0, DIM, NULL, dist );
+   printf("done *)\n");
+
+   // Construct an index, letting calibration decide whether
+   // it should be a tree or a flat scan
+   printf("(* building index... *)\n");
+   search_index = build_index( s, bounded_radius, INDEX_AUTO, DIM, dist );
    printf("(* ... done *)\n");
+   printf("indexType = \"%s\";\n", search_index->type == INDEX_TREE ? "tree" : "flat");
+   printf("targetRadius = %f;\n", search_index->target_radius);
 
    // Construct a set of query points
    printf("(* creating query points... ");
@@ -167,14 +299,41 @@ main() {
    // Perform a range search on the query
    printf("(* performing range search... ");
    for( i = 0; i < n_query; i++ ) {
-      results[i] = NULL;
-      range_search( tree, query[i], range, &results[i], dist );
+      range_results[i] = create_neighbor_array();
+      index_range_search( search_index, query[i], range, range_results[i], dist );
    }
    printf("done *)\n");
 
 #ifdef DEBUG
    // Dump the range search results for Mathematica
    printf("rangeResults = {");
+   for( i = 0; i < n_query; i++ ) {
+      printf("{");
+      for( j = 0; j < range_results[i]->size; j++ ) {
+         printf("%d", range_results[i]->items[j].p->id);
+         if( j < range_results[i]->size-1 )
+            printf(",");
+      }
+      if( i < n_query-1 )
+         printf("},");
+      else
+         printf("}");
+   }
+   printf("};\n");
+#endif
+
+   // Perform a nearest neighbor search on the query
+   printf("(* performing nearest neighbor search... ");
+   for( i = 0; i < n_query; i++ ) {
+      free_neighbor_array( range_results[i] );
+      results[i] = NULL;
+      index_nearest_neighbor_search( search_index, query[i], n_neighbor, &results[i], dist );
+   }
+   printf("done *)\n");
+
+#ifdef DEBUG
+   // Dump the nearest neighbor search results for Mathematica
+   printf("nearestNeighborResults = {");
    ap_PointList *index;
    for( i = 0; i < n_query; i++ ) {
       printf("{");
@@ -191,18 +350,20 @@ main() {
    printf("};\n");
 #endif
 
-   // Perform a nearest neighbor search on the query
-   printf("(* performing nearest neighbor search... ");
+   // Perform a nearest neighbor search limited to the range on
+   // the query, using the Chebyshev distance as a proxy
+   printf("(* performing nearest neighbor within range search... ");
    for( i = 0; i < n_query; i++ ) {
       free_list( results[i] );
       results[i] = NULL;
-      nearest_neighbor_search( tree, query[i], n_neighbor, &results[i], dist );
+      index_nearest_neighbor_search_within( search_index, query[i], n_neighbor, range, &results[i], chebyshev_dist, dist );
    }
    printf("done *)\n");
 
 #ifdef DEBUG
-   // Dump the nearest neighbor search results for Mathematica
-   printf("nearestNeighborResults = {");
+   // Dump the nearest neighbor within range search results for
+   // Mathematica
+   printf("nearestNeighborWithinResults = {");
    for( i = 0; i < n_query; i++ ) {
       printf("{");
       for( index = results[i]; index != NULL; index = index->next ) {
@@ -218,28 +379,526 @@ main() {
    printf("};\n");
 #endif
 
+   // Perform a batched nearest neighbor search on all queries
+   // at once
+   printf("(* performing batch nearest neighbor search... ");
+   for( i = 0; i < n_query; i++ )
+      free_list( results[i] );
+   index_nearest_neighbor_search_batch( search_index, query, n_query, n_neighbor, results, dist );
+   printf("done *)\n");
+
+#ifdef DEBUG
+   // Dump the batch nearest neighbor search results for
+   // Mathematica
+   printf("batchNearestNeighborResults = {");
+   for( i = 0; i < n_query; i++ ) {
+      printf("{");
+      for( index = results[i]; index != NULL; index = index->next ) {
+         printf("%d", index->p->id);
+         if( index->next != NULL )
+            printf(",");
+      }
+      if( i < n_query-1 )
+         printf("},");
+      else
+         printf("}");
+   }
+   printf("};\n");
+#endif
+
+   // Perform a dual-tree nearest neighbor search, comparing a
+   // tree built over the queries against the data tree
+   if( search_index->type == INDEX_TREE ) {
+      printf("(* performing dual-tree nearest neighbor search... ");
+      ap_PointList *query_set = NULL;
+      for( i = 0; i < n_query; i++ ) {
+         free_list( results[i] );
+         add_point( &query_set, query[i], 0 );
+      }
+      ap_Tree *query_tree = build_tree( query_set, bounded_radius, NULL, NULL, DIM, dist );
+      nearest_neighbor_search_dual_tree( query_tree, search_index->tree, query, n_query, n_neighbor, results, dist );
+      free_tree( query_tree );
+      free_list( query_set );
+      printf("done *)\n");
+
+#ifdef DEBUG
+      // Dump the dual-tree nearest neighbor search results for
+      // Mathematica
+      printf("dualTreeNearestNeighborResults = {");
+      for( i = 0; i < n_query; i++ ) {
+         printf("{");
+         for( index = results[i]; index != NULL; index = index->next ) {
+            printf("%d", index->p->id);
+            if( index->next != NULL )
+               printf(",");
+         }
+         if( i < n_query-1 )
+            printf("},");
+         else
+            printf("}");
+      }
+      printf("};\n");
+#endif
+
+      // Perform a batched nearest neighbor search on an on-disk
+      // copy of the tree, with a cache too small to hold all of
+      // its leaves
+      printf("(* performing out-of-core nearest neighbor search... ");
+      char disk_path[] = "/tmp/photomosaic-XXXXXX";
+      int disk_fd = mkstemp( disk_path );
+      assert( disk_fd >= 0 );
+      close( disk_fd );
+      bool saved = save_disk_index( search_index->tree, disk_path, DIM * sizeof( VEC_TYPE ) );
+      assert( saved );
+      ap_DiskIndex *disk_index = open_disk_index( disk_path, 1 );
+      assert( disk_index );
+      unlink( disk_path );
+      for( i = 0; i < n_query; i++ )
+         free_list( results[i] );
+      bool searched = disk_nearest_neighbor_search_batch( disk_index, query, n_query, n_neighbor, results, dist );
+      assert( searched );
+      printf("done *)\n");
+
+#ifdef DEBUG
+      // Dump the out-of-core nearest neighbor search results for
+      // Mathematica
+      printf("diskNearestNeighborResults = {");
+      for( i = 0; i < n_query; i++ ) {
+         printf("{");
+         for( index = results[i]; index != NULL; index = index->next ) {
+            printf("%d", index->p->id);
+            if( index->next != NULL )
+               printf(",");
+         }
+         if( i < n_query-1 )
+            printf("},");
+         else
+            printf("}");
+      }
+      printf("};\n");
+#endif
+
+      for( i = 0; i < n_query; i++ ) {
+         free_list( results[i] );
+         results[i] = NULL;
+      }
+      free_disk_index( disk_index );
+   }
+
+   // Perform nearest neighbor searches over several frames of
+   // a video, in which some query cells drift slightly from
+   // one frame to the next, reusing each cell's previous
+   // results where they are provably still the nearest, and
+   // check every frame against a naive search
+   printf("(* performing temporal nearest neighbor search... ");
+   for( i = 0; i < n_query; i++ )
+      free_list( results[i] );
+   int n_frame = 3, n_mismatch = 0;
+   ap_PointList *expected;
+   ap_TemporalCache *temporal_cache = create_temporal_cache( n_query, n_neighbor, DIM * sizeof( VEC_TYPE ) );
+   for( j = 0; j < n_frame; j++ ) {
+      for( i = 0; i < n_query; i++ ) {
+         if( j > 0 && rand() % 2 )
+            ((VEC_TYPE*)query[i]->vec)[0] = ((VEC_TYPE*)query[i]->vec)[0] > 0 ? ((VEC_TYPE*)query[i]->vec)[0] - 1 : 1;
+         temporal_nearest_neighbor_search( temporal_cache, search_index, i, query[i], &results[i], NULL, dist );
+         expected = naive_nearest_neighbor_search( data, n_data, query[i], n_neighbor, dist );
+         n_mismatch += !same_neighbors( results[i], expected );
+         free_list( expected );
+      }
+   }
+   printf("done *)\n");
+   printf("temporalReused = %ld;\n", temporal_cache->reused);
+   printf("temporalSeeded = %ld;\n", temporal_cache->seeded);
+   printf("temporalMismatches = %d;\n", n_mismatch);
+   for( i = 0; i < n_query; i++ )
+      results[i] = NULL;
+   free_temporal_cache( temporal_cache );
+
+   // Search the queries through a result cache three times:
+   // the second pass repeats them exactly and the third nudges
+   // them within their quantization bins, as the near-identical
+   // cells of a flat region are. Check each against a naive
+   // search.
+   printf("(* performing cached nearest neighbor search... ");
+   n_mismatch = 0;
+   ap_ResultCache *result_cache = create_result_cache( search_index, 4 * n_query, n_neighbor, DIM, CACHE_UINT8, 8 );
+   for( j = 0; j < 3; j++ ) {
+      for( i = 0; i < n_query; i++ ) {
+         if( j == 2 )
+            ((VEC_TYPE*)query[i]->vec)[DIM-1] ^= 1;
+         cached_nearest_neighbor_search( result_cache, query[i], &results[i], NULL, dist );
+         expected = naive_nearest_neighbor_search( data, n_data, query[i], n_neighbor, dist );
+         n_mismatch += !same_neighbors( results[i], expected );
+         free_list( expected );
+         free_list( results[i] );
+         results[i] = NULL;
+      }
+   }
+   printf("done *)\n");
+   printf("cacheExact = %ld;\n", atomic_load( &result_cache->exact ));
+   printf("cacheReused = %ld;\n", atomic_load( &result_cache->reused ));
+   printf("cacheSeeded = %ld;\n", atomic_load( &result_cache->seeded ));
+   printf("cacheMissed = %ld;\n", atomic_load( &result_cache->missed ));
+   printf("cacheMismatches = %d;\n", n_mismatch);
+   free_result_cache( result_cache );
+
+   // Pull neighbors one at a time for each query, as a mosaic
+   // does when its tile-reuse rules reject some of them, here
+   // rejecting every point with an odd id
+   printf("(* performing incremental nearest neighbor search... ");
+   ap_Point *neighbor;
+   long n_pulled = 0;
+   for( i = 0; i < n_query; i++ ) {
+      ap_NeighborIterator *iter = create_index_neighbor_iterator( search_index, query[i] );
+      for( j = 0; j < n_neighbor && ( neighbor = neighbor_iterator_next( iter, NULL, dist ) ) != NULL; )
+         if( neighbor->id % 2 == 0 )
+            j++;
+      n_pulled += iter->yielded;
+      free_neighbor_iterator( iter );
+   }
+   printf("done *)\n");
+   printf("incrementalPulled = %ld;\n", n_pulled);
+
+   // Search a principal component projection of the data that
+   // keeps one of its DIM components, and check it against a
+   // naive search over the same points as doubles
+   printf("(* performing PCA nearest neighbor search... ");
+   ap_Point double_points[n_data + n_query], *double_data[n_data];
+   double double_vecs[( n_data + n_query ) * DIM];
+   ap_PointList *double_set = NULL;
+   for( i = 0; i < n_data + n_query; i++ ) {
+      ap_Point *original = i < n_data ? data[i] : query[i - n_data];
+      double_points[i].id = original->id;
+      double_points[i].vec = double_vecs + i * DIM;
+      double_points[i].ancestors = NULL;
+      for( j = 0; j < DIM; j++ )
+         double_vecs[i * DIM + j] = ((VEC_TYPE*)original->vec)[j];
+      if( i < n_data ) {
+         double_data[i] = &double_points[i];
+         add_point( &double_set, &double_points[i], 0 );
+      }
+   }
+   ap_PcaIndex *pca_index = build_pca_index( double_set, DIM, 1, bounded_radius, INDEX_AUTO );
+   n_mismatch = 0;
+   for( i = 0; i < n_query; i++ ) {
+      pca_nearest_neighbor_search( pca_index, &double_points[n_data + i], n_neighbor, &results[i], double_dist );
+      expected = naive_nearest_neighbor_search( double_data, n_data, &double_points[n_data + i], n_neighbor, double_dist );
+      n_mismatch += !same_neighbors( results[i], expected );
+      free_list( expected );
+      free_list( results[i] );
+      results[i] = NULL;
+   }
+   printf("done *)\n");
+   printf("pcaRetained = %f;\n", pca_index->pca->retained);
+   printf("pcaMismatches = %d;\n", n_mismatch);
+   free_pca_index( pca_index );
+   free_list( double_set );
+
+   // Search a set of tile descriptors for the tiles nearest any
+   // rotation or mirror image of each query tile, with a tree
+   // index and with a flat index, and check the distances and
+   // the orientations returned against a naive scan of every
+   // variant
+   printf("(* performing dihedral variants search... ");
+   int n_tile = 500, orientations[n_neighbor], t, v;
+   double variant_dist;
+   ap_Point tiles[n_tile + n_query], *tile_data[n_tile], **variants;
+   uint8_t tile_vecs[( n_tile + n_query ) * DESCRIPTOR_SIZE];
+   ap_PointList *tile_set = NULL, *match;
+   for( i = 0; i < n_tile + n_query; i++ ) {
+      tiles[i].id = i + 1;
+      tiles[i].vec = tile_vecs + i * DESCRIPTOR_SIZE;
+      tiles[i].ancestors = NULL;
+      for( j = 0; j < DESCRIPTOR_SIZE; j++ )
+         tile_vecs[i * DESCRIPTOR_SIZE + j] = rand() % 256;
+      if( i < n_tile ) {
+         tile_data[i] = &tiles[i];
+         add_point( &tile_set, &tiles[i], 0 );
+      }
+   }
+   double tile_radius = tune_target_radius( tile_set, NULL, 0, n_neighbor, 0, DESCRIPTOR_SIZE, NULL, descriptor_dist );
+   ap_Index *tile_indexes[2] = { build_index( tile_set, tile_radius, INDEX_TREE, DESCRIPTOR_SIZE, descriptor_dist ),
+                                 build_index( tile_set, tile_radius, INDEX_FLAT, DESCRIPTOR_SIZE, descriptor_dist ) };
+   n_mismatch = 0;
+   for( t = 0; t < 2; t++ ) {
+      for( i = 0; i < n_query; i++ ) {
+         variants = create_dihedral_variants( &tiles[n_tile + i], DESCRIPTOR_SIDE, DESCRIPTOR_CHANNELS );
+         index_nearest_neighbor_search_variants( tile_indexes[t], variants, DIHEDRAL_ORIENTATIONS, n_neighbor, &results[i], orientations, descriptor_dist );
+         ap_PointQueue *point_pq = create_point_queue( n_neighbor );
+         for( j = 0; j < n_tile; j++ ) {
+            for( v = 0, variant_dist = INFINITY; v < DIHEDRAL_ORIENTATIONS; v++ )
+               variant_dist = fmin( variant_dist, descriptor_dist( variants[v], tile_data[j] ) );
+            point_queue_insert( point_pq, tile_data[j], variant_dist );
+         }
+         expected = point_queue_to_list( point_pq );
+         n_mismatch += !same_neighbors( results[i], expected );
+         for( j = 0, match = results[i]; match != NULL; j++, match = match->next )
+            n_mismatch += descriptor_dist( variants[orientations[j]], match->p ) != match->dist;
+         free_point_queue( point_pq );
+         free_list( expected );
+         free_list( results[i] );
+         results[i] = NULL;
+         free_dihedral_variants( variants );
+      }
+   }
+   printf("done *)\n");
+   printf("variantsMismatches = %d;\n", n_mismatch);
+   free_index( tile_indexes[0] );
+   free_index( tile_indexes[1] );
+   free_list( tile_set );
+
+   // Store random tiles in every other slot of an atlas file,
+   // reopen it, and draw every slot at the largest level size,
+   // at the next level down, and at a size between levels,
+   // checking the pixels against the source tiles: copied, 2 x
+   // 2 averaged, and sampled, respectively
+   printf("(* performing atlas round-trip and blit... ");
+   int n_atlas = 16, atlas_size = 32, cell_sizes[3] = { 32, 16, 20 }, cell_size, x, y, c, expected_pixel;
+   uint8_t atlas_pixels[n_atlas][atlas_size * atlas_size * ATLAS_CHANNELS], cell[atlas_size * atlas_size * ATLAS_CHANNELS];
+   char atlas_path[] = "/tmp/photomosaic-XXXXXX";
+   int atlas_fd = mkstemp( atlas_path );
+   assert( atlas_fd >= 0 );
+   close( atlas_fd );
+   ap_Atlas *atlas = create_atlas( atlas_path, n_atlas, 4, atlas_size );
+   assert( atlas );
+   for( i = 0; i < n_atlas; i += 2 ) {
+      for( j = 0; j < atlas_size * atlas_size * ATLAS_CHANNELS; j++ )
+         atlas_pixels[i][j] = rand() % 256;
+      bool added = atlas_add_tile( atlas, i, atlas_pixels[i], atlas_size, atlas_size, atlas_size * ATLAS_CHANNELS );
+      assert( added );
+   }
+   free_atlas( atlas );
+   atlas = open_atlas( atlas_path );
+   assert( atlas );
+   unlink( atlas_path );
+   n_mismatch = 0;
+   for( i = 0; i < n_atlas; i++ ) {
+      for( t = 0; t < 3; t++ ) {
+         cell_size = cell_sizes[t];
+         if( atlas_blit( atlas, i, cell_size, cell, cell_size * ATLAS_CHANNELS ) != ( i % 2 == 0 ) ) {
+            n_mismatch++;
+            continue;
+         }
+         if( i % 2 != 0 )
+            continue;
+         const uint8_t *src = atlas_pixels[i];
+         size_t row = atlas_size * ATLAS_CHANNELS;
+         for( y = 0; y < cell_size; y++ ) {
+            for( x = 0; x < cell_size; x++ ) {
+               for( c = 0; c < ATLAS_CHANNELS; c++ ) {
+                  if( cell_size * 2 == atlas_size )
+                     expected_pixel = ( src[2 * y * row + 2 * x * ATLAS_CHANNELS + c] + src[2 * y * row + ( 2 * x + 1 ) * ATLAS_CHANNELS + c] +
+                                        src[( 2 * y + 1 ) * row + 2 * x * ATLAS_CHANNELS + c] + src[( 2 * y + 1 ) * row + ( 2 * x + 1 ) * ATLAS_CHANNELS + c] + 2 ) / 4;
+                  else
+                     expected_pixel = src[y * atlas_size / cell_size * row + x * atlas_size / cell_size * ATLAS_CHANNELS + c];
+                  n_mismatch += cell[( y * cell_size + x ) * ATLAS_CHANNELS + c] != expected_pixel;
+               }
+            }
+         }
+      }
+   }
+   printf("done *)\n");
+   printf("atlasLevels = {%d,%d};\n", atlas->min_level, atlas->max_level);
+   printf("atlasMismatches = %d;\n", n_mismatch);
+
+   // Write a directory of test tile files and read them back,
+   // along with one that does not exist, through io_uring if
+   // the kernel permits it and through the blocking reader
+   // threads, checking the contents handed to each decode call
+   printf("(* performing tile file loading... ");
+   int n_files = 40, tile_checks[n_files + 1], n_files_read, tile_uring = 0;
+   char tile_dir[] = "/tmp/photomosaic-XXXXXX", tile_paths[n_files + 1][sizeof( tile_dir ) + 16];
+   const char *tile_path_list[n_files + 1];
+   size_t offset;
+   bool made = mkdtemp( tile_dir ) != NULL;
+   assert( made );
+   for( i = 0; i <= n_files; i++ ) {
+      snprintf( tile_paths[i], sizeof( tile_paths[i] ), "%s/%d", tile_dir, i );
+      tile_path_list[i] = tile_paths[i];
+      if( i == n_files )
+         continue;
+      FILE *tile_file = fopen( tile_paths[i], "wb" );
+      assert( tile_file );
+      for( offset = 0; offset < TILE_FILE_SIZE( i ); offset++ )
+         fputc( TILE_FILE_BYTE( i, offset ), tile_file );
+      fclose( tile_file );
+   }
+   n_mismatch = 0;
+   for( t = 0; t < 2; t++ ) {
+      ap_TileReader *tile_reader = create_tile_reader( 8, 4, t == 0 );
+      if( t == 0 )
+         tile_uring = tile_reader->uring;
+      for( i = 0; i <= n_files; i++ )
+         tile_checks[i] = 0;
+      n_files_read = tile_reader_run( tile_reader, tile_path_list, n_files + 1, tile_checks, check_tile_file );
+      n_mismatch += n_files_read != n_files;
+      for( i = 0; i <= n_files; i++ )
+         n_mismatch += tile_checks[i] != ( i < n_files ? 1 : -1 );
+      free_tile_reader( tile_reader );
+   }
+   for( i = 0; i < n_files; i++ )
+      unlink( tile_paths[i] );
+   rmdir( tile_dir );
+   printf("done *)\n");
+   printf("tileUring = %d;\n", tile_uring);
+   printf("tileMismatches = %d;\n", n_mismatch);
+
+   // Make a test image whose left half is one flat color and
+   // whose right half is noise, and check the means and
+   // variances of random rectangles of it, and the descriptors
+   // of a grid of cells over it, against sums taken directly
+   // over the pixels
+   printf("(* performing integral image sums... ");
+   int image_width = 128, image_height = 96, rect_x, rect_y, rect_w, rect_h, row, col;
+   size_t image_stride = image_width * ATLAS_CHANNELS + 5;
+   uint8_t *test_image = malloc( image_height * image_stride ), direct_vec[DESCRIPTOR_SIZE];
+   assert( test_image );
+   double image_mean[ATLAS_CHANNELS], image_variance[ATLAS_CHANNELS], direct_mean, direct_variance;
+   uint64_t direct_sum;
+   for( y = 0; y < image_height; y++ )
+      for( x = 0; x < image_width; x++ )
+         for( c = 0; c < ATLAS_CHANNELS; c++ )
+            test_image[y * image_stride + x * ATLAS_CHANNELS + c] = x < image_width / 2 ? 64 * ( c + 1 ) : rand() % 256;
+   ap_IntegralImage *integral = create_integral_image( test_image, image_width, image_height, ATLAS_CHANNELS, image_stride, true );
+   n_mismatch = 0;
+   for( i = 0; i < 1000; i++ ) {
+      rect_w = 1 + rand() % image_width;
+      rect_h = 1 + rand() % image_height;
+      rect_x = rand() % ( image_width - rect_w + 1 );
+      rect_y = rand() % ( image_height - rect_h + 1 );
+      integral_mean( integral, rect_x, rect_y, rect_w, rect_h, image_mean );
+      integral_variance( integral, rect_x, rect_y, rect_w, rect_h, image_variance );
+      for( c = 0; c < ATLAS_CHANNELS; c++ ) {
+         direct_sum = 0;
+         for( y = rect_y; y < rect_y + rect_h; y++ )
+            for( x = rect_x; x < rect_x + rect_w; x++ )
+               direct_sum += test_image[y * image_stride + x * ATLAS_CHANNELS + c];
+         direct_mean = (double)direct_sum / ( rect_w * rect_h );
+         direct_variance = 0;
+         for( y = rect_y; y < rect_y + rect_h; y++ )
+            for( x = rect_x; x < rect_x + rect_w; x++ )
+               direct_variance += pow( test_image[y * image_stride + x * ATLAS_CHANNELS + c] - direct_mean, 2 ) / ( rect_w * rect_h );
+         n_mismatch += image_mean[c] != direct_mean;
+         n_mismatch += fabs( image_variance[c] - direct_variance ) > 1e-6 * ( 1 + direct_variance );
+      }
+   }
+   ap_DescriptorGrid *grid = create_descriptor_grid( integral, 12, 3, 5, DESCRIPTOR_SIDE );
+   for( i = 0; i < grid->n_rows * grid->n_cols; i++ ) {
+      for( row = 0; row < DESCRIPTOR_SIDE; row++ ) {
+         for( col = 0; col < DESCRIPTOR_SIDE; col++ ) {
+            rect_w = grid->cell_size / DESCRIPTOR_SIDE;
+            rect_x = grid->offset_x + i % grid->n_cols * grid->cell_size + col * rect_w;
+            rect_y = grid->offset_y + i / grid->n_cols * grid->cell_size + row * rect_w;
+            for( c = 0; c < ATLAS_CHANNELS; c++ ) {
+               direct_sum = 0;
+               for( y = rect_y; y < rect_y + rect_w; y++ )
+                  for( x = rect_x; x < rect_x + rect_w; x++ )
+                     direct_sum += test_image[y * image_stride + x * ATLAS_CHANNELS + c];
+               direct_vec[( row * DESCRIPTOR_SIDE + col ) * ATLAS_CHANNELS + c] = ( direct_sum + rect_w * rect_w / 2 ) / ( rect_w * rect_w );
+            }
+         }
+      }
+      for( j = 0; j < DESCRIPTOR_SIZE; j++ )
+         n_mismatch += ((uint8_t*)grid->points[i].vec)[j] != direct_vec[j];
+   }
+   printf("done *)\n");
+   printf("gridCells = {%d,%d};\n", grid->n_cols, grid->n_rows);
+   printf("integralMismatches = %d;\n", n_mismatch);
+   free_descriptor_grid( grid );
+
+   // Lay a quadtree of cells from the atlas's largest size
+   // down to 4 pixels over the test image, and check that the
+   // cells cover it once, that a cell was split exactly when
+   // its variance is above the threshold, and that compositing
+   // tiles from the atlas into the cells copies each tile's
+   // level of the cell's size into place
+   printf("(* performing quadtree layout... ");
+   int min_cell = 4, n_largest = 0, parent_size, n_drawn;
+   double threshold = 100;
+   uint8_t *coverage = calloc( image_width * image_height, 1 ), *mosaic = malloc( image_height * image_stride );
+   assert( coverage && mosaic );
+   ap_QuadtreeLayout *layout = create_quadtree_layout( integral, atlas_size, min_cell, threshold, DESCRIPTOR_SIDE );
+   int tile_ids[layout->n_cells];
+   n_mismatch = 0;
+   for( i = 0; i < layout->n_cells; i++ ) {
+      ap_QuadCell *quad_cell = &(layout->cells[i]);
+      for( y = quad_cell->y; y < quad_cell->y + quad_cell->size; y++ )
+         for( x = quad_cell->x; x < quad_cell->x + quad_cell->size; x++ )
+            coverage[y * image_width + x]++;
+      integral_variance( integral, quad_cell->x, quad_cell->y, quad_cell->size, quad_cell->size, image_variance );
+      if( quad_cell->size > min_cell )
+         n_mismatch += image_variance[0] + image_variance[1] + image_variance[2] > threshold;
+      if( quad_cell->size < atlas_size ) {
+         parent_size = 2 * quad_cell->size;
+         integral_variance( integral, quad_cell->x - quad_cell->x % parent_size, quad_cell->y - quad_cell->y % parent_size, parent_size, parent_size, image_variance );
+         n_mismatch += image_variance[0] + image_variance[1] + image_variance[2] <= threshold;
+      }
+      n_largest += quad_cell->size == atlas_size;
+      tile_ids[i] = 2 * ( i % ( n_atlas / 2 ) );
+   }
+   for( i = 0; i < image_width * image_height; i++ )
+      n_mismatch += coverage[i] != 1;
+   n_drawn = composite_quadtree_layout( layout, atlas, tile_ids, mosaic, image_stride );
+   n_mismatch += n_drawn != layout->n_cells;
+   for( i = 0; i < layout->n_cells; i++ ) {
+      ap_QuadCell *quad_cell = &(layout->cells[i]);
+      const uint8_t *src = atlas_tile( atlas, tile_ids[i], atlas_log2( quad_cell->size ) );
+      for( y = 0; y < quad_cell->size; y++ )
+         n_mismatch += memcmp( mosaic + ( quad_cell->y + y ) * image_stride + quad_cell->x * ATLAS_CHANNELS,
+                               src + y * quad_cell->size * ATLAS_CHANNELS, quad_cell->size * ATLAS_CHANNELS ) != 0;
+   }
+   printf("done *)\n");
+   printf("quadtreeCells = %d;\n", layout->n_cells);
+   printf("quadtreeLargest = %d;\n", n_largest);
+   printf("quadtreeDrawn = %d;\n", n_drawn);
+   printf("quadtreeMismatches = %d;\n", n_mismatch);
+   free_quadtree_layout( layout );
+   free( coverage );
+   free( mosaic );
+   free_integral_image( integral );
+   free( test_image );
+   free_atlas( atlas );
+
+   // Group the data points that lie within a small distance of
+   // one another, as near-duplicate tiles are, and check the
+   // number of pairs found against a naive count. This builds
+   // and frees a tree over the data, so it comes last.
+   printf("(* performing near-duplicate self-join... ");
+   double epsilon = VEC_DOMAIN * 0.05;
+   long n_pairs, n_naive_pairs = 0;
+   ap_PointList *groups = deduplicate_points( s, epsilon, bounded_radius, DIM, 2, NULL, &n_pairs, dist );
+   for( i = 0; i < n_data; i++ )
+      for( j = i + 1; j < n_data; j++ )
+         n_naive_pairs += dist( data[i], data[j] ) <= epsilon;
+   printf("done *)\n");
+   printf("epsilon = %f;\n", epsilon);
+   printf("dedupGroups = %d;\n", list_size( groups ));
+   printf("dedupPairs = %ld;\n", n_pairs);
+   printf("naiveDedupPairs = %ld;\n", n_naive_pairs);
+   free_list( groups );
+
    /*
-   // Check for sane heap behavior
-   ap_Heap *heap = create_heap( true, -1 );
+   // Check for sane priority queue behavior
+   ap_PointQueue *point_pq = create_point_queue( n_neighbor );
    for( i = 0; i < n_data; i++ )
-      heap_insert( heap, data[i], dist( query[0], data[i] ) );
-   printf("\n");
-   for( i = 0; i < heap->size; i++ )
-      printf("(* h id=%d\tdist=%f *)\n", ((ap_Point*)heap->items[i])->id, heap->dists[i]);
+      point_queue_insert( point_pq, data[i], dist( query[0], data[i] ) );
    printf("\n");
-   while( heap->size > n_neighbor ) {
-      printf("(* r id=%d\tdist=%f *)\n", ((ap_Point*)heap->items[0])->id, heap->dists[0]);
-      heap_pop( heap );
-   }
-   printf("\n");
-   for( i = 0; i < heap->size; i++ )
-      printf("(* h id=%d\tdist=%f *)\n", ((ap_Point*)heap->items[i])->id, heap->dists[i]);
+   for( i = 0; i < point_pq->size; i++ )
+      printf("(* q id=%d\tdist=%f *)\n", point_pq->items[i].p->id, point_pq->items[i].dist);
    printf("\n");
-   ap_PointList *v = heap_to_list( heap );
+   ap_PointList *v = point_queue_to_list( point_pq );
    while( v != NULL ) {
       printf("(* l id=%d\tdist=%f *)\n", v->p->id, v->dist);
       v = v->next;
    }
+   ap_TreeQueue *tree_pq = create_tree_queue();
+   for( i = 0; i < n_data; i++ )
+      tree_queue_insert( tree_pq, (ap_Tree*)data[i], dist( query[0], data[i] ) );
+   printf("\n");
+   while( tree_pq->size > 0 ) {
+      printf("(* t dist=%f *)\n", tree_pq->items[0].dist);
+      tree_queue_pop( tree_pq );
+   }
    */
 
 
@@ -252,7 +911,7 @@ main() {
    /*
    // Test for mem leaks in approx_1_median
    for( i = 0; i < 1e7; i++ )
-      approx_1_median( s, &median, DIM, dist );
+      approx_1_median( s, &median, DIM, NULL, dist );
    */
 
    /*
@@ -264,7 +923,7 @@ main() {
    /*
    // Test for mem leaks in approx_antipoles
    for( i = 0; i < 1e7; i++ )
-      approx_antipoles( s, &antipole_a, &antipole_b, DIM, dist );
+      approx_antipoles( s, &antipole_a, &antipole_b, DIM, NULL, dist );
    */
 
    /*
@@ -274,11 +933,11 @@ main() {
    */
 
    /*
-   // Test for mem leaks in build_tree, make_cluster,
-   // free_tree, and free_cluster
+   // Test for mem leaks in build_index, build_tree,
+   // make_cluster, free_index, free_tree, and free_cluster
    for( i = 0; i < 1e6; i++ ) {
-      free_tree( tree );
-      tree = build_tree( s, bounded_radius, NULL, NULL, DIM, dist );
+      free_index( search_index );
+      search_index = build_index( s, bounded_radius, INDEX_AUTO, DIM, dist );
    }
    */
 
@@ -305,26 +964,32 @@ main() {
    */
 
    /*
-   // Test for mem leaks in create_heap, heap_insert,
-   // heap_remove, and free_heap
-   ap_Heap *heap = NULL;
+   // Test for mem leaks in create_point_queue,
+   // point_queue_insert, free_point_queue, create_tree_queue,
+   // tree_queue_insert, tree_queue_pop, and free_tree_queue
+   ap_PointQueue *point_pq = NULL;
+   ap_TreeQueue *tree_pq = NULL;
    for( i = 0; i < 2e7; i++ ) {
-      free_heap( heap );
-      heap = create_heap( false, -1 );
-      for( j = 0; j < n_data; j++ )
-         heap_insert( heap, data[j], dist( query[0], data[j] ) );
-      while( heap->size > n_neighbor )
-         heap_pop( heap );
+      free_point_queue( point_pq );
+      free_tree_queue( tree_pq );
+      point_pq = create_point_queue( n_neighbor );
+      tree_pq = create_tree_queue();
+      for( j = 0; j < n_data; j++ ) {
+         point_queue_insert( point_pq, data[j], dist( query[0], data[j] ) );
+         tree_queue_insert( tree_pq, NULL, dist( query[0], data[j] ) );
+      }
+      while( tree_pq->size > 0 )
+         tree_queue_pop( tree_pq );
    }
    */
 
    /*
-   // Test for mem leaks in heap_to_list
-   ap_Heap *heap = create_heap( false, -1 );
+   // Test for mem leaks in point_queue_to_list
+   ap_PointQueue *point_pq = create_point_queue( n_data );
    for( i = 0; i < n_data; i++ )
-      heap_insert( heap, data[i], dist( query[0], data[i] ) );
+      point_queue_insert( point_pq, data[i], dist( query[0], data[i] ) );
    for( i = 0; i < 2e6; i++ ) {
-      free_list( heap_to_list( heap ) );
+      free_list( point_queue_to_list( point_pq ) );
    }
    */
 
@@ -332,9 +997,9 @@ main() {
    // Test for mem leaks in range_search
    for( i = 0; i < 1e6; i++ ) {
       for( j = 0; j < n_query; j++ ) {
-         free_list( results[j] );
-         results[j] = NULL;
-         range_search( tree, query[j], range, &results[j], dist );
+         free_neighbor_array( range_results[j] );
+         range_results[j] = create_neighbor_array();
+         index_range_search( search_index, query[j], range, range_results[j], dist );
       }
    }
    */
@@ -345,7 +1010,7 @@ main() {
       for( j = 0; j < n_query; j++ ) {
          free_list( results[j] );
          results[j] = NULL;
-         nearest_neighbor_search( tree, query[j], n_neighbor, &results[j], dist );
+         index_nearest_neighbor_search( search_index, query[j], n_neighbor, &results[j], dist );
       }
    }
    */
@@ -391,16 +1056,16 @@ main() {
    // Naive nearest neighbor search
    printf("(* performing naive nearest neighbor search... ");
    int k;
-   ap_Heap *point_pq = NULL;
+   ap_PointQueue *point_pq = NULL;
    for( i = 0; i < 1e6; i++ ) {
       for( j = 0; j < n_query; j++ ) {
          free_list( results[j] );
          results[j] = NULL;
-         free_heap( point_pq );
-         point_pq = create_heap( true, n_neighbor );;
+         free_point_queue( point_pq );
+         point_pq = create_point_queue( n_neighbor );
          for( k = 0; k < n_data; k++ )
-            nearest_neighbor_search_try_point( point_pq, data[k], dist( query[j], data[k] ) );
-         results[j] = heap_to_list( point_pq );
+            point_queue_insert( point_pq, data[k], dist( query[j], data[k] ) );
+         results[j] = point_queue_to_list( point_pq );
       }
    }
    printf("done *)\n");
@@ -424,6 +1089,13 @@ main() {
 #endif
    */
 
+   // Write the trace of this run if one was asked for
+   if( trace_path != NULL ) {
+      if( !write_trace( trace_path ) )
+         fprintf( stderr, "%s: cannot write trace to %s\n", "photomosaic", trace_path );
+      free_trace();
+   }
+
    printf("(* ----------------------- *)\n");
    return 0;
 }
@@ -0,0 +1,435 @@
+/* numa.c
+ *
+ * Copyright (c) 2011, Jeffrey P. Gill
+ *
+ * This file is part of photomosaic.
+ *
+ * photomosaic is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * photomosaic is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with photomosaic.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE          /* pthread_setaffinity_np, CPU_SET */
+
+#include <assert.h>  /* assert */
+#include <pthread.h> /* pthread_create, pthread_setaffinity_np */
+#include <sched.h>   /* cpu_set_t */
+#include <stdatomic.h> /* atomic_fetch_add */
+#include <stdio.h>   /* fopen, fgets, fprintf, snprintf */
+#include <stdlib.h>  /* NULL, exit, malloc, qsort, strtol */
+#include <string.h>  /* memcpy */
+#include <unistd.h>  /* sysconf */
+#include "numa.h"
+#include "trace.h"
+
+#define min(a,b) ((a) < (b) ? (a) : (b))
+#define max(a,b) ((a) > (b) ? (a) : (b))
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+                    TOPOLOGY FUNCTIONS
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+
+// Read the NUMA nodes and the cpus on each from sysfs. If
+// the topology cannot be read, a single node holding every
+// online cpu is returned.
+ap_NumaTopology*
+read_numa_topology( void ) {
+
+   int id, i, n_cpus;
+   char path[256], line[4096];
+   FILE *file;
+   int max_cpus = max( (int)sysconf( _SC_NPROCESSORS_CONF ), 1 );
+
+   ap_NumaTopology *topology = malloc( sizeof( ap_NumaTopology ) );
+   assert( topology );
+   topology->n_nodes = 0;
+   topology->nodes = malloc( NUMA_MAX_NODES * sizeof( ap_NumaNode ) );
+   assert( topology->nodes );
+
+   for( id = 0; id < NUMA_MAX_NODES; id++ ) {
+      snprintf( path, sizeof( path ), NUMA_SYSFS "/node%d/cpulist", id );
+      file = fopen( path, "r" );
+      if( file == NULL )
+         continue;
+      if( fgets( line, sizeof( line ), file ) != NULL ) {
+         int *cpus = malloc( max_cpus * sizeof( int ) );
+         assert( cpus );
+         n_cpus = parse_cpu_list( line, cpus, max_cpus );
+         if( n_cpus > 0 ) {
+            topology->nodes[topology->n_nodes].id = id;
+            topology->nodes[topology->n_nodes].n_cpus = n_cpus;
+            topology->nodes[topology->n_nodes].cpus = cpus;
+            topology->n_nodes++;
+         } else {
+            free( cpus );
+         }
+      }
+      fclose( file );
+   }
+
+   // Fall back on a single node
+   if( topology->n_nodes == 0 ) {
+      n_cpus = max( (int)sysconf( _SC_NPROCESSORS_ONLN ), 1 );
+      topology->nodes[0].id = 0;
+      topology->nodes[0].n_cpus = n_cpus;
+      topology->nodes[0].cpus = malloc( n_cpus * sizeof( int ) );
+      assert( topology->nodes[0].cpus );
+      for( i = 0; i < n_cpus; i++ )
+         topology->nodes[0].cpus[i] = i;
+      topology->n_nodes = 1;
+   }
+
+   return topology;
+}
+
+
+// Parse a kernel cpu list such as "0-7,16-23" into the
+// array cpus, storing at most max_cpus. Returns the number
+// of cpus stored.
+int
+parse_cpu_list( const char *list, int *cpus, int max_cpus ) {
+
+   int n = 0, first, last, cpu;
+   char *end;
+
+   while( *list != '\0' ) {
+      first = strtol( list, &end, 10 );
+      if( end == list )
+         break;
+      last = first;
+      list = end;
+      if( *list == '-' ) {
+         last = strtol( list + 1, &end, 10 );
+         list = end;
+      }
+      for( cpu = first; cpu <= last && n < max_cpus; cpu++ )
+         cpus[n++] = cpu;
+      if( *list != ',' )
+         break;
+      list++;
+   }
+
+   return n;
+}
+
+
+// Restrict the calling thread to the cpus of a NUMA node, so
+// that memory it touches first is allocated on that node.
+// Returns true if the thread was pinned, or false otherwise.
+bool
+pin_to_numa_node( ap_NumaNode *node ) {
+
+   int i;
+   cpu_set_t set;
+
+   CPU_ZERO( &set );
+   for( i = 0; i < node->n_cpus; i++ )
+      if( node->cpus[i] < CPU_SETSIZE )
+         CPU_SET( node->cpus[i], &set );
+
+   return pthread_setaffinity_np( pthread_self(), sizeof( cpu_set_t ), &set ) == 0;
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+                   REPLICATION FUNCTIONS
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+
+// Create a deep copy of a tree, including the points and
+// position vectors it refers to, in a new arena owned by the
+// copy's root. All of the copy's memory is written by the
+// calling thread, so under the kernel's default first-touch
+// policy it is placed on the calling thread's NUMA node. The
+// copied points have the same ids as the originals but no
+// ancestor lists. vec_size is the number of bytes in each
+// position vector.
+ap_Tree*
+replicate_tree( ap_Tree *tree, size_t vec_size ) {
+
+   int i, n_points = 0, n_unique;
+
+   // Collect every point in the tree and sort them by
+   // address, discarding duplicates, so that they can be
+   // numbered with find_point
+   collect_tree_points( tree, NULL, &n_points );
+   ap_Point **points = malloc( max( n_points, 1 ) * sizeof( ap_Point* ) );
+   assert( points );
+   n_points = 0;
+   collect_tree_points( tree, points, &n_points );
+   qsort( points, n_points, sizeof( ap_Point* ), compare_point_addresses );
+   for( i = n_unique = 0; i < n_points; i++ )
+      if( n_unique == 0 || points[i] != points[n_unique-1] )
+         points[n_unique++] = points[i];
+   n_points = n_unique;
+
+   // Copy the points and their position vectors
+   ap_Arena *arena = create_arena( ARENA_BLOCK_SIZE );
+   ap_Point *copies = arena_alloc( arena, n_points * sizeof( ap_Point ) );
+   for( i = 0; i < n_points; i++ ) {
+      copies[i].id = points[i]->id;
+      copies[i].vec = arena_alloc( arena, vec_size );
+      copies[i].ancestors = NULL;
+      memcpy( copies[i].vec, points[i]->vec, vec_size );
+   }
+
+   // Copy the tree
+   ap_Tree *replica = replicate_subtree( tree, arena, points, copies, n_points );
+   replica->arena = arena;
+
+   free( points );
+
+   return replica;
+}
+
+
+// Count the antipoles, centroids, and cluster members of the
+// tree. If points is not NULL, the points are also stored
+// there (possibly more than once).
+void
+collect_tree_points( ap_Tree *tree, ap_Point **points, int *n_points ) {
+
+   int i;
+
+   if( tree->is_leaf ) {
+      if( points != NULL ) {
+         points[*n_points] = tree->cluster->centroid;
+         for( i = 0; i < tree->cluster->size; i++ )
+            points[*n_points+1+i] = tree->cluster->members[i];
+      }
+      *n_points += 1 + tree->cluster->size;
+   } else {
+      if( points != NULL ) {
+         points[*n_points] = tree->a;
+         points[*n_points+1] = tree->b;
+      }
+      *n_points += 2;
+      collect_tree_points( tree->left, points, n_points );
+      collect_tree_points( tree->right, points, n_points );
+   }
+}
+
+
+// Recursively copy a subtree into arena, replacing each
+// point with its copy, found by looking the point up in the
+// sorted array points.
+ap_Tree*
+replicate_subtree( ap_Tree *tree, ap_Arena *arena, ap_Point **points, ap_Point *copies, int n_points ) {
+
+   int i;
+
+   ap_Tree *new_tree = arena_alloc( arena, sizeof( ap_Tree ) );
+   *new_tree = *tree;
+   new_tree->arena = NULL;
+
+   if( tree->is_leaf ) {
+      ap_Cluster *cluster = arena_alloc( arena, sizeof( ap_Cluster ) );
+      *cluster = *tree->cluster;
+      cluster->centroid = &copies[find_point( points, n_points, tree->cluster->centroid )];
+      cluster->members = arena_alloc( arena, cluster->size * sizeof( ap_Point* ) );
+      cluster->dists = arena_alloc( arena, cluster->size * sizeof( double ) );
+      for( i = 0; i < cluster->size; i++ ) {
+         cluster->members[i] = &copies[find_point( points, n_points, tree->cluster->members[i] )];
+         cluster->dists[i] = tree->cluster->dists[i];
+      }
+      new_tree->cluster = cluster;
+   } else {
+      new_tree->a = &copies[find_point( points, n_points, tree->a )];
+      new_tree->b = &copies[find_point( points, n_points, tree->b )];
+      new_tree->left = replicate_subtree( tree->left, arena, points, copies, n_points );
+      new_tree->right = replicate_subtree( tree->right, arena, points, copies, n_points );
+   }
+
+   return new_tree;
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+                PARALLEL SEARCH FUNCTIONS
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+
+// Create an ap_ParallelIndex for searching a frozen tree
+// from threads spread across the NUMA nodes. If replicate is
+// true, a thread pinned to each node makes that node's own
+// copy of the tree (see replicate_tree); otherwise every
+// node shares the original. The tree must not be modified or
+// freed while the index is in use.
+ap_ParallelIndex*
+create_parallel_index( ap_Tree *tree, size_t vec_size, bool replicate ) {
+
+   int i;
+
+   ap_ParallelIndex *pindex = malloc( sizeof( ap_ParallelIndex ) );
+   assert( pindex );
+   pindex->topology = read_numa_topology();
+   pindex->tree = tree;
+   pindex->trees = malloc( pindex->topology->n_nodes * sizeof( ap_Tree* ) );
+   assert( pindex->trees );
+   pindex->replicated = replicate;
+
+   if( !replicate ) {
+      for( i = 0; i < pindex->topology->n_nodes; i++ )
+         pindex->trees[i] = tree;
+      return pindex;
+   }
+
+   // Make the replicas concurrently, one thread per node
+   pthread_t *threads = malloc( pindex->topology->n_nodes * sizeof( pthread_t ) );
+   ap_ParallelWorker *workers = calloc( pindex->topology->n_nodes, sizeof( ap_ParallelWorker ) );
+   assert( threads && workers );
+   for( i = 0; i < pindex->topology->n_nodes; i++ ) {
+      workers[i].pindex = pindex;
+      workers[i].node = i;
+      workers[i].vec_size = vec_size;
+      if( pthread_create( &threads[i], NULL, replicate_worker, &workers[i] ) != 0 ) {
+         fprintf( stderr, "create_parallel_index: failed to create thread\n" );
+         exit( EXIT_FAILURE );
+      }
+   }
+   for( i = 0; i < pindex->topology->n_nodes; i++ )
+      pthread_join( threads[i], NULL );
+
+   free( threads );
+   free( workers );
+
+   return pindex;
+}
+
+
+// Thread entry point that pins itself to a node and makes
+// the node's replica of the tree.
+void*
+replicate_worker( void *arg ) {
+
+   ap_ParallelWorker *worker = arg;
+   ap_ParallelIndex *pindex = worker->pindex;
+
+   pin_to_numa_node( &(pindex->topology->nodes[worker->node]) );
+   double start = trace_begin();
+   pindex->trees[worker->node] = replicate_tree( pindex->tree, worker->vec_size );
+   trace_end( "build", "replicate_tree", start );
+
+   return NULL;
+}
+
+
+// Search the index for the k points nearest each of n_query
+// queries from n_threads threads and place the results in
+// out[0..n_query-1]. Threads are assigned to the NUMA nodes
+// in turn, pinned there, and search that node's tree; they
+// claim the queries in chunks so that faster threads take
+// more. If node_queries is not NULL, the number of queries
+// searched on each node is stored there. If the index is
+// replicated, the points in out belong to the replicas.
+void
+parallel_nearest_neighbor_search_batch( ap_ParallelIndex *pindex, ap_Point **queries, int n_query, int k, ap_PointList **out, int n_threads, int *node_queries, DIST_FUNC ) {
+
+   int i;
+   atomic_int next = 0;
+
+   n_threads = max( n_threads, 1 );
+   pthread_t *threads = malloc( n_threads * sizeof( pthread_t ) );
+   ap_ParallelWorker *workers = calloc( n_threads, sizeof( ap_ParallelWorker ) );
+   assert( threads && workers );
+
+   for( i = 0; i < n_threads; i++ ) {
+      workers[i].pindex = pindex;
+      workers[i].node = i % pindex->topology->n_nodes;
+      workers[i].queries = queries;
+      workers[i].n_query = n_query;
+      workers[i].k = k;
+      workers[i].out = out;
+      workers[i].next = &next;
+      workers[i].done = 0;
+      workers[i].dist = dist;
+      if( pthread_create( &threads[i], NULL, search_worker, &workers[i] ) != 0 ) {
+         fprintf( stderr, "parallel_nearest_neighbor_search_batch: failed to create thread\n" );
+         exit( EXIT_FAILURE );
+      }
+   }
+   for( i = 0; i < n_threads; i++ )
+      pthread_join( threads[i], NULL );
+
+   if( node_queries != NULL ) {
+      for( i = 0; i < pindex->topology->n_nodes; i++ )
+         node_queries[i] = 0;
+      for( i = 0; i < n_threads; i++ )
+         node_queries[workers[i].node] += workers[i].done;
+   }
+
+   free( threads );
+   free( workers );
+}
+
+
+// Thread entry point that pins itself to a node and searches
+// chunks of queries against the node's tree until none are
+// left.
+void*
+search_worker( void *arg ) {
+
+   int start, count;
+   ap_ParallelWorker *worker = arg;
+   ap_ParallelIndex *pindex = worker->pindex;
+   ap_Tree *tree = pindex->trees[worker->node];
+
+   pin_to_numa_node( &(pindex->topology->nodes[worker->node]) );
+
+   double worker_start = trace_begin();
+   while( ( start = atomic_fetch_add( worker->next, PARALLEL_CHUNK_SIZE ) ) < worker->n_query ) {
+      count = min( PARALLEL_CHUNK_SIZE, worker->n_query - start );
+      nearest_neighbor_search_batch( tree, worker->queries + start, count, worker->k, worker->out + start, worker->dist );
+      worker->done += count;
+   }
+   trace_end( "search", "search_worker", worker_start );
+
+   return NULL;
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+               MEMORY MANAGEMENT FUNCTIONS
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+
+// Free up memory used by an ap_NumaTopology.
+void
+free_numa_topology( ap_NumaTopology *topology ) {
+
+   int i;
+   if( topology != NULL ) {
+      for( i = 0; i < topology->n_nodes; i++ )
+         free( topology->nodes[i].cpus );
+      free( topology->nodes );
+      free( topology );
+   }
+}
+
+
+// Free up memory used by an ap_ParallelIndex, including any
+// replicas, but not the original tree.
+void
+free_parallel_index( ap_ParallelIndex *pindex ) {
+
+   int i;
+   if( pindex != NULL ) {
+      if( pindex->replicated )
+         for( i = 0; i < pindex->topology->n_nodes; i++ )
+            free_tree( pindex->trees[i] );
+      free( pindex->trees );
+      free_numa_topology( pindex->topology );
+      free( pindex );
+   }
+}
@@ -0,0 +1,85 @@
+/* numa.h
+ *
+ * Copyright (c) 2011, Jeffrey P. Gill
+ *
+ * This file is part of photomosaic.
+ *
+ * photomosaic is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * photomosaic is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with photomosaic.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef NUMA_H
+#define NUMA_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "antipole.h"
+
+#define NUMA_SYSFS "/sys/devices/system/node"  /* where the kernel describes the NUMA topology */
+#define NUMA_MAX_NODES 64        /* largest number of NUMA nodes recognized */
+#define PARALLEL_CHUNK_SIZE 64   /* number of queries a worker thread claims at a time */
+
+typedef struct ap_NumaNode ap_NumaNode;
+typedef struct ap_NumaTopology ap_NumaTopology;
+typedef struct ap_ParallelIndex ap_ParallelIndex;
+typedef struct ap_ParallelWorker ap_ParallelWorker;
+
+struct ap_NumaNode {
+   int id;                    /* kernel node number */
+   int n_cpus;                /* number of online cpus on the node */
+   int *cpus;                 /* array of online cpu numbers on the node */
+};
+
+struct ap_NumaTopology {
+   int n_nodes;               /* number of nodes with online cpus */
+   ap_NumaNode *nodes;        /* array of nodes */
+};
+
+struct ap_ParallelIndex {
+   ap_NumaTopology *topology; /* nodes that worker threads are spread across */
+   ap_Tree *tree;             /* the original tree */
+   ap_Tree **trees;           /* tree searched by threads on each node, either a local replica or the original */
+   bool replicated;           /* whether each node has its own replica */
+};
+
+struct ap_ParallelWorker {
+   ap_ParallelIndex *pindex;  /* index being searched */
+   int node;                  /* index of the node the thread is pinned to */
+   ap_Point **queries;        /* array of all queries */
+   int n_query;               /* number of queries */
+   int k;                     /* number of neighbors to find */
+   ap_PointList **out;        /* array of results for all queries */
+   atomic_int *next;          /* shared index of the next unclaimed query */
+   int done;                  /* number of queries searched by the thread */
+   double (*dist)( ap_Point *p1, ap_Point *p2 );  /* distance function */
+   size_t vec_size;           /* if replicating, number of bytes in each position vector */
+};
+
+ap_NumaTopology* read_numa_topology( void );
+int parse_cpu_list( const char *list, int *cpus, int max_cpus );
+bool pin_to_numa_node( ap_NumaNode *node );
+
+ap_Tree* replicate_tree( ap_Tree *tree, size_t vec_size );
+void collect_tree_points( ap_Tree *tree, ap_Point **points, int *n_points );
+ap_Tree* replicate_subtree( ap_Tree *tree, ap_Arena *arena, ap_Point **points, ap_Point *copies, int n_points );
+
+ap_ParallelIndex* create_parallel_index( ap_Tree *tree, size_t vec_size, bool replicate );
+void* replicate_worker( void *arg );
+void parallel_nearest_neighbor_search_batch( ap_ParallelIndex *pindex, ap_Point **queries, int n_query, int k, ap_PointList **out, int n_threads, int *node_queries, DIST_FUNC );
+void* search_worker( void *arg );
+
+void free_numa_topology( ap_NumaTopology *topology );
+void free_parallel_index( ap_ParallelIndex *pindex );
+
+#endif
@@ -0,0 +1,351 @@
+/* pca.c
+ *
+ * Copyright (c) 2011, Jeffrey P. Gill
+ *
+ * This file is part of photomosaic.
+ *
+ * photomosaic is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * photomosaic is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with photomosaic.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>  /* assert */
+#include <math.h>    /* fabs, sqrt, INFINITY */
+#include <stdlib.h>  /* NULL, malloc, calloc */
+#include "pca.h"
+
+#define min(a,b) ((a) < (b) ? (a) : (b))
+#define max(a,b) ((a) > (b) ? (a) : (b))
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+                   PROJECTION FUNCTIONS
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+
+// Fit a principal component projection to a set of points
+// whose position vectors are arrays of dimensionality
+// doubles, keeping the given number of components. The
+// covariance is estimated from at most PCA_SAMPLE points
+// spread evenly through the set. The projection is a
+// rotation onto the kept axes and is not whitened, so the
+// Euclidean distance between two projected vectors never
+// exceeds the distance between the full vectors.
+ap_Pca*
+fit_pca( ap_PointList *set, int dimensionality, int components ) {
+
+   int i, j, l, n_sample, best;
+   double *vec, total;
+   ap_PointList *index;
+
+   int d = dimensionality;
+   int step = max( list_size( set ) / PCA_SAMPLE, 1 );
+
+   ap_Pca *new_pca = malloc( sizeof( ap_Pca ) );
+   assert( new_pca );
+   new_pca->dimensionality = d;
+   new_pca->components = components = max( 1, min( components, d ) );
+   new_pca->mean = calloc( d, sizeof( double ) );
+   new_pca->basis = malloc( components * d * sizeof( double ) );
+   new_pca->variance = malloc( components * sizeof( double ) );
+   double *cov = calloc( d * d, sizeof( double ) );
+   double *values = malloc( d * sizeof( double ) );
+   double *vectors = malloc( d * d * sizeof( double ) );
+   double *centered = malloc( d * sizeof( double ) );
+   bool *taken = calloc( d, sizeof( bool ) );
+   assert( new_pca->mean && new_pca->basis && new_pca->variance && cov && values && vectors && centered && taken );
+
+   // Find the mean of the sample
+   n_sample = 0;
+   for( index = set, i = 0; index != NULL && n_sample < PCA_SAMPLE; index = index->next, i++ ) {
+      if( i % step != 0 )
+         continue;
+      vec = index->p->vec;
+      for( j = 0; j < d; j++ )
+         new_pca->mean[j] += vec[j];
+      n_sample++;
+   }
+   for( j = 0; j < d; j++ )
+      new_pca->mean[j] /= max( n_sample, 1 );
+
+   // Accumulate the upper triangle of the covariance matrix of
+   // the sample, then mirror it
+   n_sample = 0;
+   for( index = set, i = 0; index != NULL && n_sample < PCA_SAMPLE; index = index->next, i++ ) {
+      if( i % step != 0 )
+         continue;
+      vec = index->p->vec;
+      for( j = 0; j < d; j++ )
+         centered[j] = vec[j] - new_pca->mean[j];
+      for( j = 0; j < d; j++ )
+         for( l = j; l < d; l++ )
+            cov[j * d + l] += centered[j] * centered[l];
+      n_sample++;
+   }
+   for( j = 0; j < d; j++ ) {
+      for( l = j; l < d; l++ ) {
+         cov[j * d + l] /= max( n_sample, 1 );
+         cov[l * d + j] = cov[j * d + l];
+      }
+   }
+
+   // Keep the eigenvectors of the covariance matrix with the
+   // largest eigenvalues as the principal axes, choosing them
+   // by selection since only a few are usually kept
+   pca_eigen( cov, d, values, vectors );
+   for( total = 0, j = 0; j < d; j++ )
+      total += values[j];
+   new_pca->retained = 0;
+   for( i = 0; i < components; i++ ) {
+      for( best = -1, j = 0; j < d; j++ )
+         if( !taken[j] && ( best < 0 || values[j] > values[best] ) )
+            best = j;
+      taken[best] = true;
+      new_pca->variance[i] = max( values[best], 0 );
+      new_pca->retained += new_pca->variance[i];
+      for( j = 0; j < d; j++ )
+         new_pca->basis[i * d + j] = vectors[j * d + best];
+   }
+   new_pca->retained = total > 0 ? new_pca->retained / total : 1;
+
+   free( cov );
+   free( values );
+   free( vectors );
+   free( centered );
+   free( taken );
+
+   return new_pca;
+}
+
+
+// Project a vector of the pca's full dimensionality onto its
+// principal axes and store the components in out.
+void
+pca_project( ap_Pca *pca, const double *vec, double *out ) {
+
+   int i, j;
+   double sum;
+   const double *axis;
+
+   for( i = 0; i < pca->components; i++ ) {
+      axis = pca->basis + i * pca->dimensionality;
+      for( sum = 0, j = 0; j < pca->dimensionality; j++ )
+         sum += axis[j] * ( vec[j] - pca->mean[j] );
+      out[i] = sum;
+   }
+}
+
+
+// Find the eigenvalues and eigenvectors of the symmetric
+// n x n matrix a by cyclic Jacobi rotations, storing the
+// eigenvalues in values and the eigenvectors in the columns
+// of vectors. The matrix is overwritten. Each rotation zeroes
+// one off-diagonal element, and sweeps continue until the
+// off-diagonal elements are negligible next to the diagonal.
+void
+pca_eigen( double *a, int n, double *values, double *vectors ) {
+
+   int i, p, q, sweep;
+   double off, diagonal, theta, t, c, s, x, y;
+
+   for( i = 0; i < n * n; i++ )
+      vectors[i] = 0;
+   for( i = 0; i < n; i++ )
+      vectors[i * n + i] = 1;
+
+   for( sweep = 0; sweep < PCA_MAX_SWEEPS; sweep++ ) {
+      off = diagonal = 0;
+      for( p = 0; p < n; p++ ) {
+         diagonal += a[p * n + p] * a[p * n + p];
+         for( q = p + 1; q < n; q++ )
+            off += a[p * n + q] * a[p * n + q];
+      }
+      if( off <= 1e-24 * diagonal || off == 0 )
+         break;
+
+      for( p = 0; p < n; p++ ) {
+         for( q = p + 1; q < n; q++ ) {
+            if( a[p * n + q] == 0 )
+               continue;
+
+            // Choose the smaller rotation angle that zeroes a[p][q]
+            theta = ( a[q * n + q] - a[p * n + p] ) / ( 2 * a[p * n + q] );
+            t = ( theta >= 0 ? 1 : -1 ) / ( fabs( theta ) + sqrt( theta * theta + 1 ) );
+            c = 1 / sqrt( t * t + 1 );
+            s = t * c;
+
+            // Rotate columns p and q, then rows p and q, of a, and
+            // accumulate the rotation into vectors
+            for( i = 0; i < n; i++ ) {
+               x = a[i * n + p];
+               y = a[i * n + q];
+               a[i * n + p] = c * x - s * y;
+               a[i * n + q] = s * x + c * y;
+            }
+            for( i = 0; i < n; i++ ) {
+               x = a[p * n + i];
+               y = a[q * n + i];
+               a[p * n + i] = c * x - s * y;
+               a[q * n + i] = s * x + c * y;
+            }
+            for( i = 0; i < n; i++ ) {
+               x = vectors[i * n + p];
+               y = vectors[i * n + q];
+               vectors[i * n + p] = c * x - s * y;
+               vectors[i * n + q] = s * x + c * y;
+            }
+         }
+      }
+   }
+
+   for( i = 0; i < n; i++ )
+      values[i] = a[i * n + i];
+}
+
+
+// Calculate the Euclidean distance between two projected
+// points. A projected vector leads with its number of
+// components, followed by the components themselves, so
+// indexes with different numbers of components can be built
+// and searched at once.
+double
+pca_dist( ap_Point *p1, ap_Point *p2 ) {
+
+   int i;
+   double d, sum = 0;
+   const double *v1 = p1->vec, *v2 = p2->vec;
+   int components = (int)v1[0];
+
+   for( i = 1; i <= components; i++ ) {
+      d = v1[i] - v2[i];
+      sum += d * d;
+   }
+
+   return sqrt( sum );
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+                     INDEX FUNCTIONS
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+
+// Fit a projection to a set of points whose position vectors
+// are arrays of dimensionality doubles, and build an ap_Index
+// of the given type over the points projected to the given
+// number of components. target_radius is measured in the
+// projected space.
+ap_PcaIndex*
+build_pca_index( ap_PointList *set, int dimensionality, int components, double target_radius, ap_IndexType type ) {
+
+   int i;
+   ap_PointList *projected_set = NULL;
+
+   ap_PcaIndex *new_pindex = malloc( sizeof( ap_PcaIndex ) );
+   assert( new_pindex );
+   new_pindex->pca = fit_pca( set, dimensionality, components );
+   components = new_pindex->pca->components;
+   new_pindex->size = list_size( set );
+   new_pindex->points = malloc( max( new_pindex->size, 1 ) * sizeof( ap_Point* ) );
+   new_pindex->projected = malloc( max( new_pindex->size, 1 ) * sizeof( ap_Point ) );
+   new_pindex->vecs = malloc( max( new_pindex->size, 1 ) * ( components + 1 ) * sizeof( double ) );
+   assert( new_pindex->points && new_pindex->projected && new_pindex->vecs );
+
+   // Project every point, building the list in the order of
+   // the set
+   for( i = 0; set != NULL; i++, set = set->next ) {
+      new_pindex->points[i] = set->p;
+      new_pindex->projected[i].id = set->p->id;
+      new_pindex->projected[i].vec = new_pindex->vecs + i * ( components + 1 );
+      new_pindex->projected[i].ancestors = NULL;
+      new_pindex->vecs[i * ( components + 1 )] = components;
+      pca_project( new_pindex->pca, set->p->vec, new_pindex->vecs + i * ( components + 1 ) + 1 );
+   }
+   for( i = new_pindex->size - 1; i >= 0; i-- )
+      prepend_point( &projected_set, &(new_pindex->projected[i]), 0, NULL );
+
+   new_pindex->index = build_index( projected_set, target_radius, type, components, pca_dist );
+   free_list( projected_set );
+
+   return new_pindex;
+}
+
+
+// Find the k points nearest the query, by dist between the
+// full vectors, and place them in out sorted by distance.
+// The search is a single best-first pass over the projected
+// index: projected points are pulled from a neighbor
+// iterator in order of projected distance, and the original
+// point behind each is ranked by its full distance. Since
+// projected distances never exceed full distances, once the
+// next projected distance reaches the kth full distance
+// found so far, no point yet to be pulled can be nearer, and
+// the search stops. dist must be the Euclidean distance
+// between the full vectors for the results to be exact.
+void
+pca_nearest_neighbor_search( ap_PcaIndex *pindex, ap_Point *query, int k, ap_PointList **out, DIST_FUNC ) {
+
+   double projected_dist;
+   ap_Point *p;
+
+   double *vec = malloc( ( pindex->pca->components + 1 ) * sizeof( double ) );
+   assert( vec );
+   vec[0] = pindex->pca->components;
+   pca_project( pindex->pca, query->vec, vec + 1 );
+   ap_Point projected_query = { query->id, vec, NULL };
+
+   // Filter by projected distance and refine by full distance,
+   // allowing PCA_TOLERANCE for rounding in the projection
+   ap_PointQueue *point_pq = create_point_queue( k );
+   ap_NeighborIterator *iter = create_index_neighbor_iterator( pindex->index, &projected_query );
+   while( ( p = neighbor_iterator_next( iter, &projected_dist, pca_dist ) ) != NULL ) {
+      if( projected_dist > point_pq->bound * ( 1 + PCA_TOLERANCE ) )
+         break;
+      p = pindex->points[p - pindex->projected];
+      point_queue_insert( point_pq, p, dist( p, query ) );
+   }
+
+   *out = point_queue_to_list( point_pq );
+   free_neighbor_iterator( iter );
+   free_point_queue( point_pq );
+   free( vec );
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+               MEMORY MANAGEMENT FUNCTIONS
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+
+// Free up memory used by an ap_Pca.
+void
+free_pca( ap_Pca *pca ) {
+
+   free( pca->mean );
+   free( pca->basis );
+   free( pca->variance );
+   free( pca );
+}
+
+
+// Free up memory used by an ap_PcaIndex, but not the
+// original points.
+void
+free_pca_index( ap_PcaIndex *pindex ) {
+
+   free_index( pindex->index );
+   free_pca( pindex->pca );
+   free( pindex->points );
+   free( pindex->projected );
+   free( pindex->vecs );
+   free( pindex );
+}
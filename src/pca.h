@@ -0,0 +1,62 @@
+/* pca.h
+ *
+ * Copyright (c) 2011, Jeffrey P. Gill
+ *
+ * This file is part of photomosaic.
+ *
+ * photomosaic is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * photomosaic is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with photomosaic.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PCA_H
+#define PCA_H
+
+#include "antipole.h"
+
+#define PCA_SAMPLE 20000         /* largest number of points the covariance is estimated from */
+#define PCA_MAX_SWEEPS 64        /* largest number of Jacobi sweeps over the covariance matrix */
+#define PCA_TOLERANCE 1e-9       /* relative slack on projected bounds to absorb rounding in the projection */
+
+typedef struct ap_Pca ap_Pca;
+typedef struct ap_PcaIndex ap_PcaIndex;
+
+struct ap_Pca {
+   int dimensionality;        /* number of dimensions of the full vectors */
+   int components;            /* number of dimensions of the projected vectors */
+   double *mean;              /* mean of the fitted vectors */
+   double *basis;             /* components x dimensionality array whose orthonormal rows are the principal axes, by decreasing variance */
+   double *variance;          /* variance of the fitted vectors along each principal axis */
+   double retained;           /* fraction of the total variance along the kept axes */
+};
+
+struct ap_PcaIndex {
+   ap_Pca *pca;               /* projection fitted to the points */
+   int size;                  /* number of points in index */
+   ap_Point **points;         /* array of the original points */
+   ap_Point *projected;       /* array of projected points, where projected[i] stands for points[i] */
+   double *vecs;              /* position vectors of the projected points, each its number of components followed by the components */
+   ap_Index *index;           /* index over the projected points */
+};
+
+ap_Pca* fit_pca( ap_PointList *set, int dimensionality, int components );
+void pca_project( ap_Pca *pca, const double *vec, double *out );
+void pca_eigen( double *a, int n, double *values, double *vectors );
+double pca_dist( ap_Point *p1, ap_Point *p2 );
+
+ap_PcaIndex* build_pca_index( ap_PointList *set, int dimensionality, int components, double target_radius, ap_IndexType type );
+void pca_nearest_neighbor_search( ap_PcaIndex *pindex, ap_Point *query, int k, ap_PointList **out, DIST_FUNC );
+
+void free_pca( ap_Pca *pca );
+void free_pca_index( ap_PcaIndex *pindex );
+
+#endif
@@ -0,0 +1,200 @@
+/* perf.c
+ *
+ * Copyright (c) 2011, Jeffrey P. Gill
+ *
+ * This file is part of photomosaic.
+ *
+ * photomosaic is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * photomosaic is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with photomosaic.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>  /* assert */
+#include <linux/perf_event.h> /* perf_event_attr, PERF_* */
+#include <stdint.h>  /* uint64_t */
+#include <stdlib.h>  /* NULL, malloc */
+#include <string.h>  /* memset */
+#include <sys/ioctl.h> /* ioctl */
+#include <sys/syscall.h> /* __NR_perf_event_open */
+#include <unistd.h>  /* syscall, read, close */
+#include "perf.h"
+
+#define PERF_CACHE_READ_MISSES(cache) ( (cache) | ( PERF_COUNT_HW_CACHE_OP_READ << 8 ) | ( PERF_COUNT_HW_CACHE_RESULT_MISS << 16 ) )
+
+const char *perf_counter_names[PERF_COUNTERS] = {  /* name of each counter when printed */
+   "cycles", "instructions", "L1d misses", "LLC misses", "branch misses", "dTLB misses", "task clock ns"
+};
+const uint32_t perf_counter_types[PERF_COUNTERS] = {  /* kernel event type of each counter */
+   PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE, PERF_TYPE_HW_CACHE,
+   PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE, PERF_TYPE_SOFTWARE
+};
+const uint64_t perf_counter_configs[PERF_COUNTERS] = {  /* kernel event config of each counter */
+   PERF_COUNT_HW_CPU_CYCLES,
+   PERF_COUNT_HW_INSTRUCTIONS,
+   PERF_CACHE_READ_MISSES( PERF_COUNT_HW_CACHE_L1D ),
+   PERF_CACHE_READ_MISSES( PERF_COUNT_HW_CACHE_LL ),
+   PERF_COUNT_HW_BRANCH_MISSES,
+   PERF_CACHE_READ_MISSES( PERF_COUNT_HW_CACHE_DTLB ),
+   PERF_COUNT_SW_TASK_CLOCK
+};
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+                    COUNTER FUNCTIONS
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+
+// Open a set of counters on the calling process, counting
+// in user space only so that an unprivileged process may
+// use them. Threads created after this call are counted as
+// well, though a thread's counts are only included once it
+// has exited. Counters the kernel or machine does not
+// support (as in most virtual machines) are left
+// unavailable rather than treated as an error.
+ap_PerfCounters*
+create_perf_counters( void ) {
+
+   int i;
+   struct perf_event_attr attr;
+
+   ap_PerfCounters *new_counters = malloc( sizeof( ap_PerfCounters ) );
+   assert( new_counters );
+   new_counters->n_available = 0;
+   new_counters->n_hardware = 0;
+
+   for( i = 0; i < PERF_COUNTERS; i++ ) {
+      memset( &attr, 0, sizeof( attr ) );
+      attr.size = sizeof( attr );
+      attr.type = perf_counter_types[i];
+      attr.config = perf_counter_configs[i];
+      attr.disabled = 1;
+      attr.inherit = 1;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+      new_counters->fds[i] = syscall( __NR_perf_event_open, &attr, 0, -1, -1, 0 );
+      new_counters->values[i] = 0;
+      if( new_counters->fds[i] >= 0 ) {
+         new_counters->n_available++;
+         if( perf_counter_types[i] != PERF_TYPE_SOFTWARE )
+            new_counters->n_hardware++;
+      }
+   }
+
+   return new_counters;
+}
+
+
+// Note the current counts and start counting. The counters
+// are not reset, since a reset does not clear the counts
+// inherited from threads that have exited; perf_stop takes
+// the difference instead.
+void
+perf_start( ap_PerfCounters *counters ) {
+
+   int i;
+
+   for( i = 0; i < PERF_COUNTERS; i++ )
+      if( counters->fds[i] >= 0 && perf_read( counters, i, counters->start[i] ) )
+         ioctl( counters->fds[i], PERF_EVENT_IOC_ENABLE, 0 );
+}
+
+
+// Stop counting and store the counts since perf_start in
+// values. When more counters are open than the machine has
+// registers for, the kernel multiplexes them, and each count
+// is scaled up by the fraction of the time it was running.
+// A counter that cannot be read becomes unavailable.
+void
+perf_stop( ap_PerfCounters *counters ) {
+
+   int i;
+   uint64_t buffer[3];
+   double count, enabled, running;
+
+   for( i = 0; i < PERF_COUNTERS; i++ )
+      if( counters->fds[i] >= 0 )
+         ioctl( counters->fds[i], PERF_EVENT_IOC_DISABLE, 0 );
+
+   for( i = 0; i < PERF_COUNTERS; i++ ) {
+      counters->values[i] = 0;
+      if( counters->fds[i] < 0 || !perf_read( counters, i, buffer ) )
+         continue;
+      count = buffer[0] - counters->start[i][0];
+      enabled = buffer[1] - counters->start[i][1];
+      running = buffer[2] - counters->start[i][2];
+      counters->values[i] = running > 0 ? count * enabled / running : 0;
+   }
+}
+
+
+// Read the count, time enabled and time running of one
+// counter into buffer. If the counter cannot be read, it is
+// closed and becomes unavailable, and false is returned.
+bool
+perf_read( ap_PerfCounters *counters, int counter, uint64_t *buffer ) {
+
+   if( read( counters->fds[counter], buffer, 3 * sizeof( uint64_t ) ) == 3 * sizeof( uint64_t ) )
+      return true;
+
+   close( counters->fds[counter] );
+   counters->fds[counter] = -1;
+   counters->n_available--;
+   if( perf_counter_types[counter] != PERF_TYPE_SOFTWARE )
+      counters->n_hardware--;
+   return false;
+}
+
+
+// Print the counts of the last perf_stop divided by n_units,
+// naming the unit (such as "query" or "node") they are per.
+// Unavailable counters are left out, and instructions per
+// cycle are added when both are available.
+void
+print_perf_counters( ap_PerfCounters *counters, const char *unit, double n_units, FILE *stream ) {
+
+   int i;
+   const char *separator = ":";
+
+   if( counters->n_available == 0 || n_units <= 0 )
+      return;
+
+   fprintf( stream, "(*    per %s", unit );
+   for( i = 0; i < PERF_COUNTERS; i++ ) {
+      if( counters->fds[i] >= 0 ) {
+         fprintf( stream, "%s %.1f %s", separator, counters->values[i] / n_units, perf_counter_names[i] );
+         separator = ",";
+      }
+   }
+   if( counters->fds[PERF_CYCLES] >= 0 && counters->fds[PERF_INSTRUCTIONS] >= 0 && counters->values[PERF_CYCLES] > 0 )
+      fprintf( stream, ", %.2f IPC", counters->values[PERF_INSTRUCTIONS] / counters->values[PERF_CYCLES] );
+   fprintf( stream, " *)\n" );
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+               MEMORY MANAGEMENT FUNCTIONS
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+
+// Close the counters and free up memory used by an
+// ap_PerfCounters.
+void
+free_perf_counters( ap_PerfCounters *counters ) {
+
+   int i;
+
+   for( i = 0; i < PERF_COUNTERS; i++ )
+      if( counters->fds[i] >= 0 )
+         close( counters->fds[i] );
+   free( counters );
+}
@@ -0,0 +1,59 @@
+/* perf.h
+ *
+ * Copyright (c) 2011, Jeffrey P. Gill
+ *
+ * This file is part of photomosaic.
+ *
+ * photomosaic is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * photomosaic is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with photomosaic.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PERF_H
+#define PERF_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+typedef enum {
+   PERF_CYCLES,               /* cpu cycles */
+   PERF_INSTRUCTIONS,         /* instructions retired */
+   PERF_L1D_MISSES,           /* level 1 data cache read misses */
+   PERF_LLC_MISSES,           /* last level cache misses */
+   PERF_BRANCH_MISSES,        /* mispredicted branches */
+   PERF_DTLB_MISSES,          /* data TLB read misses */
+   PERF_TASK_CLOCK,           /* nanoseconds of cpu time, counted by the kernel even without hardware counters */
+   PERF_COUNTERS              /* number of counters */
+} ap_PerfCounter;
+
+typedef struct ap_PerfCounters ap_PerfCounters;
+
+struct ap_PerfCounters {
+   int fds[PERF_COUNTERS];    /* file descriptor of each counter, or -1 if it is unavailable */
+   uint64_t start[PERF_COUNTERS][3];  /* count, time enabled and time running of each counter at the last perf_start */
+   double values[PERF_COUNTERS];  /* counts between the last perf_start and perf_stop */
+   int n_available;           /* number of counters that could be opened */
+   int n_hardware;            /* number of hardware counters that could be opened */
+};
+
+extern const char *perf_counter_names[PERF_COUNTERS];
+
+ap_PerfCounters* create_perf_counters( void );
+void perf_start( ap_PerfCounters *counters );
+void perf_stop( ap_PerfCounters *counters );
+bool perf_read( ap_PerfCounters *counters, int counter, uint64_t *buffer );
+void print_perf_counters( ap_PerfCounters *counters, const char *unit, double n_units, FILE *stream );
+
+void free_perf_counters( ap_PerfCounters *counters );
+
+#endif
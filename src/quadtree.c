@@ -0,0 +1,192 @@
+/* quadtree.c
+ *
+ * Copyright (c) 2011, Jeffrey P. Gill
+ *
+ * This file is part of photomosaic.
+ *
+ * photomosaic is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * photomosaic is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with photomosaic.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>  /* assert */
+#include <stdlib.h>  /* NULL, malloc, realloc */
+#include "quadtree.h"
+#include "trace.h"
+
+#define max(a,b) ((a) > (b) ? (a) : (b))
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+                    LAYOUT FUNCTIONS
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+
+// Lay cells over an image as a quadtree instead of a uniform
+// grid. The image is covered by max_size cells, and each cell
+// is split into four until its color variance, summed over
+// the channels, is at most threshold or it reaches min_size,
+// so featureless regions are drawn with a few large tiles and
+// only detailed regions need many small ones. max_size must
+// be min_size times a power of two. Cells along the right and
+// bottom edges are split until they fit within the image, and
+// strips too thin for a min_size cell are left uncovered, as
+// with a uniform grid of min_size cells. The image must have
+// been created with squares.
+//
+// Each cell gets a descriptor of the same side x side layout
+// regardless of its size, ready to be passed to the batch
+// searches as queries, so one search issues one query per
+// cell rather than one per min_size square.
+ap_QuadtreeLayout*
+create_quadtree_layout( ap_IntegralImage *image, int max_size, int min_size, double threshold, int side ) {
+
+   int i, x, y, n_stack;
+   double start = trace_begin();
+
+   assert( image->squares && min_size >= side && min_size > 0 );
+   assert( max_size >= min_size && max_size % min_size == 0 && ( ( max_size / min_size ) & ( max_size / min_size - 1 ) ) == 0 );
+
+   ap_QuadtreeLayout *layout = malloc( sizeof( ap_QuadtreeLayout ) );
+   assert( layout );
+   layout->n_cells = 0;
+   layout->capacity = max( ( image->width / max_size + 1 ) * ( image->height / max_size + 1 ), 16 );
+   layout->cells = malloc( layout->capacity * sizeof( ap_QuadCell ) );
+   assert( layout->cells );
+   layout->min_size = min_size;
+   layout->max_size = max_size;
+   layout->side = side;
+   layout->vec_size = side * side * image->channels;
+
+   // Walk each root cell's subtree depth first, pushing the
+   // children of a split cell in reverse so that the cells
+   // come out in Z order; each level pushes at most four
+   int depth = atlas_log2( max_size / min_size );
+   ap_QuadCell stack[3 * depth + 1], cell;
+   for( y = 0; y + min_size <= image->height; y += max_size ) {
+      for( x = 0; x + min_size <= image->width; x += max_size ) {
+         stack[0] = (ap_QuadCell){ x, y, max_size };
+         n_stack = 1;
+         while( n_stack > 0 ) {
+            cell = stack[--n_stack];
+            if( cell.x + min_size > image->width || cell.y + min_size > image->height )
+               continue;
+            if( !quadtree_split( image, &cell, min_size, threshold ) ) {
+               quadtree_add_cell( layout, cell.x, cell.y, cell.size );
+               continue;
+            }
+            int half = cell.size / 2;
+            stack[n_stack++] = (ap_QuadCell){ cell.x + half, cell.y + half, half };
+            stack[n_stack++] = (ap_QuadCell){ cell.x, cell.y + half, half };
+            stack[n_stack++] = (ap_QuadCell){ cell.x + half, cell.y, half };
+            stack[n_stack++] = (ap_QuadCell){ cell.x, cell.y, half };
+         }
+      }
+   }
+
+   // Describe each cell
+   layout->points = malloc( max( layout->n_cells, 1 ) * sizeof( ap_Point ) );
+   layout->queries = malloc( max( layout->n_cells, 1 ) * sizeof( ap_Point* ) );
+   layout->vecs = malloc( max( layout->n_cells, 1 ) * layout->vec_size );
+   assert( layout->points && layout->queries && layout->vecs );
+   for( i = 0; i < layout->n_cells; i++ ) {
+      layout->points[i].id = i;
+      layout->points[i].vec = layout->vecs + i * layout->vec_size;
+      layout->points[i].ancestors = NULL;
+      layout->queries[i] = &(layout->points[i]);
+      integral_descriptor( image, layout->cells[i].x, layout->cells[i].y, layout->cells[i].size, side, layout->vecs + i * layout->vec_size );
+   }
+
+   trace_end( "extract", "create_quadtree_layout", start );
+
+   return layout;
+}
+
+
+// Return true if a cell should be split into four: if it is
+// larger than min_size and either extends past the image or
+// has a color variance, summed over the channels, above
+// threshold.
+bool
+quadtree_split( ap_IntegralImage *image, ap_QuadCell *cell, int min_size, double threshold ) {
+
+   int c;
+   double variance[image->channels], total = 0;
+
+   if( cell->size <= min_size )
+      return false;
+   if( cell->x + cell->size > image->width || cell->y + cell->size > image->height )
+      return true;
+
+   integral_variance( image, cell->x, cell->y, cell->size, cell->size, variance );
+   for( c = 0; c < image->channels; c++ )
+      total += variance[c];
+
+   return total > threshold;
+}
+
+
+// Append a cell to a layout, growing its array if necessary
+void
+quadtree_add_cell( ap_QuadtreeLayout *layout, int x, int y, int size ) {
+
+   if( layout->n_cells == layout->capacity ) {
+      layout->capacity *= 2;
+      layout->cells = realloc( layout->cells, layout->capacity * sizeof( ap_QuadCell ) );
+      assert( layout->cells );
+   }
+
+   layout->cells[layout->n_cells++] = (ap_QuadCell){ x, y, size };
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+                   RENDERING FUNCTIONS
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+
+// Draw the tile chosen for each cell of a layout, ids[i] for
+// cell i, into an output image the size of the target whose
+// rows are dst_stride bytes apart, each tile drawn at its
+// cell's size. Cells with a negative id are left alone.
+// Returns the number of tiles drawn.
+int
+composite_quadtree_layout( ap_QuadtreeLayout *layout, ap_Atlas *atlas, const int *ids, uint8_t *dst, size_t dst_stride ) {
+
+   int i, drawn = 0;
+
+   for( i = 0; i < layout->n_cells; i++ ) {
+      ap_QuadCell *cell = &(layout->cells[i]);
+      if( ids[i] >= 0 && atlas_blit( atlas, ids[i], cell->size, dst + cell->y * dst_stride + (size_t)cell->x * ATLAS_CHANNELS, dst_stride ) )
+         drawn++;
+   }
+
+   return drawn;
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+               MEMORY MANAGEMENT FUNCTIONS
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+
+// Free up memory used by an ap_QuadtreeLayout, including its
+// descriptors.
+void
+free_quadtree_layout( ap_QuadtreeLayout *layout ) {
+
+   free( layout->cells );
+   free( layout->points );
+   free( layout->queries );
+   free( layout->vecs );
+   free( layout );
+}
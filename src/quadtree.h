@@ -0,0 +1,58 @@
+/* quadtree.h
+ *
+ * Copyright (c) 2011, Jeffrey P. Gill
+ *
+ * This file is part of photomosaic.
+ *
+ * photomosaic is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * photomosaic is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with photomosaic.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef QUADTREE_H
+#define QUADTREE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "antipole.h"
+#include "atlas.h"
+#include "integral.h"
+
+typedef struct ap_QuadCell ap_QuadCell;
+typedef struct ap_QuadtreeLayout ap_QuadtreeLayout;
+
+struct ap_QuadCell {
+   int x, y;                  /* position of the cell's top left pixel */
+   int size;                  /* width and height of the cell in pixels */
+};
+
+struct ap_QuadtreeLayout {
+   int n_cells;               /* number of cells */
+   int capacity;              /* number of cells allocated */
+   ap_QuadCell *cells;        /* array of cells, in depth-first order */
+   int min_size, max_size;    /* smallest and largest cell sizes */
+   int side;                  /* number of sub-cells across and down each descriptor */
+   size_t vec_size;           /* number of bytes in each descriptor */
+   ap_Point *points;          /* descriptor of each cell, with the cell's index as its id */
+   ap_Point **queries;        /* pointer to each descriptor, for the batch searches */
+   uint8_t *vecs;             /* position vectors of the descriptors */
+};
+
+ap_QuadtreeLayout* create_quadtree_layout( ap_IntegralImage *image, int max_size, int min_size, double threshold, int side );
+bool quadtree_split( ap_IntegralImage *image, ap_QuadCell *cell, int min_size, double threshold );
+void quadtree_add_cell( ap_QuadtreeLayout *layout, int x, int y, int size );
+int composite_quadtree_layout( ap_QuadtreeLayout *layout, ap_Atlas *atlas, const int *ids, uint8_t *dst, size_t dst_stride );
+
+void free_quadtree_layout( ap_QuadtreeLayout *layout );
+
+#endif
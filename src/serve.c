@@ -0,0 +1,144 @@
+/* serve.c
+ *
+ * Copyright (c) 2011, Jeffrey P. Gill
+ *
+ * This file is part of photomosaic.
+ *
+ * photomosaic is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * photomosaic is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with photomosaic.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>     /* assert */
+#include <math.h>       /* sqrt */
+#include <signal.h>     /* sigaction */
+#include <stdint.h>     /* uint8_t */
+#include <stdio.h>      /* fopen, fread, fprintf */
+#include <stdlib.h>     /* atoi, getenv, malloc */
+#include <string.h>     /* memset */
+#include "antipole.h"
+#include "server.h"
+#include "trace.h"
+
+int DIM = 3;               /* dimensionality of the mean RGB data */
+typedef uint8_t VEC_TYPE;  /* data type of the mean RGB data */
+#define VEC_DOMAIN 256     /* the range over which the data can fall */
+
+volatile sig_atomic_t stop = 0;  /* set when the server should shut down */
+
+// Calculate the Euclidian distance between two points
+double
+dist( ap_Point *p1, ap_Point *p2 ) {
+
+   int i;
+   double d, sum = 0;
+   for( i = 0; i < DIM; i++ ) {
+      d = (double)((VEC_TYPE*)p1->vec)[i] - (double)((VEC_TYPE*)p2->vec)[i];
+      sum += d * d;
+   }
+
+   return sqrt( sum );
+}
+
+
+// Ask the server to shut down
+void
+handle_stop( int signal ) {
+
+   (void)signal;
+   stop = 1;
+}
+
+
+// Load a file of position vectors, build one index over
+// them, and serve nearest neighbor and range queries on it
+// until interrupted. The id of each point is its record
+// number in the file.
+int
+main( int argc, char **argv ) {
+
+   int i;
+   long size;
+
+   if( argc < 3 ) {
+      fprintf( stderr, "usage: %s socket data [dim]\n", argv[0] );
+      return EXIT_FAILURE;
+   }
+   DIM = argc > 3 ? atoi( argv[3] ) : DIM;
+   size_t vec_size = DIM * sizeof( VEC_TYPE );
+
+   const char *trace_path = getenv( TRACE_ENV );
+   if( trace_path != NULL )
+      start_trace();
+   double bounded_radius = VEC_DOMAIN * 0.05 * sqrt( DIM );
+
+   // Read the data vectors
+   FILE *file = fopen( argv[2], "rb" );
+   if( file == NULL || fseek( file, 0, SEEK_END ) != 0 || ( size = ftell( file ) ) < 0 ) {
+      fprintf( stderr, "%s: cannot read %s\n", argv[0], argv[2] );
+      return EXIT_FAILURE;
+   }
+   int n_data = size / vec_size;
+   char *vecs = malloc( n_data * vec_size + 1 );
+   ap_Point *data = malloc( ( n_data + 1 ) * sizeof( ap_Point ) );
+   assert( vecs && data );
+   rewind( file );
+   if( fread( vecs, vec_size, n_data, file ) != (size_t)n_data ) {
+      fprintf( stderr, "%s: cannot read %s\n", argv[0], argv[2] );
+      return EXIT_FAILURE;
+   }
+   fclose( file );
+
+   ap_PointList *s = NULL;
+   for( i = 0; i < n_data; i++ ) {
+      data[i].id = i;
+      data[i].vec = vecs + i * vec_size;
+      data[i].ancestors = NULL;
+      prepend_point( &s, &data[i], 0, NULL );
+   }
+
+   ap_Index *search_index = build_index( s, bounded_radius, INDEX_AUTO, DIM, dist );
+   fprintf( stderr, "(* serving %d points in a %s index on %s *)\n", n_data, search_index->type == INDEX_TREE ? "tree" : "flat", argv[1] );
+
+   ap_Server *server = create_server( argv[1], search_index, vec_size );
+   if( server == NULL ) {
+      fprintf( stderr, "%s: cannot listen on %s\n", argv[0], argv[1] );
+      return EXIT_FAILURE;
+   }
+
+   // Stop serving on an interrupt, without restarting the
+   // system call the server is waiting in
+   struct sigaction action;
+   memset( &action, 0, sizeof( action ) );
+   action.sa_handler = handle_stop;
+   sigaction( SIGINT, &action, NULL );
+   sigaction( SIGTERM, &action, NULL );
+   signal( SIGPIPE, SIG_IGN );
+
+   run_server( server, &stop, dist );
+
+   print_server_stats( &server->stats, stderr );
+   free_server( server );
+   free_index( search_index );
+   free_list( s );
+   free( data );
+   free( vecs );
+
+   // Write the trace of this run if one was asked for
+   if( trace_path != NULL ) {
+      if( !write_trace( trace_path ) )
+         fprintf( stderr, "%s: cannot write trace to %s\n", argv[0], trace_path );
+      free_trace();
+   }
+
+   return 0;
+}
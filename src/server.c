@@ -0,0 +1,671 @@
+/* server.c
+ *
+ * Copyright (c) 2011, Jeffrey P. Gill
+ *
+ * This file is part of photomosaic.
+ *
+ * photomosaic is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * photomosaic is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with photomosaic.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE          /* accept4 */
+
+#include <assert.h>  /* assert */
+#include <errno.h>   /* errno, EAGAIN, EINTR */
+#include <math.h>    /* isnan, log2 */
+#include <poll.h>    /* poll */
+#include <stdlib.h>  /* NULL, malloc, realloc */
+#include <string.h>  /* memcpy, memmove, strcpy */
+#include <sys/socket.h> /* socket, bind, listen, accept4, send */
+#include <sys/un.h>  /* sockaddr_un */
+#include <time.h>    /* clock_gettime */
+#include <unistd.h>  /* read, write, close, unlink */
+#include "server.h"
+#include "trace.h"
+
+#define min(a,b) ((a) < (b) ? (a) : (b))
+#define max(a,b) ((a) > (b) ? (a) : (b))
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+                     SERVER FUNCTIONS
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+
+// Create a server that answers queries on the index over a
+// Unix domain socket at path, replacing any stale socket
+// left there. vec_size is the number of bytes in each
+// position vector, which every request must carry. Returns
+// NULL if the socket could not be created.
+ap_Server*
+create_server( const char *path, ap_Index *index, size_t vec_size ) {
+
+   int i;
+   struct sockaddr_un addr;
+
+   assert( sizeof( ap_ServerRequest ) + vec_size <= SERVER_BUFFER_SIZE );
+   if( strlen( path ) >= sizeof( addr.sun_path ) )
+      return NULL;
+
+   memset( &addr, 0, sizeof( addr ) );
+   addr.sun_family = AF_UNIX;
+   strcpy( addr.sun_path, path );
+   int fd = socket( AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 );
+   if( fd < 0 )
+      return NULL;
+   unlink( path );
+   if( bind( fd, (struct sockaddr*)&addr, sizeof( addr ) ) < 0 || listen( fd, SOMAXCONN ) < 0 ) {
+      close( fd );
+      return NULL;
+   }
+
+   // Create the new ap_Server
+   ap_Server *server = malloc( sizeof( ap_Server ) );
+   assert( server );
+   server->listen_fd = fd;
+   server->path = malloc( strlen( path ) + 1 );
+   server->vecs = malloc( max( SERVER_BATCH_SIZE * vec_size, 1 ) );
+   assert( server->path && server->vecs );
+   strcpy( server->path, path );
+   server->index = index;
+   server->vec_size = vec_size;
+   for( i = 0; i < SERVER_MAX_CLIENTS; i++ )
+      server->conns[i].fd = -1;
+   server->n_queue = 0;
+   for( i = 0; i < SERVER_BATCH_SIZE; i++ ) {
+      server->points[i].id = -1;
+      server->points[i].vec = server->vecs + i * vec_size;
+      server->points[i].ancestors = NULL;
+   }
+   server->range_results = create_neighbor_array();
+   memset( &server->stats, 0, sizeof( ap_ServerStats ) );
+   server->stats.vec_size = vec_size;
+
+   return server;
+}
+
+
+// Serve requests until stop is set, normally by a signal
+// handler. Requests that arrive together, on one connection
+// or several, are coalesced into a batch of up to
+// SERVER_BATCH_SIZE, so that nearest neighbor requests share
+// one pass through the tree. Clients may pipeline requests;
+// responses on each connection come back in request order.
+void
+run_server( ap_Server *server, volatile sig_atomic_t *stop, DIST_FUNC ) {
+
+   int i, n_fds;
+   bool progress, pending = false;
+   struct pollfd fds[SERVER_MAX_CLIENTS + 1];
+   int slots[SERVER_MAX_CLIENTS + 1];
+   ap_ServerConnection *conn;
+
+   while( !*stop ) {
+
+      // Watch the listening socket and every connection that
+      // has room for more requests or responses to send
+      fds[0].fd = server->listen_fd;
+      fds[0].events = POLLIN;
+      n_fds = 1;
+      for( i = 0; i < SERVER_MAX_CLIENTS; i++ ) {
+         conn = &(server->conns[i]);
+         if( conn->fd < 0 )
+            continue;
+         fds[n_fds].fd = conn->fd;
+         fds[n_fds].events = 0;
+         if( !conn->closed && conn->in_size - conn->in_start < SERVER_BUFFER_SIZE && conn->out_size - conn->out_sent < SERVER_MAX_OUTPUT )
+            fds[n_fds].events |= POLLIN;
+         if( conn->out_sent < conn->out_size )
+            fds[n_fds].events |= POLLOUT;
+         slots[n_fds++] = i;
+      }
+
+      // Do not wait if requests left over from the last batch
+      // are already buffered
+      if( poll( fds, n_fds, pending ? 0 : -1 ) < 0 ) {
+         if( errno == EINTR )
+            continue;
+         break;
+      }
+
+      if( fds[0].revents & POLLIN )
+         server_accept( server );
+      for( i = 1; i < n_fds; i++ ) {
+         conn = &(server->conns[slots[i]]);
+         if( fds[i].revents & (POLLIN | POLLHUP | POLLERR) )
+            server_read( conn );
+         if( fds[i].revents & POLLOUT )
+            server_flush( conn );
+      }
+
+      // Take one request from each connection in turn until
+      // the batch is full or no complete requests remain
+      do {
+         progress = false;
+         for( i = 0; i < SERVER_MAX_CLIENTS && server->n_queue < SERVER_BATCH_SIZE; i++ )
+            progress = server_parse( server, i ) || progress;
+      } while( progress && server->n_queue < SERVER_BATCH_SIZE );
+
+      if( server->n_queue > 0 )
+         server_process_queue( server, dist );
+
+      // Send the responses, and close connections that have
+      // hung up once nothing is left to do for them
+      pending = false;
+      for( i = 0; i < SERVER_MAX_CLIENTS; i++ ) {
+         conn = &(server->conns[i]);
+         if( conn->fd < 0 )
+            continue;
+         if( conn->out_sent < conn->out_size )
+            server_flush( conn );
+         if( conn->in_size - conn->in_start >= sizeof( ap_ServerRequest ) + server->vec_size )
+            pending = true;
+         else if( conn->closed && conn->out_sent == conn->out_size )
+            server_close_connection( conn );
+      }
+   }
+}
+
+
+// Accept every waiting connection into a free slot. When
+// every slot is taken, new connections are refused.
+void
+server_accept( ap_Server *server ) {
+
+   int i, fd;
+
+   while( ( fd = accept4( server->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC ) ) >= 0 ) {
+      for( i = 0; i < SERVER_MAX_CLIENTS && server->conns[i].fd >= 0; i++ );
+      if( i == SERVER_MAX_CLIENTS ) {
+         close( fd );
+         continue;
+      }
+      ap_ServerConnection *conn = &(server->conns[i]);
+      conn->fd = fd;
+      conn->closed = false;
+      conn->in = malloc( SERVER_BUFFER_SIZE );
+      assert( conn->in );
+      conn->in_size = conn->in_start = 0;
+      conn->n_arrivals = 0;
+      conn->out = NULL;
+      conn->out_size = conn->out_capacity = conn->out_sent = 0;
+   }
+}
+
+
+// Read whatever the connection has sent into its receive
+// buffer, noting when the bytes arrived so that the latency
+// of each request counts the time it waits to be parsed. A
+// connection that has hung up or failed is marked closed,
+// but requests it sent before hanging up are still answered.
+void
+server_read( ap_ServerConnection *conn ) {
+
+   int i;
+
+   if( conn->closed )
+      return;
+
+   // Move unparsed bytes to the front of the buffer
+   if( conn->in_start > 0 ) {
+      memmove( conn->in, conn->in + conn->in_start, conn->in_size - conn->in_start );
+      for( i = 0; i < conn->n_arrivals; i++ )
+         conn->arrivals[i].end -= conn->in_start;
+      conn->in_size -= conn->in_start;
+      conn->in_start = 0;
+   }
+
+   ssize_t n = read( conn->fd, conn->in + conn->in_size, SERVER_BUFFER_SIZE - conn->in_size );
+   if( n > 0 ) {
+      conn->in_size += n;
+
+      // When too many reads are pending, fold this one into
+      // the last, overstating the latency of its requests
+      // rather than understating it
+      if( conn->n_arrivals == SERVER_MAX_ARRIVALS )
+         conn->arrivals[conn->n_arrivals - 1].end = conn->in_size;
+      else
+         conn->arrivals[conn->n_arrivals++] = (ap_ServerArrival){ conn->in_size, server_time() };
+   } else if( n == 0 || ( errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR ) )
+      conn->closed = true;
+}
+
+
+// Move one complete request from the connection's receive
+// buffer into the current batch, stamped with the time its
+// last byte was read. Returns true if a request was queued,
+// or false otherwise.
+bool
+server_parse( ap_Server *server, int conn ) {
+
+   int i;
+   ap_ServerConnection *c = &(server->conns[conn]);
+   size_t request_size = sizeof( ap_ServerRequest ) + server->vec_size;
+   if( c->fd < 0 || server->n_queue == SERVER_BATCH_SIZE || c->in_size - c->in_start < request_size )
+      return false;
+
+   ap_ServerQuery *query = &(server->queue[server->n_queue]);
+   query->conn = conn;
+   memcpy( &query->request, c->in + c->in_start, sizeof( ap_ServerRequest ) );
+   memcpy( server->points[server->n_queue].vec, c->in + c->in_start + sizeof( ap_ServerRequest ), server->vec_size );
+   query->out = NULL;
+   c->in_start += request_size;
+   server->n_queue++;
+
+   // Find the read that completed the request, and forget the
+   // reads that have been parsed completely
+   for( i = 0; c->arrivals[i].end < c->in_start; i++ );
+   query->start = c->arrivals[i].time;
+   if( c->arrivals[i].end == c->in_start )
+      i++;
+   memmove( c->arrivals, c->arrivals + i, ( c->n_arrivals - i ) * sizeof( ap_ServerArrival ) );
+   c->n_arrivals -= i;
+
+   return true;
+}
+
+
+// Return the number of requests buffered by the server: those
+// in the current batch and the complete requests still
+// waiting in the receive buffers, which are left over when a
+// batch fills up
+int
+server_backlog( ap_Server *server ) {
+
+   int i, backlog = server->n_queue;
+   size_t request_size = sizeof( ap_ServerRequest ) + server->vec_size;
+
+   for( i = 0; i < SERVER_MAX_CLIENTS; i++ )
+      if( server->conns[i].fd >= 0 )
+         backlog += ( server->conns[i].in_size - server->conns[i].in_start ) / request_size;
+
+   return backlog;
+}
+
+
+// Answer every request in the current batch. Nearest
+// neighbor requests asking for the same number of neighbors
+// are searched together in one batched search, then the
+// responses are queued in arrival order.
+void
+server_process_queue( ap_Server *server, DIST_FUNC ) {
+
+   int i, j, n;
+   uint32_t k;
+   int slots[SERVER_BATCH_SIZE];
+   bool searched[SERVER_BATCH_SIZE];
+
+   double start = trace_begin();
+   server->stats.batches++;
+   server->stats.queue_depth = server_backlog( server );
+   server->stats.max_queue_depth = max( server->stats.max_queue_depth, server->stats.queue_depth );
+
+   for( i = 0; i < server->n_queue; i++ ) {
+      k = server->queue[i].request.k;
+      searched[i] = server->queue[i].request.op != SERVER_OP_KNN || k < 1 || k > SERVER_MAX_K;
+   }
+
+   for( i = 0; i < server->n_queue; i++ ) {
+      if( searched[i] )
+         continue;
+      k = server->queue[i].request.k;
+      for( j = i, n = 0; j < server->n_queue; j++ ) {
+         if( !searched[j] && server->queue[j].request.k == k ) {
+            server->queries[n] = &(server->points[j]);
+            slots[n++] = j;
+            searched[j] = true;
+         }
+      }
+      index_nearest_neighbor_search_batch( server->index, server->queries, n, k, server->out, dist );
+      for( j = 0; j < n; j++ )
+         server->queue[slots[j]].out = server->out[j];
+      server->stats.knn_searches++;
+   }
+
+   for( i = 0; i < server->n_queue; i++ )
+      server_respond( server, &(server->queue[i]), dist );
+   server->n_queue = 0;
+   trace_end( "serve", "server_process_queue", start );
+}
+
+
+// Queue the response to one request of the current batch
+// on its connection, running the range search if it is a
+// range request, and record its latency
+void
+server_respond( ap_Server *server, ap_ServerQuery *query, DIST_FUNC ) {
+
+   int i, n;
+   ap_ServerResponse response;
+   ap_ServerResult *results;
+   ap_PointList *index;
+   ap_ServerConnection *conn = &(server->conns[query->conn]);
+   ap_Point *q = &(server->points[query - server->queue]);
+
+   response.tag = query->request.tag;
+   response.op = query->request.op;
+   response.n_results = 0;
+   response.length = 0;
+
+   switch( query->request.op ) {
+      case SERVER_OP_KNN:
+         if( query->request.k < 1 || query->request.k > SERVER_MAX_K ) {
+            response.op = SERVER_OP_ERROR;
+            server_queue_response( conn, &response );
+            break;
+         }
+         n = 0;
+         for( index = query->out; index != NULL; index = index->next )
+            n++;
+         response.n_results = n;
+         response.length = n * sizeof( ap_ServerResult );
+         results = server_queue_response( conn, &response );
+         for( index = query->out, i = 0; index != NULL; index = index->next, i++ ) {
+            results[i].id = index->p->id;
+            results[i].unused = 0;
+            results[i].dist = index->dist;
+         }
+         free_list( query->out );
+         query->out = NULL;
+         server->stats.knn_requests++;
+         break;
+
+      case SERVER_OP_RANGE:
+         if( isnan( query->request.range ) || query->request.range < 0 ) {
+            response.op = SERVER_OP_ERROR;
+            server_queue_response( conn, &response );
+            break;
+         }
+         server->range_results->size = 0;
+         index_range_search( server->index, q, query->request.range, server->range_results, dist );
+         response.n_results = server->range_results->size;
+         response.length = response.n_results * sizeof( ap_ServerResult );
+         results = server_queue_response( conn, &response );
+         for( i = 0; i < server->range_results->size; i++ ) {
+            results[i].id = server->range_results->items[i].p->id;
+            results[i].unused = 0;
+            results[i].dist = server->range_results->items[i].dist;
+         }
+         server->stats.range_requests++;
+         break;
+
+      case SERVER_OP_STATS:
+         response.length = sizeof( ap_ServerStats );
+         memcpy( server_queue_response( conn, &response ), &server->stats, sizeof( ap_ServerStats ) );
+         break;
+
+      default:
+         response.op = SERVER_OP_ERROR;
+         server_queue_response( conn, &response );
+         break;
+   }
+
+   server->stats.requests++;
+   server->stats.latency[server_latency_bucket( server_time() - query->start )]++;
+}
+
+
+// Append a response header to the connection's send buffer
+// and reserve room for the response->length bytes that
+// follow it. Returns a pointer to the reserved bytes.
+void*
+server_queue_response( ap_ServerConnection *conn, ap_ServerResponse *response ) {
+
+   size_t size = sizeof( ap_ServerResponse ) + response->length;
+
+   // Drop bytes already sent before growing the buffer
+   if( conn->out_sent > 0 && conn->out_size + size > conn->out_capacity ) {
+      memmove( conn->out, conn->out + conn->out_sent, conn->out_size - conn->out_sent );
+      conn->out_size -= conn->out_sent;
+      conn->out_sent = 0;
+   }
+   if( conn->out_size + size > conn->out_capacity ) {
+      conn->out_capacity = max( 2 * conn->out_capacity, conn->out_size + size );
+      conn->out = realloc( conn->out, conn->out_capacity );
+      assert( conn->out );
+   }
+
+   memcpy( conn->out + conn->out_size, response, sizeof( ap_ServerResponse ) );
+   void *payload = conn->out + conn->out_size + sizeof( ap_ServerResponse );
+   conn->out_size += size;
+
+   return payload;
+}
+
+
+// Send as much of the connection's send buffer as the
+// socket will take without blocking. If the client has gone
+// away, its unsent responses are discarded.
+void
+server_flush( ap_ServerConnection *conn ) {
+
+   ssize_t n;
+
+   while( conn->out_sent < conn->out_size ) {
+      n = send( conn->fd, conn->out + conn->out_sent, conn->out_size - conn->out_sent, MSG_NOSIGNAL );
+      if( n < 0 && errno == EINTR )
+         continue;
+      if( n < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ) )
+         return;
+      if( n < 0 ) {
+         conn->closed = true;
+         break;
+      }
+      conn->out_sent += n;
+   }
+
+   conn->out_size = conn->out_sent = 0;
+}
+
+
+// Close the connection and free its slot
+void
+server_close_connection( ap_ServerConnection *conn ) {
+
+   close( conn->fd );
+   free( conn->in );
+   free( conn->out );
+   conn->fd = -1;
+}
+
+
+// Return the latency histogram bucket of a request answered
+// in the given number of seconds
+int
+server_latency_bucket( double seconds ) {
+
+   double us = seconds * 1e6;
+   if( us < 1 )
+      return 0;
+
+   return min( (int)log2( us ) + 1, SERVER_LATENCY_BUCKETS - 1 );
+}
+
+
+// Return the time in seconds from a monotonic clock
+double
+server_time( void ) {
+
+   struct timespec ts;
+   clock_gettime( CLOCK_MONOTONIC, &ts );
+   return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+// Print the server statistics, including the latency
+// histogram and the approximate median and 99th percentile
+// latencies taken from it
+void
+print_server_stats( ap_ServerStats *stats, FILE *stream ) {
+
+   int i;
+   uint64_t seen = 0;
+   double p50 = 0, p99 = 0;
+
+   fprintf( stream, "(* requests %lu (knn %lu, range %lu) *)\n", (unsigned long)stats->requests,
+         (unsigned long)stats->knn_requests, (unsigned long)stats->range_requests );
+   fprintf( stream, "(* batches %lu, mean batch size %.2f, max queue depth %u *)\n", (unsigned long)stats->batches,
+         stats->batches > 0 ? (double)stats->requests / stats->batches : 0.0, stats->max_queue_depth );
+   for( i = 0; i < SERVER_LATENCY_BUCKETS; i++ ) {
+      if( stats->latency[i] == 0 )
+         continue;
+      seen += stats->latency[i];
+      if( p50 == 0 && seen * 2 >= stats->requests )
+         p50 = ldexp( 1, i );
+      if( p99 == 0 && seen * 100 >= stats->requests * 99 )
+         p99 = ldexp( 1, i );
+      fprintf( stream, "(*    < %8.0f us %10lu *)\n", ldexp( 1, i ), (unsigned long)stats->latency[i] );
+   }
+   fprintf( stream, "(* latency p50 < %.0f us, p99 < %.0f us *)\n", p50, p99 );
+}
+
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+                     CLIENT FUNCTIONS
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+
+// Connect to a server listening at path. Returns the
+// connected socket, or -1 if the connection failed.
+int
+connect_server( const char *path ) {
+
+   struct sockaddr_un addr;
+
+   if( strlen( path ) >= sizeof( addr.sun_path ) )
+      return -1;
+   memset( &addr, 0, sizeof( addr ) );
+   addr.sun_family = AF_UNIX;
+   strcpy( addr.sun_path, path );
+
+   int fd = socket( AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0 );
+   if( fd < 0 )
+      return -1;
+   if( connect( fd, (struct sockaddr*)&addr, sizeof( addr ) ) < 0 ) {
+      close( fd );
+      return -1;
+   }
+
+   return fd;
+}
+
+
+// Send a request and its query's position vector in one
+// write. Several requests may be sent before reading their
+// responses. Returns true if the request was sent, or false
+// otherwise.
+bool
+server_send_request( int fd, ap_ServerRequest *request, const void *vec, size_t vec_size ) {
+
+   char buffer[sizeof( ap_ServerRequest ) + vec_size];
+   memcpy( buffer, request, sizeof( ap_ServerRequest ) );
+   memcpy( buffer + sizeof( ap_ServerRequest ), vec, vec_size );
+
+   return server_write_all( fd, buffer, sizeof( buffer ) );
+}
+
+
+// Read the next response. If the response carries results
+// or statistics, payload is set to a newly allocated copy of
+// them that the caller must free, and otherwise to NULL.
+// Returns true if a response was read, or false otherwise.
+bool
+server_read_response( int fd, ap_ServerResponse *response, void **payload ) {
+
+   *payload = NULL;
+   if( !server_read_all( fd, response, sizeof( ap_ServerResponse ) ) )
+      return false;
+   if( response->length == 0 )
+      return true;
+
+   *payload = malloc( response->length );
+   assert( *payload );
+   if( !server_read_all( fd, *payload, response->length ) ) {
+      free( *payload );
+      *payload = NULL;
+      return false;
+   }
+
+   return true;
+}
+
+
+// Write all size bytes of buffer to a blocking socket.
+// Returns true if every byte was written, or false
+// otherwise.
+bool
+server_write_all( int fd, const void *buffer, size_t size ) {
+
+   ssize_t n;
+   size_t done = 0;
+
+   while( done < size ) {
+      n = send( fd, (const char*)buffer + done, size - done, MSG_NOSIGNAL );
+      if( n < 0 && errno == EINTR )
+         continue;
+      if( n <= 0 )
+         return false;
+      done += n;
+   }
+
+   return true;
+}
+
+
+// Read exactly size bytes from a blocking socket into
+// buffer. Returns true if every byte was read, or false
+// otherwise.
+bool
+server_read_all( int fd, void *buffer, size_t size ) {
+
+   ssize_t n;
+   size_t done = 0;
+
+   while( done < size ) {
+      n = read( fd, (char*)buffer + done, size - done );
+      if( n < 0 && errno == EINTR )
+         continue;
+      if( n <= 0 )
+         return false;
+      done += n;
+   }
+
+   return true;
+}
+
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+                   MEMORY FREEING FUNCTIONS
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+
+// Close every connection and the listening socket, remove
+// the socket from the file system, and free the server. The
+// index being served is not freed.
+void
+free_server( ap_Server *server ) {
+
+   int i;
+
+   for( i = 0; i < SERVER_MAX_CLIENTS; i++ )
+      if( server->conns[i].fd >= 0 )
+         server_close_connection( &(server->conns[i]) );
+   close( server->listen_fd );
+   unlink( server->path );
+   free( server->path );
+   free( server->vecs );
+   free_neighbor_array( server->range_results );
+   free( server );
+}
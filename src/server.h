@@ -0,0 +1,153 @@
+/* server.h
+ *
+ * Copyright (c) 2011, Jeffrey P. Gill
+ *
+ * This file is part of photomosaic.
+ *
+ * photomosaic is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * photomosaic is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with photomosaic.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <signal.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "antipole.h"
+
+#define SERVER_MAX_CLIENTS 64    /* largest number of simultaneous connections */
+#define SERVER_BATCH_SIZE 256    /* largest number of requests coalesced into one batch */
+#define SERVER_BUFFER_SIZE 65536 /* size of each connection's request buffer */
+#define SERVER_MAX_OUTPUT 1048576  /* bytes of unsent responses beyond which a connection stops being read */
+#define SERVER_MAX_K 1024        /* largest number of neighbors a request may ask for */
+#define SERVER_LATENCY_BUCKETS 24  /* number of power-of-two microsecond buckets in the latency histogram */
+#define SERVER_MAX_ARRIVALS 16   /* largest number of reads whose arrival times each connection tracks */
+
+typedef enum {
+   SERVER_OP_KNN,             /* k nearest neighbors */
+   SERVER_OP_RANGE,           /* all neighbors within range */
+   SERVER_OP_STATS,           /* server statistics */
+   SERVER_OP_ERROR            /* response to a malformed request */
+} ap_ServerOp;
+
+typedef struct ap_ServerRequest ap_ServerRequest;
+typedef struct ap_ServerResponse ap_ServerResponse;
+typedef struct ap_ServerResult ap_ServerResult;
+typedef struct ap_ServerStats ap_ServerStats;
+typedef struct ap_ServerQuery ap_ServerQuery;
+typedef struct ap_ServerArrival ap_ServerArrival;
+typedef struct ap_ServerConnection ap_ServerConnection;
+typedef struct ap_Server ap_Server;
+
+struct ap_ServerRequest {
+   uint32_t tag;              /* chosen by the client and echoed in the response */
+   uint32_t op;               /* an ap_ServerOp */
+   uint32_t k;                /* if knn, number of neighbors to find */
+   uint32_t unused;           /* padding */
+   double range;              /* if range, distance within which to find neighbors */
+};                            /* followed by the query's position vector */
+
+struct ap_ServerResponse {
+   uint32_t tag;              /* tag of the request */
+   uint32_t op;               /* op of the request, or SERVER_OP_ERROR */
+   uint32_t n_results;        /* number of ap_ServerResults that follow */
+   uint32_t length;           /* number of bytes that follow */
+};
+
+struct ap_ServerResult {
+   int32_t id;                /* id of the point found */
+   uint32_t unused;           /* padding */
+   double dist;               /* distance to query */
+};
+
+struct ap_ServerStats {
+   uint64_t vec_size;         /* number of bytes in each position vector */
+   uint64_t requests;         /* number of requests answered */
+   uint64_t knn_requests;     /* number of knn requests answered */
+   uint64_t range_requests;   /* number of range requests answered */
+   uint64_t batches;          /* number of batches processed */
+   uint64_t knn_searches;     /* number of batched nearest neighbor searches run */
+   uint32_t queue_depth;      /* number of requests buffered when the stats request's batch was taken */
+   uint32_t max_queue_depth;  /* largest number of requests buffered when a batch was taken */
+   uint64_t latency[SERVER_LATENCY_BUCKETS];  /* number of requests answered in [2^(i-1), 2^i) microseconds, bucket 0 below 1 */
+};
+
+struct ap_ServerQuery {
+   int conn;                  /* index of the connection that sent the request */
+   ap_ServerRequest request;  /* the request header */
+   double start;              /* time the last byte of the request was read */
+   ap_PointList *out;         /* if knn, neighbors found */
+};
+
+struct ap_ServerArrival {
+   size_t end;                /* end of the bytes read, as an offset into the receive buffer */
+   double time;               /* time they were read */
+};
+
+struct ap_ServerConnection {
+   int fd;                    /* connected socket, or -1 if the slot is free */
+   bool closed;               /* whether the connection is closed once the current batch is answered */
+   char *in;                  /* buffer of received bytes */
+   size_t in_size;            /* number of bytes in the receive buffer */
+   size_t in_start;           /* number of bytes of the receive buffer already parsed */
+   ap_ServerArrival arrivals[SERVER_MAX_ARRIVALS];  /* reads holding unparsed bytes, oldest first */
+   int n_arrivals;            /* number of reads in arrivals */
+   char *out;                 /* buffer of unsent responses */
+   size_t out_size;           /* number of bytes in the send buffer */
+   size_t out_capacity;       /* number of bytes allocated for the send buffer */
+   size_t out_sent;           /* number of bytes of the send buffer already sent */
+};
+
+struct ap_Server {
+   int listen_fd;             /* listening socket */
+   char *path;                /* path of the socket */
+   ap_Index *index;           /* index being served */
+   size_t vec_size;           /* number of bytes in each position vector */
+   ap_ServerConnection conns[SERVER_MAX_CLIENTS];  /* connection slots */
+   ap_ServerQuery queue[SERVER_BATCH_SIZE];  /* requests of the current batch, in arrival order */
+   int n_queue;               /* number of requests in the current batch */
+   ap_Point points[SERVER_BATCH_SIZE];  /* query points of the current batch */
+   char *vecs;                /* position vectors of the query points */
+   ap_Point *queries[SERVER_BATCH_SIZE];  /* queries of one batched search */
+   ap_PointList *out[SERVER_BATCH_SIZE];  /* results of one batched search */
+   ap_NeighborArray *range_results;  /* results of one range search */
+   ap_ServerStats stats;      /* statistics since the server started */
+};
+
+ap_Server* create_server( const char *path, ap_Index *index, size_t vec_size );
+void run_server( ap_Server *server, volatile sig_atomic_t *stop, DIST_FUNC );
+void server_accept( ap_Server *server );
+void server_read( ap_ServerConnection *conn );
+bool server_parse( ap_Server *server, int conn );
+int server_backlog( ap_Server *server );
+void server_process_queue( ap_Server *server, DIST_FUNC );
+void server_respond( ap_Server *server, ap_ServerQuery *query, DIST_FUNC );
+void* server_queue_response( ap_ServerConnection *conn, ap_ServerResponse *response );
+void server_flush( ap_ServerConnection *conn );
+void server_close_connection( ap_ServerConnection *conn );
+int server_latency_bucket( double seconds );
+double server_time( void );
+void print_server_stats( ap_ServerStats *stats, FILE *stream );
+
+int connect_server( const char *path );
+bool server_send_request( int fd, ap_ServerRequest *request, const void *vec, size_t vec_size );
+bool server_read_response( int fd, ap_ServerResponse *response, void **payload );
+bool server_write_all( int fd, const void *buffer, size_t size );
+bool server_read_all( int fd, void *buffer, size_t size );
+
+void free_server( ap_Server *server );
+
+#endif
@@ -0,0 +1,139 @@
+/* temporal.c
+ *
+ * Copyright (c) 2011, Jeffrey P. Gill
+ *
+ * This file is part of photomosaic.
+ *
+ * photomosaic is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * photomosaic is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with photomosaic.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>  /* assert */
+#include <math.h>    /* INFINITY */
+#include <stdlib.h>  /* NULL, malloc */
+#include <string.h>  /* memcpy */
+#include "temporal.h"
+
+#define max(a,b) ((a) > (b) ? (a) : (b))
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+                  TEMPORAL SEARCH FUNCTIONS
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+
+// Create a cache that remembers, for each of n_cells cells,
+// the query and k nearest neighbors of the last frame, so
+// that successive frames of a video can reuse them. vec_size
+// is the number of bytes in each position vector.
+ap_TemporalCache*
+create_temporal_cache( int n_cells, int k, size_t vec_size ) {
+
+   int i;
+
+   // Create the new ap_TemporalCache
+   ap_TemporalCache *cache = malloc( sizeof( ap_TemporalCache ) );
+   assert( cache );
+   cache->n_cells = n_cells;
+   cache->k = k;
+   cache->vec_size = vec_size;
+   cache->cells = malloc( max( n_cells, 1 ) * sizeof( ap_TemporalCell ) );
+   cache->vecs = malloc( max( n_cells * vec_size, 1 ) );
+   assert( cache->cells && cache->vecs );
+   for( i = 0; i < n_cells; i++ ) {
+      cache->cells[i].valid = false;
+      cache->cells[i].query.id = -1;
+      cache->cells[i].query.vec = cache->vecs + i * vec_size;
+      cache->cells[i].query.ancestors = NULL;
+      cache->cells[i].neighbors = NULL;
+   }
+   cache->reused = cache->seeded = cache->searched = 0;
+
+   return cache;
+}
+
+
+// Find the k points of the index nearest the query for one
+// cell of the current frame and place them in out, sorted by
+// distance. The list belongs to the cache and is valid until
+// the cell is searched again or the cache is freed.
+//
+// The last frame's neighbors are reused or seed the search
+// as reseed_nearest_neighbor_search describes, so the result
+// is exact. Returns true if the result was answered from the
+// last frame without a search, or false otherwise.
+bool
+temporal_nearest_neighbor_search( ap_TemporalCache *cache, ap_Index *index, int cell, ap_Point *query, ap_PointList **out, PROXY_FUNC, DIST_FUNC ) {
+
+   int n;
+   bool reused = false;
+   ap_PointList *neighbor, *results;
+   ap_TemporalCell *c = &(cache->cells[cell]);
+
+   if( c->valid ) {
+      ap_Neighbor old_neighbors[max( cache->k, 1 )];
+      for( neighbor = c->neighbors, n = 0; neighbor != NULL && n < cache->k; neighbor = neighbor->next, n++ ) {
+         old_neighbors[n].p = neighbor->p;
+         old_neighbors[n].dist = neighbor->dist;
+      }
+      reused = reseed_nearest_neighbor_search( index, query, cache->k, &c->query, old_neighbors, n, &results, proxy, dist );
+      if( reused )
+         cache->reused++;
+      else
+         cache->seeded++;
+   } else {
+      index_nearest_neighbor_search_within( index, query, cache->k, INFINITY, &results, proxy, dist );
+      cache->searched++;
+   }
+
+   // Remember the query and its neighbors for the next frame
+   free_list( c->neighbors );
+   c->neighbors = results;
+   memcpy( c->query.vec, query->vec, cache->vec_size );
+   c->valid = true;
+   *out = results;
+
+   return reused;
+}
+
+
+// Forget every cell's previous frame, as after a scene cut,
+// so that the next search of each cell starts afresh
+void
+reset_temporal_cache( ap_TemporalCache *cache ) {
+
+   int i;
+
+   for( i = 0; i < cache->n_cells; i++ ) {
+      free_list( cache->cells[i].neighbors );
+      cache->cells[i].neighbors = NULL;
+      cache->cells[i].valid = false;
+   }
+}
+
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+                   MEMORY FREEING FUNCTIONS
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+
+// Free the cache along with every cell's neighbor list
+void
+free_temporal_cache( ap_TemporalCache *cache ) {
+
+   reset_temporal_cache( cache );
+   free( cache->cells );
+   free( cache->vecs );
+   free( cache );
+}
@@ -0,0 +1,54 @@
+/* temporal.h
+ *
+ * Copyright (c) 2011, Jeffrey P. Gill
+ *
+ * This file is part of photomosaic.
+ *
+ * photomosaic is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * photomosaic is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with photomosaic.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TEMPORAL_H
+#define TEMPORAL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "antipole.h"
+
+typedef struct ap_TemporalCell ap_TemporalCell;
+typedef struct ap_TemporalCache ap_TemporalCache;
+
+struct ap_TemporalCell {
+   bool valid;                /* whether the cell has been searched since the cache was reset */
+   ap_Point query;            /* the cell's query from the last frame */
+   ap_PointList *neighbors;   /* the cell's k nearest neighbors from the last frame, sorted by distance */
+};
+
+struct ap_TemporalCache {
+   int n_cells;               /* number of cells */
+   int k;                     /* number of neighbors found for each cell */
+   size_t vec_size;           /* number of bytes in each position vector */
+   ap_TemporalCell *cells;    /* array of cells */
+   char *vecs;                /* position vectors of the cells' queries */
+   long reused;               /* number of searches answered from the last frame's neighbors */
+   long seeded;               /* number of searches bounded by the last frame's neighbors */
+   long searched;             /* number of searches made without a previous frame */
+};
+
+ap_TemporalCache* create_temporal_cache( int n_cells, int k, size_t vec_size );
+bool temporal_nearest_neighbor_search( ap_TemporalCache *cache, ap_Index *index, int cell, ap_Point *query, ap_PointList **out, PROXY_FUNC, DIST_FUNC );
+void reset_temporal_cache( ap_TemporalCache *cache );
+
+void free_temporal_cache( ap_TemporalCache *cache );
+
+#endif
@@ -0,0 +1,477 @@
+/* tileio.c
+ *
+ * Copyright (c) 2011, Jeffrey P. Gill
+ *
+ * This file is part of photomosaic.
+ *
+ * photomosaic is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * photomosaic is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with photomosaic.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>  /* assert */
+#include <errno.h>   /* errno, EAGAIN, EINTR, EINVAL */
+#include <fcntl.h>   /* open */
+#include <stdio.h>   /* fprintf */
+#include <stdlib.h>  /* NULL, exit, malloc */
+#include <string.h>  /* memset */
+#include <sys/mman.h> /* mmap, munmap */
+#include <sys/stat.h> /* fstat */
+#include <sys/syscall.h> /* __NR_io_uring_setup, __NR_io_uring_enter */
+#include <unistd.h>  /* syscall, pread, close */
+#include "tileio.h"
+#include "trace.h"
+
+#define min(a,b) ((a) < (b) ? (a) : (b))
+#define max(a,b) ((a) > (b) ? (a) : (b))
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+                    TILE READER FUNCTIONS
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+
+// Create a reader that reads whole files and hands their
+// contents to n_workers decode threads, keeping at most
+// max_in_flight files being read or waiting to be decoded
+// so that memory stays bounded. Reads are issued in batches
+// through io_uring if allow_uring is true and the kernel
+// permits it, and by a pool of blocking reader threads
+// otherwise.
+ap_TileReader*
+create_tile_reader( int max_in_flight, int n_workers, bool allow_uring ) {
+
+   // Create the new ap_TileReader
+   ap_TileReader *reader = malloc( sizeof( ap_TileReader ) );
+   assert( reader );
+   reader->max_in_flight = max( max_in_flight, 1 );
+   reader->n_workers = max( n_workers, 1 );
+   reader->uring = allow_uring && tile_ring_setup( &reader->ring, min( reader->max_in_flight, TILEIO_RING_ENTRIES ) );
+   pthread_mutex_init( &reader->lock, NULL );
+   pthread_cond_init( &reader->ready, NULL );
+   pthread_cond_init( &reader->freed, NULL );
+
+   return reader;
+}
+
+
+// Read every file in paths and call decode on a decode
+// thread with the index of each file in paths and its
+// contents. For a file that could not be read, data is NULL
+// and size is 0. decode may be called concurrently from
+// several threads, in any order, and the data is freed when
+// it returns. Returns the number of files read
+// successfully.
+int
+tile_reader_run( ap_TileReader *reader, const char **paths, int n_paths, void *arg, TILE_FUNC ) {
+
+   int i, n_readers = 0;
+   pthread_t workers[reader->n_workers], readers[TILEIO_READERS];
+
+   reader->paths = paths;
+   reader->n_paths = n_paths;
+   reader->next = 0;
+   reader->in_flight = 0;
+   reader->n_read = 0;
+   reader->done = false;
+   reader->head = reader->tail = NULL;
+   reader->arg = arg;
+   reader->decode = decode;
+
+   for( i = 0; i < reader->n_workers; i++ ) {
+      if( pthread_create( &workers[i], NULL, tile_decode_worker, reader ) != 0 ) {
+         fprintf( stderr, "tile_reader_run: failed to create thread\n" );
+         exit( EXIT_FAILURE );
+      }
+   }
+
+   // Issue the reads from this thread through io_uring, or
+   // from a pool of reader threads
+   if( reader->uring ) {
+      tile_reader_run_uring( reader );
+   } else {
+      n_readers = min( TILEIO_READERS, max( n_paths, 1 ) );
+      for( i = 0; i < n_readers; i++ ) {
+         if( pthread_create( &readers[i], NULL, tile_read_worker, reader ) != 0 ) {
+            fprintf( stderr, "tile_reader_run: failed to create thread\n" );
+            exit( EXIT_FAILURE );
+         }
+      }
+      for( i = 0; i < n_readers; i++ )
+         pthread_join( readers[i], NULL );
+   }
+
+   // Let the decode threads finish the queue and exit
+   pthread_mutex_lock( &reader->lock );
+   reader->done = true;
+   pthread_cond_broadcast( &reader->ready );
+   pthread_mutex_unlock( &reader->lock );
+   for( i = 0; i < reader->n_workers; i++ )
+      pthread_join( workers[i], NULL );
+
+   return reader->n_read;
+}
+
+
+// Read every file of the current run through io_uring.
+// Files are opened and sized here, then their reads are
+// queued in the ring and submitted together with a single
+// system call that also waits for completions, so the
+// kernel works on up to TILEIO_RING_ENTRIES reads at once.
+// Short reads are resubmitted for the remainder, and reads
+// the kernel does not support through io_uring are done
+// with pread instead.
+void
+tile_reader_run_uring( ap_TileReader *reader ) {
+
+   int index = 0, in_ring = 0, n;
+   unsigned head, tail, to_submit = 0;
+   bool room;
+   ap_TileRead *read;
+   ap_TileRing *ring = &reader->ring;
+
+   while( index < reader->n_paths || in_ring > 0 ) {
+
+      // Queue reads while the ring and the in-flight limit
+      // allow, waiting for decode threads to free a slot only
+      // if nothing is in the ring to wait for instead
+      while( index < reader->n_paths && in_ring < (int)ring->entries ) {
+         pthread_mutex_lock( &reader->lock );
+         while( in_ring == 0 && reader->in_flight >= reader->max_in_flight )
+            pthread_cond_wait( &reader->freed, &reader->lock );
+         room = reader->in_flight < reader->max_in_flight;
+         if( room )
+            reader->in_flight++;
+         pthread_mutex_unlock( &reader->lock );
+         if( !room )
+            break;
+
+         read = tile_open( reader, index++ );
+         if( read->fd < 0 || read->size == 0 ) {
+            tile_push( reader, read, read->fd >= 0 );
+            continue;
+         }
+         tile_ring_prep_read( ring, read );
+         in_ring++;
+         to_submit++;
+      }
+      if( in_ring == 0 )
+         continue;
+
+      // Submit the queued reads and wait for at least one to
+      // complete
+      double start = trace_begin();
+      n = tile_ring_enter( ring, to_submit, 1 );
+      trace_end( "io", "io_uring_enter", start );
+      if( n < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY ) {
+         fprintf( stderr, "tile_reader_run_uring: io_uring_enter failed\n" );
+         exit( EXIT_FAILURE );
+      }
+      if( n > 0 )
+         to_submit -= n;
+
+      // Collect the completed reads
+      head = *ring->cq_head;
+      tail = __atomic_load_n( ring->cq_tail, __ATOMIC_ACQUIRE );
+      for( ; head != tail; head++ ) {
+         struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+         read = (ap_TileRead*)(uintptr_t)cqe->user_data;
+         if( cqe->res == -EINTR || cqe->res == -EAGAIN ) {
+            tile_ring_prep_read( ring, read );
+            to_submit++;
+         } else if( cqe->res == -EINVAL || cqe->res == -EOPNOTSUPP ) {
+            tile_push( reader, read, tile_read_blocking( read ) );
+            in_ring--;
+         } else if( cqe->res <= 0 ) {
+            tile_push( reader, read, false );
+            in_ring--;
+         } else if( ( read->done += cqe->res ) < read->size ) {
+            tile_ring_prep_read( ring, read );
+            to_submit++;
+         } else {
+            tile_push( reader, read, true );
+            in_ring--;
+         }
+      }
+      __atomic_store_n( ring->cq_head, head, __ATOMIC_RELEASE );
+   }
+}
+
+
+// Read files of the current run with blocking system calls
+// until none are left. Several of these threads run at once
+// when io_uring is unavailable.
+void*
+tile_read_worker( void *arg ) {
+
+   int index;
+   double start;
+   ap_TileRead *read;
+   ap_TileReader *reader = arg;
+
+   while( true ) {
+      start = trace_begin();
+      pthread_mutex_lock( &reader->lock );
+      while( reader->in_flight >= reader->max_in_flight && reader->next < reader->n_paths )
+         pthread_cond_wait( &reader->freed, &reader->lock );
+      trace_end( "io", "wait_for_slot", start );
+      if( reader->next >= reader->n_paths ) {
+         pthread_mutex_unlock( &reader->lock );
+         break;
+      }
+      index = reader->next++;
+      reader->in_flight++;
+      pthread_mutex_unlock( &reader->lock );
+
+      start = trace_begin();
+      read = tile_open( reader, index );
+      tile_push( reader, read, read->fd >= 0 && tile_read_blocking( read ) );
+      trace_end( "io", "read_tile", start );
+   }
+
+   return NULL;
+}
+
+
+// Decode completed reads as they arrive until the run ends
+// and the queue is empty
+void*
+tile_decode_worker( void *arg ) {
+
+   double start;
+   ap_TileRead *read;
+   ap_TileReader *reader = arg;
+
+   while( true ) {
+      start = trace_begin();
+      pthread_mutex_lock( &reader->lock );
+      while( reader->head == NULL && !reader->done )
+         pthread_cond_wait( &reader->ready, &reader->lock );
+      trace_end( "io", "wait_for_read", start );
+      read = reader->head;
+      if( read == NULL ) {
+         pthread_mutex_unlock( &reader->lock );
+         break;
+      }
+      reader->head = read->next;
+      if( reader->head == NULL )
+         reader->tail = NULL;
+      pthread_mutex_unlock( &reader->lock );
+
+      start = trace_begin();
+      reader->decode( read->index, read->data, read->size, reader->arg );
+      trace_end( "io", "decode_tile", start );
+      free( read->data );
+      free( read );
+
+      pthread_mutex_lock( &reader->lock );
+      reader->in_flight--;
+      pthread_cond_broadcast( &reader->freed );
+      pthread_mutex_unlock( &reader->lock );
+   }
+
+   return NULL;
+}
+
+
+// Open the file at the given index of the current run and
+// allocate a buffer for its contents. If the file cannot be
+// opened, the read's fd is -1.
+ap_TileRead*
+tile_open( ap_TileReader *reader, int index ) {
+
+   struct stat st;
+
+   ap_TileRead *read = malloc( sizeof( ap_TileRead ) );
+   assert( read );
+   read->index = index;
+   read->data = NULL;
+   read->size = read->done = 0;
+   read->next = NULL;
+   read->fd = open( reader->paths[index], O_RDONLY | O_CLOEXEC );
+   if( read->fd >= 0 && fstat( read->fd, &st ) != 0 ) {
+      close( read->fd );
+      read->fd = -1;
+   }
+   if( read->fd >= 0 ) {
+      read->size = st.st_size;
+      read->data = malloc( max( read->size, 1 ) );
+      assert( read->data );
+   }
+
+   return read;
+}
+
+
+// Close a finished read's file and queue it for the decode
+// threads, discarding its buffer if it failed
+void
+tile_push( ap_TileReader *reader, ap_TileRead *read, bool ok ) {
+
+   if( read->fd >= 0 )
+      close( read->fd );
+   read->fd = -1;
+   if( !ok ) {
+      free( read->data );
+      read->data = NULL;
+      read->size = 0;
+   }
+
+   pthread_mutex_lock( &reader->lock );
+   if( reader->tail != NULL )
+      reader->tail->next = read;
+   else
+      reader->head = read;
+   reader->tail = read;
+   if( ok )
+      reader->n_read++;
+   pthread_cond_signal( &reader->ready );
+   pthread_mutex_unlock( &reader->lock );
+}
+
+
+// Read the rest of an open file with blocking system calls.
+// Returns true if the whole file was read, or false
+// otherwise.
+bool
+tile_read_blocking( ap_TileRead *read ) {
+
+   ssize_t n;
+
+   while( read->done < read->size ) {
+      n = pread( read->fd, read->data + read->done, read->size - read->done, read->done );
+      if( n < 0 && errno == EINTR )
+         continue;
+      if( n <= 0 )
+         return false;
+      read->done += n;
+   }
+
+   return true;
+}
+
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+                     IO_URING FUNCTIONS
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+
+// Create an io_uring instance with room for the given number
+// of submissions and map its rings, using the system calls
+// directly so no library is needed. Returns false if the
+// kernel does not provide io_uring or forbids it.
+bool
+tile_ring_setup( ap_TileRing *ring, unsigned entries ) {
+
+   struct io_uring_params params;
+
+   memset( &params, 0, sizeof( params ) );
+   ring->fd = syscall( __NR_io_uring_setup, entries, &params );
+   if( ring->fd < 0 )
+      return false;
+
+   ring->entries = params.sq_entries;
+   ring->sq_map_size = params.sq_off.array + params.sq_entries * sizeof( unsigned );
+   ring->cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof( struct io_uring_cqe );
+   if( params.features & IORING_FEAT_SINGLE_MMAP )
+      ring->sq_map_size = ring->cq_map_size = max( ring->sq_map_size, ring->cq_map_size );
+   ring->sqes_size = params.sq_entries * sizeof( struct io_uring_sqe );
+
+   ring->sq_map = mmap( NULL, ring->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING );
+   ring->cq_map = params.features & IORING_FEAT_SINGLE_MMAP ? ring->sq_map :
+      mmap( NULL, ring->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING );
+   ring->sqes = mmap( NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES );
+   if( ring->sq_map == MAP_FAILED || ring->cq_map == MAP_FAILED || ring->sqes == MAP_FAILED ) {
+      if( ring->sqes != MAP_FAILED )
+         munmap( ring->sqes, ring->sqes_size );
+      if( ring->cq_map != MAP_FAILED && ring->cq_map != ring->sq_map )
+         munmap( ring->cq_map, ring->cq_map_size );
+      if( ring->sq_map != MAP_FAILED )
+         munmap( ring->sq_map, ring->sq_map_size );
+      close( ring->fd );
+      return false;
+   }
+
+   ring->sq_head = (unsigned*)( (char*)ring->sq_map + params.sq_off.head );
+   ring->sq_tail = (unsigned*)( (char*)ring->sq_map + params.sq_off.tail );
+   ring->sq_mask = (unsigned*)( (char*)ring->sq_map + params.sq_off.ring_mask );
+   ring->sq_array = (unsigned*)( (char*)ring->sq_map + params.sq_off.array );
+   ring->cq_head = (unsigned*)( (char*)ring->cq_map + params.cq_off.head );
+   ring->cq_tail = (unsigned*)( (char*)ring->cq_map + params.cq_off.tail );
+   ring->cq_mask = (unsigned*)( (char*)ring->cq_map + params.cq_off.ring_mask );
+   ring->cqes = (struct io_uring_cqe*)( (char*)ring->cq_map + params.cq_off.cqes );
+
+   return true;
+}
+
+
+// Queue a read of the rest of a file in the submission
+// ring. The caller must ensure the ring has room.
+void
+tile_ring_prep_read( ap_TileRing *ring, ap_TileRead *read ) {
+
+   unsigned tail = *ring->sq_tail;
+   unsigned slot = tail & *ring->sq_mask;
+   struct io_uring_sqe *sqe = &ring->sqes[slot];
+
+   memset( sqe, 0, sizeof( struct io_uring_sqe ) );
+   sqe->opcode = IORING_OP_READ;
+   sqe->fd = read->fd;
+   sqe->addr = (uintptr_t)( read->data + read->done );
+   sqe->len = read->size - read->done;
+   sqe->off = read->done;
+   sqe->user_data = (uintptr_t)read;
+   ring->sq_array[slot] = slot;
+   __atomic_store_n( ring->sq_tail, tail + 1, __ATOMIC_RELEASE );
+}
+
+
+// Submit queued reads and wait for at least min_complete of
+// them to complete. Returns the number of reads submitted,
+// or -1 with errno set if the system call failed.
+int
+tile_ring_enter( ap_TileRing *ring, unsigned to_submit, unsigned min_complete ) {
+
+   return syscall( __NR_io_uring_enter, ring->fd, to_submit, min_complete, min_complete > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0 );
+}
+
+
+// Unmap the rings and close the io_uring instance
+void
+tile_ring_free( ap_TileRing *ring ) {
+
+   munmap( ring->sqes, ring->sqes_size );
+   if( ring->cq_map != ring->sq_map )
+      munmap( ring->cq_map, ring->cq_map_size );
+   munmap( ring->sq_map, ring->sq_map_size );
+   close( ring->fd );
+}
+
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+                   MEMORY FREEING FUNCTIONS
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+
+// Free the reader and its io_uring instance
+void
+free_tile_reader( ap_TileReader *reader ) {
+
+   if( reader->uring )
+      tile_ring_free( &reader->ring );
+   pthread_mutex_destroy( &reader->lock );
+   pthread_cond_destroy( &reader->ready );
+   pthread_cond_destroy( &reader->freed );
+   free( reader );
+}
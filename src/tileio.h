@@ -0,0 +1,94 @@
+/* tileio.h
+ *
+ * Copyright (c) 2011, Jeffrey P. Gill
+ *
+ * This file is part of photomosaic.
+ *
+ * photomosaic is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * photomosaic is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with photomosaic.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TILEIO_H
+#define TILEIO_H
+
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define TILE_FUNC void (*decode)( int index, uint8_t *data, size_t size, void *arg )
+
+#define TILEIO_RING_ENTRIES 64   /* largest number of reads submitted to io_uring at once */
+#define TILEIO_READERS 16        /* number of reader threads used when io_uring is unavailable */
+
+typedef struct ap_TileRead ap_TileRead;
+typedef struct ap_TileRing ap_TileRing;
+typedef struct ap_TileReader ap_TileReader;
+
+struct ap_TileRead {
+   int index;                 /* position of the file in the list of paths */
+   int fd;                    /* open file being read, or -1 once closed */
+   uint8_t *data;             /* contents of the file */
+   size_t size;               /* number of bytes in the file */
+   size_t done;               /* number of bytes read so far */
+   ap_TileRead *next;         /* next completed read waiting to be decoded */
+};
+
+struct ap_TileRing {
+   int fd;                    /* io_uring instance */
+   unsigned entries;          /* number of submission queue entries */
+   unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;  /* submission queue ring */
+   struct io_uring_sqe *sqes; /* submission queue entries */
+   unsigned *cq_head, *cq_tail, *cq_mask;  /* completion queue ring */
+   struct io_uring_cqe *cqes; /* completion queue entries */
+   void *sq_map, *cq_map;     /* mapped rings, which may be the same mapping */
+   size_t sq_map_size, cq_map_size, sqes_size;  /* sizes of the mappings */
+};
+
+struct ap_TileReader {
+   int max_in_flight;         /* largest number of files being read or waiting to be decoded */
+   int n_workers;             /* number of decode threads */
+   bool uring;                /* whether reads go through io_uring rather than reader threads */
+   ap_TileRing ring;          /* if uring, the io_uring instance */
+   const char **paths;        /* files being read by the current run */
+   int n_paths;               /* number of files being read by the current run */
+   int next;                  /* index of the next file to read, for reader threads */
+   int in_flight;             /* number of files being read or waiting to be decoded */
+   int n_read;                /* number of files read successfully by the current run */
+   bool done;                 /* whether every file of the current run has been read */
+   ap_TileRead *head, *tail;  /* queue of completed reads waiting to be decoded */
+   pthread_mutex_t lock;      /* protects the fields above that are shared between threads */
+   pthread_cond_t ready;      /* signaled when a read completes or the run ends */
+   pthread_cond_t freed;      /* signaled when a file has been decoded */
+   void *arg;                 /* argument passed to decode */
+   void (*decode)( int index, uint8_t *data, size_t size, void *arg );  /* decode function */
+};
+
+ap_TileReader* create_tile_reader( int max_in_flight, int n_workers, bool allow_uring );
+int tile_reader_run( ap_TileReader *reader, const char **paths, int n_paths, void *arg, TILE_FUNC );
+void tile_reader_run_uring( ap_TileReader *reader );
+void* tile_read_worker( void *arg );
+void* tile_decode_worker( void *arg );
+ap_TileRead* tile_open( ap_TileReader *reader, int index );
+void tile_push( ap_TileReader *reader, ap_TileRead *read, bool ok );
+bool tile_read_blocking( ap_TileRead *read );
+
+bool tile_ring_setup( ap_TileRing *ring, unsigned entries );
+void tile_ring_prep_read( ap_TileRing *ring, ap_TileRead *read );
+int tile_ring_enter( ap_TileRing *ring, unsigned to_submit, unsigned min_complete );
+void tile_ring_free( ap_TileRing *ring );
+
+void free_tile_reader( ap_TileReader *reader );
+
+#endif
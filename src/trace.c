@@ -0,0 +1,199 @@
+/* trace.c
+ *
+ * Copyright (c) 2011, Jeffrey P. Gill
+ *
+ * This file is part of photomosaic.
+ *
+ * photomosaic is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * photomosaic is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with photomosaic.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>  /* assert */
+#include <pthread.h> /* pthread_mutex_lock */
+#include <stdio.h>   /* fopen, fprintf */
+#include <stdlib.h>  /* NULL, malloc, realloc */
+#include <time.h>    /* clock_gettime */
+#include <unistd.h>  /* getpid */
+#include "trace.h"
+
+bool trace_enabled = false;            /* whether events are being recorded */
+double trace_epoch = 0;                /* clock reading when the trace started */
+int trace_generation = 0;              /* number of traces started, so threads notice stale buffers */
+int trace_threads = 0;                 /* number of threads that have recorded an event */
+ap_TraceBuffer *trace_buffers = NULL;  /* buffers of every thread, most recent first */
+pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;  /* guards the list of buffers */
+
+__thread ap_TraceBuffer *trace_buffer = NULL;  /* this thread's buffer */
+__thread int trace_buffer_generation = 0;      /* trace this thread's buffer belongs to */
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+                    RECORDING FUNCTIONS
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+
+// Discard any events recorded so far and start recording
+// phases. Timestamps are relative to this call.
+void
+start_trace( void ) {
+
+   free_trace();
+   pthread_mutex_lock( &trace_lock );
+   trace_generation++;
+   trace_epoch = trace_clock();
+   trace_enabled = true;
+   pthread_mutex_unlock( &trace_lock );
+}
+
+
+// Return the time at which a phase begins, to be passed to
+// trace_end once it is over. When tracing is off, the clock
+// is not read.
+double
+trace_begin( void ) {
+
+   return trace_enabled ? trace_clock() : 0;
+}
+
+
+// Record a phase that began at start (as returned by
+// trace_begin) and ends now in the calling thread's buffer.
+// The category and name are not copied, so they should be
+// string literals.
+void
+trace_end( const char *category, const char *name, double start ) {
+
+   if( !trace_enabled )
+      return;
+
+   double end = trace_clock();
+   ap_TraceBuffer *buffer = trace_thread_buffer();
+
+   if( buffer->size == buffer->capacity ) {
+      buffer->capacity += TRACE_BUFFER_SIZE;
+      buffer->events = realloc( buffer->events, buffer->capacity * sizeof( ap_TraceEvent ) );
+      assert( buffer->events );
+   }
+
+   ap_TraceEvent *event = &(buffer->events[buffer->size++]);
+   event->category = category;
+   event->name = name;
+   event->start = start - trace_epoch;
+   event->duration = end - start;
+}
+
+
+// Return the calling thread's buffer, creating and
+// registering it if the thread has not recorded an event
+// since the trace started. Only registration takes the
+// lock; recording into the buffer does not.
+ap_TraceBuffer*
+trace_thread_buffer( void ) {
+
+   if( trace_buffer != NULL && trace_buffer_generation == trace_generation )
+      return trace_buffer;
+
+   ap_TraceBuffer *buffer = malloc( sizeof( ap_TraceBuffer ) );
+   assert( buffer );
+   buffer->size = 0;
+   buffer->capacity = 0;
+   buffer->events = NULL;
+
+   pthread_mutex_lock( &trace_lock );
+   buffer->tid = trace_threads++;
+   buffer->next = trace_buffers;
+   trace_buffers = buffer;
+   trace_buffer_generation = trace_generation;
+   pthread_mutex_unlock( &trace_lock );
+
+   trace_buffer = buffer;
+   return buffer;
+}
+
+
+// Return the time in seconds from a monotonic clock
+double
+trace_clock( void ) {
+
+   struct timespec ts;
+   clock_gettime( CLOCK_MONOTONIC, &ts );
+   return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+                     EXPORT FUNCTIONS
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+
+// Write every recorded event to path in the Chrome trace
+// event format, as complete events with microsecond
+// timestamps, so that the trace can be loaded in a trace
+// viewer such as chrome://tracing or Perfetto. Each thread
+// is named after the order in which it first recorded an
+// event. No thread may be recording while the trace is
+// written. Returns false if the file cannot be written.
+bool
+write_trace( const char *path ) {
+
+   int i;
+   ap_TraceBuffer *buffer;
+   ap_TraceEvent *event;
+   const char *separator = "";
+
+   FILE *file = fopen( path, "w" );
+   if( file == NULL )
+      return false;
+
+   int pid = getpid();
+   fprintf( file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[" );
+   pthread_mutex_lock( &trace_lock );
+   for( buffer = trace_buffers; buffer != NULL; buffer = buffer->next ) {
+      fprintf( file, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"thread %d\"}}", separator, pid, buffer->tid, buffer->tid );
+      separator = ",";
+      for( i = 0; i < buffer->size; i++ ) {
+         event = &(buffer->events[i]);
+         fprintf( file, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                  event->name, event->category, pid, buffer->tid, event->start * 1e6, event->duration * 1e6 );
+      }
+   }
+   pthread_mutex_unlock( &trace_lock );
+   fprintf( file, "\n]}\n" );
+
+   return fclose( file ) == 0;
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+               MEMORY MANAGEMENT FUNCTIONS
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+
+// Stop recording and free the buffers of every thread. No
+// thread may be recording while they are freed.
+void
+free_trace( void ) {
+
+   ap_TraceBuffer *buffer;
+
+   pthread_mutex_lock( &trace_lock );
+   trace_enabled = false;
+   while( trace_buffers != NULL ) {
+      buffer = trace_buffers;
+      trace_buffers = buffer->next;
+      free( buffer->events );
+      free( buffer );
+   }
+   trace_threads = 0;
+   pthread_mutex_unlock( &trace_lock );
+}
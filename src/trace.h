@@ -0,0 +1,58 @@
+/* trace.h
+ *
+ * Copyright (c) 2011, Jeffrey P. Gill
+ *
+ * This file is part of photomosaic.
+ *
+ * photomosaic is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * photomosaic is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with photomosaic.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+
+#define TRACE_BUFFER_SIZE 4096   /* number of events a thread's buffer grows by */
+#define TRACE_ENV "PHOTOMOSAIC_TRACE"  /* environment variable naming the file a trace is written to */
+
+typedef struct ap_TraceEvent ap_TraceEvent;
+typedef struct ap_TraceBuffer ap_TraceBuffer;
+
+struct ap_TraceEvent {
+   const char *category;      /* group of phases the event belongs to, a string literal */
+   const char *name;          /* name of the phase, a string literal */
+   double start;              /* seconds since the trace started */
+   double duration;           /* seconds the phase lasted */
+};
+
+struct ap_TraceBuffer {
+   int tid;                   /* number of the thread recording into the buffer, in order of its first event */
+   int size;                  /* number of events recorded */
+   int capacity;              /* number of events allocated */
+   ap_TraceEvent *events;     /* array of events in the order they ended */
+   ap_TraceBuffer *next;      /* buffer of the thread that recorded its first event before this one */
+};
+
+extern bool trace_enabled;
+
+void start_trace( void );
+double trace_begin( void );
+void trace_end( const char *category, const char *name, double start );
+ap_TraceBuffer* trace_thread_buffer( void );
+double trace_clock( void );
+bool write_trace( const char *path );
+
+void free_trace( void );
+
+#endif